@@ -47,8 +47,22 @@ if nargin < 3
   eval([mexcmd(opt, verb) ' gdetect/dt.cc']);
   eval([mexcmd(opt, verb) ' gdetect/fast_bounded_dt.cc']);
   eval([mexcmd(opt, verb) ' gdetect/get_detection_trees.cc']);
+  eval([mexcmd(opt, verb) ' gdetect/detection_candidates.cc']);
   eval([mexcmd(opt, verb) ' gdetect/compute_overlap.cc']);
+  eval([mexcmd(opt, verb) ' gdetect/compute_overlaps_mex.cc']);
+  eval([mexcmd(opt, verb) ' gdetect/loss_pyramid_mex.cc']);
   eval([mexcmd(opt, verb) ' gdetect/post_pad.cc']);
+  eval([mexcmd(opt, verb) ' gdetect/struct_rule_score.cc']);
+  eval([mexcmd(opt, verb) ' test/nms_mex.cc']);
+  eval([mexcmd(opt, verb) ' test/detlog.cc']);
+  % Native dynamic programming (used by gdetect_dp.m if available)
+  try
+    eval([mexcmd(opt, verb) ' gdetect/gdetect_dp_mex.cc']);
+  catch e
+    % gdetect_dp_mex keeps a persistent workspace and locks itself
+    % (see fv_cache/fv_compile.m)
+    warning(e.identifier, 'Maybe you need to call gdetect_dp_mex(''unlock'') first?');
+  end
 
   % obsolete bounded dt algorithm & implementation
   %eval([mexcmd(opt, verb) ' CXXFLAGS="\$CXXFLAGS -DNUM_THREADS=0" gdetect/bounded_dt.cc']);
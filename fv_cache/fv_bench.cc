@@ -0,0 +1,183 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "model.h"
+#include <omp.h>
+#include <cstdlib>
+
+/*
+ * Microbenchmark for model::score_fv.
+ *
+ * Builds a synthetic cache with a model shaped like a mixture of star
+ * models (per component: a bias, a root filter and 8 part filters of
+ * 6x6x32 plus their 4-dim deformations) and one feature vector per
+ * entry, each using all blocks of a random component. The cache is
+ * scored repeatedly with score_fv (SSE2 dot_block) and with the
+ * plain scalar loop it replaced.
+ *
+ * Usage:
+ *   [t_simd, t_scalar, rel_diff] = fv_bench(num_entries, reps, storage)
+ *
+ *   num_entries  Number of cache entries (default: 20000)
+ *   reps         Number of passes over the cache (default: 10)
+ *   storage      'single' or 'half' (default: 'single')
+ *
+ *   t_simd       Seconds per pass with score_fv
+ *   t_scalar     Seconds per pass with the scalar loop
+ *   rel_diff     Largest relative difference between the two scores
+ */
+
+// Only the storage format is used by score_fv; the memory pools and
+// the rest of the cache live in fv_cache.cc and are not needed here.
+int fv::storage = fv::STORE_SINGLE;
+
+static const int num_components = 6;
+static const int num_parts      = 8;
+static const int filter_dim     = 6*6*32;
+static const int def_dim        = 4;
+static const int blocks_per_comp = 2 + 2*num_parts;
+
+
+/** -----------------------------------------------------------------
+ ** Reference scalar scorer (score_fv before dot_block)
+ **/
+static double score_scalar(const model &M, const fv &f) {
+  double val = 0.0;
+  if (fv::storage == fv::STORE_HALF) {
+    const half_t *feat = (const half_t *)f.feat;
+    for (int j = 0; j < f.num_blocks; j++) {
+      const int b = f.block_labels[j];
+      const double *wb = M.w[b];
+      for (int k = 0; k < M.block_sizes[b]; k++)
+        val += wb[k] * half_to_float(feat[k]);
+      feat += M.block_sizes[b];
+    }
+  } else {
+    const float *feat = f.feat;
+    for (int j = 0; j < f.num_blocks; j++) {
+      const int b = f.block_labels[j];
+      const double *wb = M.w[b];
+      for (int k = 0; k < M.block_sizes[b]; k++)
+        val += wb[k] * feat[k];
+      feat += M.block_sizes[b];
+    }
+  }
+  return val;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Uniform random number in [-1, 1]
+ **/
+static inline double urand() {
+  return 2.0 * rand() / RAND_MAX - 1.0;
+}
+
+
+/** -----------------------------------------------------------------
+ ** matlab entry point
+ **/
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  const int num_entries = (nrhs > 0) ? (int)mxGetScalar(prhs[0]) : 20000;
+  const int reps        = (nrhs > 1) ? (int)mxGetScalar(prhs[1]) : 10;
+  fv::storage = fv::STORE_SINGLE;
+  if (nrhs > 2) {
+    char *s = mxArrayToString(prhs[2]);
+    if (s != NULL && string(s).compare("half") == 0)
+      fv::storage = fv::STORE_HALF;
+    else if (s == NULL || string(s).compare("single") != 0)
+      mexErrMsgTxt("Unknown storage format (use 'single' or 'half').");
+    mxFree(s);
+  }
+  if (num_entries < 1 || reps < 1)
+    mexErrMsgTxt("num_entries and reps must be positive.");
+
+  srand(0);
+
+  // Synthetic model
+  model M;
+  M.num_blocks  = num_components * blocks_per_comp;
+  M.block_sizes = new int[M.num_blocks];
+  M.w           = new double*[M.num_blocks];
+  for (int b = 0; b < M.num_blocks; b++) {
+    const int i = b % blocks_per_comp;
+    M.block_sizes[b] = (i == 0) ? 1 : (i <= 1 + num_parts) ? filter_dim
+                                                           : def_dim;
+    M.w[b] = new double[M.block_sizes[b]];
+    for (int k = 0; k < M.block_sizes[b]; k++)
+      M.w[b][k] = 0.01 * urand();
+  }
+  const int comp_dim = 1 + (1 + num_parts)*filter_dim + num_parts*def_dim;
+
+  // Synthetic cache: features are stored back to back in a single
+  // buffer (in the current storage format) rather than in feat_pool
+  const int words_dim = fv::storage_dim(comp_dim);
+  vector<float> feat_buf((size_t)num_entries * words_dim);
+  vector<int> bls_buf((size_t)num_entries * blocks_per_comp);
+  vector<float> src(comp_dim);
+  vector<fv> F(num_entries);
+  for (int i = 0; i < num_entries; i++) {
+    const int c = rand() % num_components;
+    fv &f = F[i];
+    f.num_blocks   = blocks_per_comp;
+    f.feat_dim     = comp_dim;
+    f.feat         = &feat_buf[(size_t)i * words_dim];
+    f.block_labels = &bls_buf[(size_t)i * blocks_per_comp];
+    for (int j = 0; j < blocks_per_comp; j++)
+      f.block_labels[j] = c*blocks_per_comp + j;
+    for (int k = 0; k < comp_dim; k++)
+      src[k] = (float)urand();
+    f.store_feat(&src[0]);
+  }
+
+  // Time both scorers; the sums keep the loops from being optimized
+  // away and give the relative difference
+  vector<double> s_simd(num_entries), s_scalar(num_entries);
+
+  double t0 = omp_get_wtime();
+  for (int r = 0; r < reps; r++)
+    for (int i = 0; i < num_entries; i++)
+      s_simd[i] = M.score_fv(F[i]);
+  const double t_simd = (omp_get_wtime() - t0) / reps;
+
+  t0 = omp_get_wtime();
+  for (int r = 0; r < reps; r++)
+    for (int i = 0; i < num_entries; i++)
+      s_scalar[i] = score_scalar(M, F[i]);
+  const double t_scalar = (omp_get_wtime() - t0) / reps;
+
+  double rel_diff = 0;
+  for (int i = 0; i < num_entries; i++) {
+    const double d = fabs(s_simd[i] - s_scalar[i])
+                     / max(fabs(s_scalar[i]), 1e-12);
+    rel_diff = max(rel_diff, d);
+  }
+
+  const double mb = (double)num_entries * words_dim * sizeof(float) / 1e6;
+  mexPrintf("fv_bench: %d entries (%.1f MB, %s), %d reps\n", num_entries,
+            mb, (fv::storage == fv::STORE_HALF) ? "half" : "single", reps);
+  mexPrintf("  score_fv  %9.3f ms/pass  %7.1f MB/s\n", 1e3*t_simd,
+            mb / t_simd);
+  mexPrintf("  scalar    %9.3f ms/pass  %7.1f MB/s\n", 1e3*t_scalar,
+            mb / t_scalar);
+  mexPrintf("  speedup %.2fx, max rel. diff %g\n", t_scalar / t_simd,
+            rel_diff);
+
+  if (nlhs > 0)
+    plhs[0] = mxCreateDoubleScalar(t_simd);
+  if (nlhs > 1)
+    plhs[1] = mxCreateDoubleScalar(t_scalar);
+  if (nlhs > 2)
+    plhs[2] = mxCreateDoubleScalar(rel_diff);
+
+  M.free();
+}
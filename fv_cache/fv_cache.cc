@@ -18,15 +18,17 @@
 #include <cmath>
 #include <csignal>
 #include <iostream>
+#include <map>
 
 using namespace std;
 
 /** -----------------------------------------------------------------
  ** Define fv_cache static members
- ** Memory pools for feature vectors (feat_pool) and block label 
- ** lists (block_label_pool)
+ ** Feature storage format, memory pools for feature vectors 
+ ** (feat_pool) and block label lists (block_label_pool)
  **/
-mempool<float> fv::feat_pool;
+int fv::storage = fv::STORE_SINGLE;
+sized_mempool<float> fv::feat_pool;
 mempool<int> fv::block_label_pool;
 
 
@@ -45,13 +47,33 @@ struct handler_registry {
 };
 
 
+/** -----------------------------------------------------------------
+ ** Per-example state kept between ex_free and the next ex_prepare
+ **/
+struct ex_state {
+  int key[fv::KEY_LEN];
+  uint64_t signature;
+  double margin_bound;
+  int hist;
+  int score_version;
+};
+
+
 /** -----------------------------------------------------------------
  ** Wrap (almost) all globals into one global context
  **/
 struct context {
   fv_cache F;
   ex_cache E;
+  // F[0 ... num_sorted-1] is sorted and free of duplicates; entries 
+  // after it were added since the last ex_prepare
+  int num_sorted;
+  // State of the examples of the last example cache (sorted by key)
+  vector<ex_state> saved_E;
+  // Optional block-columnar copy of the example cache
+  fv_layout L;
   model M;
+  gradient_buffers G;
   long long byte_size;
   bool model_is_set;
   bool cache_is_built;
@@ -60,6 +82,7 @@ struct context {
   struct sigaction act, matlab_act;
 
   context() {
+    num_sorted      = 0;
     byte_size       = 0;
     model_is_set    = false;
     cleanup_reg     = false;
@@ -104,15 +127,98 @@ static void print_fv_cache() {
 
 /** -----------------------------------------------------------------
  ** Free the example cache
+ ** The pruning state of each example is saved so that it can be 
+ ** restored by the next build_ex_cache() (must be called before F 
+ ** changes)
  **/
 static void free_ex_cache() {
+  if (gctx.cache_is_built) {
+    gctx.saved_E.resize(gctx.E.size());
+    for (int q = 0; q < (int)gctx.E.size(); q++) {
+      const ex &e = gctx.E[q];
+      ex_state &s = gctx.saved_E[q];
+      copy(e.begin->key, e.begin->key+fv::KEY_LEN, s.key);
+      s.signature     = e.signature;
+      s.margin_bound  = e.margin_bound;
+      s.hist          = e.hist;
+      s.score_version = e.score_version;
+    }
+  }
   gctx.E.clear();
+  gctx.L.free();
   gctx.cache_is_built = false;
 }
 
 
+/** -----------------------------------------------------------------
+ ** Sort [begin, end) with one std::sort per thread followed by 
+ ** rounds of pairwise merges (also done in parallel)
+ **/
+template<class T, class Compare>
+static void parallel_sort(T begin, T end, Compare cmp) {
+  const int n = end - begin;
+  const int num_chunks = omp_get_max_threads();
+  if (num_chunks < 2 || n < 4096*num_chunks) {
+    sort(begin, end, cmp);
+    return;
+  }
+
+  vector<int> bounds(num_chunks+1);
+  for (int c = 0; c <= num_chunks; c++)
+    bounds[c] = (int)(((long long)n * c) / num_chunks);
+
+  #pragma omp parallel for schedule(static, 1)
+  for (int c = 0; c < num_chunks; c++)
+    sort(begin + bounds[c], begin + bounds[c+1], cmp);
+
+  for (int width = 1; width < num_chunks; width *= 2) {
+    #pragma omp parallel for schedule(static, 1)
+    for (int c = 0; c < num_chunks; c += 2*width) {
+      if (c + width < num_chunks)
+        inplace_merge(begin + bounds[c], begin + bounds[c+width],
+                      begin + bounds[min(c + 2*width, num_chunks)], cmp);
+    }
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Restore the saved pruning state of e (if its feature vectors are
+ ** the same as when the state was saved)
+ ** saved points into gctx.saved_E and is advanced past e's key
+ **
+ ** Nothing is restored if e holds a new feature vector (is_new): its 
+ ** score has not been computed yet, and its is_belief flag and loss 
+ ** are not covered by the signature.
+ **/
+static void restore_ex_state(ex &e, bool has_new,
+                             vector<ex_state>::const_iterator &saved) {
+  vector<ex_state>::const_iterator saved_end = gctx.saved_E.end();
+  int c = 1;
+  while (saved != saved_end) {
+    c = 0;
+    for (int k = 0; k < fv::KEY_LEN && c == 0; k++)
+      c = (saved->key[k] < e.begin->key[k]) ? -1
+          : (saved->key[k] > e.begin->key[k]) ? 1 : 0;
+    if (c >= 0)
+      break;
+    ++saved;
+  }
+  if (!has_new && saved != saved_end && c == 0 
+      && saved->signature == e.signature) {
+    e.margin_bound  = saved->margin_bound;
+    e.hist          = saved->hist;
+    e.score_version = saved->score_version;
+  }
+}
+
+
 /** -----------------------------------------------------------------
  ** Construct the example cache from the feature vector cache
+ **
+ ** F[0 ... num_sorted-1] is already sorted, so only the entries added
+ ** since the last call are sorted and then merged into it. Examples 
+ ** whose feature vectors haven't changed keep their pruning state.
  **/
 static void build_ex_cache() {
   free_ex_cache();
@@ -126,11 +232,14 @@ static void build_ex_cache() {
     return;
   }
 
-  { // Sort cache entries
+  { // Sort new cache entries and merge them into the sorted entries
     mexPrintf("Sorting cache entries...");
-    sort(F.begin(), F.end(), fv::cmp_weak);
+    fv_iter mid = F.begin() + gctx.num_sorted;
+    parallel_sort(mid, F.end(), fv::cmp_weak);
+    inplace_merge(F.begin(), mid, F.end(), fv::cmp_weak);
     mexPrintf("done\n");
-    mexPrintf("Cache holds %d feature vectors\n", F.size());
+    mexPrintf("Cache holds %d feature vectors (%d new)\n", F.size(),
+              F.size() - gctx.num_sorted);
   }
 
   { // Mark uniqueness
@@ -153,35 +262,45 @@ static void build_ex_cache() {
         gctx.byte_size -= i->free();
     }
     F.erase(new_end, F.end());
+    gctx.num_sorted = F.size();
     mexPrintf("done\n");
     mexPrintf("Cache holds %d feature vectors\n", F.size());
   }
 
   { // Construct example cache index
     mexPrintf("Building example cache...");
+    vector<ex_state>::const_iterator saved = gctx.saved_E.begin();
     ex e;
-    e.begin = F.begin();
-    // State information for margin-bound pruning
-    e.hist = 0;
-    e.margin_bound = -1;
-    e.max_nonbelief_norm = (e.begin->is_belief) ? 0 : e.begin->norm;
-    e.belief_norm = (e.begin->is_belief) ? e.begin->norm : 0;
-    for (fv_iter i = e.begin+1; i != F.end(); ++i) {
-      if (fv::key_cmp(*(e.begin), *i) != 0) {
-        e.end = i;
-        E.push_back(e);
+    bool has_new = false;
+    for (fv_iter i = F.begin(); i != F.end(); ++i) {
+      if (i == F.begin() || fv::key_cmp(*(e.begin), *i) != 0) {
+        if (i != F.begin()) {
+          e.end = i;
+          restore_ex_state(e, has_new, saved);
+          E.push_back(e);
+        }
         e.begin = i;
-        e.max_nonbelief_norm = (i->is_belief) ? 0 : i->norm;
-        e.belief_norm = (i->is_belief) ? i->norm : 0;
-      } else {
-        if (i->is_belief)
-          e.belief_norm = i->norm;
-        else
-          e.max_nonbelief_norm = max(e.max_nonbelief_norm, i->norm);
+        has_new = false;
+        // State information for margin-bound pruning
+        e.hist = 0;
+        e.margin_bound = -1;
+        e.score_version = -1;
+        e.signature = 0;
+        e.max_nonbelief_norm = 0;
+        e.belief_norm = 0;
       }
+      if (i->is_belief)
+        e.belief_norm = i->norm;
+      else
+        e.max_nonbelief_norm = max(e.max_nonbelief_norm, i->norm);
+      e.signature += i->hash;
+      has_new = has_new || i->is_new;
+      i->is_new = false;
     }
     e.end = F.end();
+    restore_ex_state(e, has_new, saved);
     E.push_back(e);
+    gctx.saved_E.clear();
     mexPrintf("done\n");
     mexPrintf("Cache holds %d examples\n", E.size());
   }
@@ -190,20 +309,93 @@ static void build_ex_cache() {
 }
 
 
+/** -----------------------------------------------------------------
+ ** Build the block-columnar layout of the example cache (see 
+ ** fv_layout in fv_cache.h)
+ **/
+static void build_fv_layout() {
+  fv_cache &F = gctx.F;
+  ex_cache &E = gctx.E;
+  fv_layout &L = gctx.L;
+
+  mexPrintf("Building columnar layout...");
+  L.free();
+  L.base = F.begin();
+  L.group_of.assign(F.size(), -1);
+  L.row_of.assign(F.size(), -1);
+
+  // Assign each nonzero feature vector to the group of its block 
+  // labels
+  map<vector<int>, int> group_ids;
+  for (int q = 0; q < (int)E.size(); q++) {
+    for (fv_iter m = E[q].begin; m != E[q].end; ++m) {
+      if (m->is_zero)
+        continue;
+      vector<int> bls(m->block_labels, m->block_labels + m->num_blocks);
+      map<vector<int>, int>::iterator id = group_ids.find(bls);
+      if (id == group_ids.end()) {
+        id = group_ids.insert(make_pair(bls, (int)L.groups.size())).first;
+        L.groups.push_back(fv_group());
+        L.groups.back().block_labels = bls;
+        L.groups.back().dim = m->feat_dim;
+        L.groups.back().w_version = -1;
+      }
+      fv_group &g = L.groups[id->second];
+      checkM(m->feat_dim == g.dim, 
+             "Feature vectors with the same block labels differ in length");
+      L.group_of[m - L.base] = id->second;
+      L.row_of[m - L.base] = g.rows.size();
+      g.rows.push_back(m);
+      g.exs.push_back(q);
+    }
+  }
+
+  // Copy the features into the group matrices and split the groups 
+  // into chunks of rows
+  const int num_groups = L.groups.size();
+  const int chunk_rows = 128;
+  for (int k = 0; k < num_groups; k++) {
+    fv_group &g = L.groups[k];
+    const int num_rows = g.rows.size();
+    g.X.resize((uint64_t)num_rows * g.dim);
+    g.coef.assign(num_rows, 0.0);
+    for (int begin = 0; begin < num_rows; begin += chunk_rows) {
+      fv_layout::chunk c = { k, begin, min(begin + chunk_rows, num_rows) };
+      L.chunks.push_back(c);
+    }
+  }
+  #pragma omp parallel for schedule(dynamic)
+  for (int k = 0; k < num_groups; k++) {
+    fv_group &g = L.groups[k];
+    for (int r = 0; r < (int)g.rows.size(); r++)
+      g.rows[r]->load_feat(&g.X[(uint64_t)r * g.dim]);
+  }
+
+  L.is_built = true;
+  mexPrintf("done\n");
+  mexPrintf("Columnar layout holds %d groups (%.1fMB)\n", num_groups,
+            L.byte_size()/(1024.0*1024.0));
+}
+
+
 /** -----------------------------------------------------------------
  ** Free all allocated memory. Resets the feature vector cache, 
  ** example cache, and model.
  **/
 static void free_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  free_ex_cache();
+  gctx.saved_E.clear();
+
   for (fv_iter i = gctx.F.begin(), i_end = gctx.F.end(); i != i_end; ++i)
     gctx.byte_size -= i->free();
 
   gctx.F.clear();
+  gctx.num_sorted = 0;
   fv::feat_pool.free();
   fv::block_label_pool.free();
   gctx.M.free();
+  gctx.G.free();
   gctx.model_is_set = false;
-  free_ex_cache();
   mexPrintf("Cache freed; byte size is: %d\n", gctx.byte_size);
   check(gctx.byte_size == 0);
 }
@@ -218,8 +410,17 @@ static void init_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prh
   // prhs[1]    max number of feature vectors
   // prhs[2]    max feature vector length
   // prhs[3]    max number of blocks
-
-  checkM(nrhs == 4, "Expected 3 inputs");
+  // prhs[4]    (optional) feature vector memory budget in MB
+  //            (default or []: max number of fvs * max fv length)
+  // prhs[5]    (optional) feature storage format
+  //            'single'  single precision (default)
+  //            'half'    half precision; twice as many feature 
+  //                      vectors fit in the budget and scores and
+  //                      gradients are still accumulated in double 
+  //                      precision (features are rounded to 11 
+  //                      significant bits)
+
+  checkM(nrhs >= 4 && nrhs <= 6, "Expected 3 to 5 inputs");
   checkM(nlhs == 0, "Expected 0 outputs");
 
   // Free existing cache
@@ -228,20 +429,42 @@ static void init_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prh
   const int max_num_fv = (int)mxGetScalar(prhs[1]);
   const int max_fv_dim = (int)mxGetScalar(prhs[2]);
   const int max_num_bl = (int)mxGetScalar(prhs[3]);
+  uint64_t max_bytes = (uint64_t)max_num_fv * max_fv_dim * sizeof(float);
+  if (nrhs >= 5 && !mxIsEmpty(prhs[4]))
+    max_bytes = (uint64_t)(mxGetScalar(prhs[4]) * 1024 * 1024);
+  fv::storage = fv::STORE_SINGLE;
+  if (nrhs >= 6) {
+    char *storage = mxArrayToString(prhs[5]);
+    checkM(storage != NULL, "Invalid input: storage format");
+    const string storage_str(storage);
+    mxFree(storage);
+    if (storage_str == "half")
+      fv::storage = fv::STORE_HALF;
+    else
+      checkM(storage_str == "single", "Unknown storage format");
+  }
   
+  // The pools grow as feature vectors are added. Feature vectors are
+  // stored in size classes, so the number of feature vectors that 
+  // fit in the budget depends on their lengths.
   bool status;
-  status = fv::feat_pool.init(max_num_fv, max_fv_dim);
+  status = fv::feat_pool.init(max_bytes, 
+                              max(1, fv::storage_dim(max_fv_dim)));
   checkM(status, "Failed to allocate feature vector memory pool");
-  status = fv::block_label_pool.init(max_num_fv, max_num_bl);
+  const uint64_t max_num_labels = 
+    max_bytes / (sizeof(float) * fv::feat_pool.sizes[0]) + 1;
+  status = fv::block_label_pool.init(max_num_labels, max(1, max_num_bl));
   checkM(status, "Failed to allocate block label memory pool");
 
   // vector resizing operations
   gctx.F.reserve(max_num_fv);
   gctx.E.reserve(max_num_fv);
 
-  mexPrintf("Created a feature vector cache to hold <= %d elements "
-            "in <= %.1fMB\n", max_num_fv, 
-            (max_num_fv*sizeof(float)*max_fv_dim)/(1024.0*1024.0));
+  mexPrintf("Created a feature vector cache with %.1fMB for %s "
+            "precision feature vectors (%d size classes; allocated as "
+            "needed)\n", max_bytes/(1024.0*1024.0), 
+            (fv::storage == fv::STORE_HALF) ? "half" : "single",
+            (int)fv::feat_pool.sizes.size());
 
   gctx.is_initialized = true;
 }
@@ -280,6 +503,10 @@ static void add_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs
   const bool is_mined     = (bool)mxGetScalar(prhs[5]);
   const double loss       = mxGetScalar(prhs[6]);
 
+  // The example cache refers to entries of F
+  if (gctx.cache_is_built)
+    free_ex_cache();
+
   fv f;
   int status = f.set(key, num_blocks, bls, feat_dim, 
                      feat, is_belief, is_mined, loss);
@@ -329,19 +556,47 @@ static void shrink_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *p
   const int *inds = (const int *)mxGetPr(mx_inds);
   const int *inds_end = inds + ind_len;
 
+  // The example cache refers to entries of F
+  free_ex_cache();
+
+  // (removing entries keeps the sorted part sorted)
   fv_iter begin = F.begin();
   fv_iter new_end = F.begin();
+  fv_iter sorted_end = F.begin() + gctx.num_sorted;
+  int num_sorted = 0;
   for (fv_iter i = F.begin(), i_end = F.end(); i != i_end; ++i) {
     int save_ind = (inds < inds_end) ? (*inds)-1 : -1;
     int cur_ind = i - begin;
     if (cur_ind == save_ind) {
       *(new_end++) = *i;
       inds++;
+      if (i < sorted_end)
+        num_sorted++;
     } else {
       gctx.byte_size -= i->free();
     }
   }
   F.erase(new_end, F.end());
+  gctx.num_sorted = num_sorted;
+
+  { // Compact the memory pools so that the memory of the removed 
+    // entries is returned
+    vector<float **> feat_refs;
+    vector<uint64_t> feat_lens;
+    vector<int **> label_refs;
+    for (fv_iter i = F.begin(), i_end = F.end(); i != i_end; ++i) {
+      if (i->feat != NULL) {
+        feat_refs.push_back(&i->feat);
+        feat_lens.push_back(fv::storage_dim(i->feat_dim));
+      }
+      if (i->block_labels != NULL)
+        label_refs.push_back(&i->block_labels);
+    }
+    uint64_t freed = fv::feat_pool.compact(feat_refs, feat_lens)
+                     + fv::block_label_pool.compact(label_refs);
+    mexPrintf("Compacted memory pools (%.1fMB returned)\n",
+              freed/(1024.0*1024.0));
+  }
 
   mexPrintf("Cache holds %d feature vectors (%.1fMB) after shrinking\n", 
             F.size(), gctx.byte_size/(1024.0*1024.0));
@@ -388,6 +643,7 @@ static void gradient_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray
     p_cur_w += s;
     dim += s;
   }
+  M.w_version++;
 
   // Remove oldest historical w
   double *w_oldest = M.w_hist.back();
@@ -418,7 +674,7 @@ static void gradient_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray
   mx_grad = mxCreateNumericArray(1, dims, mxDOUBLE_CLASS, mxREAL);
   grad = mxGetPr(mx_grad);
 
-  gradient(&obj_val, grad, dim, gctx.E, M, num_threads);
+  gradient(&obj_val, grad, dim, gctx.E, M, num_threads, gctx.G, gctx.L);
   
   plhs[0] = mxCreateDoubleScalar(obj_val);
   plhs[1] = mx_grad;
@@ -474,7 +730,7 @@ static void info_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prh
   double *info     = mxGetPr(mx_info);
 
   // Compute fv.score and fv.margin
-  compute_info(gctx.E, gctx.F, gctx.M);
+  compute_info(gctx.E, gctx.F, gctx.M, gctx.L);
 
   for (fv_iter i = gctx.F.begin(), i_end = gctx.F.end(); i != i_end; ++i) {
     *(info + dims[0]*SCORE)     = i->score;
@@ -483,7 +739,7 @@ static void info_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prh
     *(info + dims[0]*X)         = i->key[fv::KEY_X];
     *(info + dims[0]*Y)         = i->key[fv::KEY_Y];
     *(info + dims[0]*SCALE)     = i->key[fv::KEY_SCALE];
-    *(info + dims[0]*BYTE_SIZE) = sizeof(float)*i->feat_dim;
+    *(info + dims[0]*BYTE_SIZE) = sizeof(float)*fv::storage_dim(i->feat_dim);
     *(info + dims[0]*MARGIN)    = i->margin;
     *(info + dims[0]*BELIEF)    = i->is_belief;
     *(info + dims[0]*ZERO)      = i->is_zero;
@@ -541,13 +797,32 @@ static void set_model_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray
 
   model &M = gctx.M;
   
+  const mxArray *mx_w = prhs[1];
+  const mxArray *mx_lb = prhs[2];
+
+  // Keep the weight vector history if the block layout doesn't 
+  // change, so that margin-bound pruning state carries over to the
+  // next optimization (see build_ex_cache)
+  bool keep_hist = ((int)mxGetDimensions(mx_w)[0] == M.num_blocks);
+  for (int i = 0; keep_hist && i < M.num_blocks; i++)
+    keep_hist = ((int)mxGetDimensions(mxGetCell(mx_w, i))[0] 
+                 == M.block_sizes[i]);
+  deque<double *> w_hist(model::hist_size, (double *)NULL);
+  vector<double> dw_norm_hist(model::hist_size, INFINITY);
+  if (keep_hist) {
+    w_hist.swap(M.w_hist);
+    dw_norm_hist.swap(M.dw_norm_hist);
+  }
+
   // Free memory if a model already exists
   M.free();
 
-  bool quiet = (nrhs >= 8);
+  if (keep_hist) {
+    M.w_hist.swap(w_hist);
+    M.dw_norm_hist.swap(dw_norm_hist);
+  }
 
-  const mxArray *mx_w = prhs[1];
-  const mxArray *mx_lb = prhs[2];
+  bool quiet = (nrhs >= 8);
 
   M.num_blocks = mxGetDimensions(mx_w)[0];
   M.block_sizes = new (nothrow) int[M.num_blocks];
@@ -571,6 +846,7 @@ static void set_model_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray
     copy(wi, wi+s, M.w[i]);
     copy(lbi, lbi+s, M.lb[i]);
   }
+  M.w_version++;
 
   M.reg_mult = new (nothrow) float[M.num_blocks];
   M.learn_mult = new (nothrow) float[M.num_blocks];
@@ -654,7 +930,7 @@ static void obj_val_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *
   checkM(gctx.model_is_set, ERR_STR_MODEL);
 
   double terms[3];
-  obj_val(terms, gctx.E, gctx.M);
+  obj_val(terms, gctx.E, gctx.M, gctx.L);
 
   for (int i = 0; i < 3; i++)
     if (nlhs > i)
@@ -666,10 +942,30 @@ static void obj_val_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *
  ** Build the example cache (e.g., to prepare for gradient requests)
  **/
 static void ex_prepare_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
-  checkM(nrhs == 1, "Expected 0 inputs");
+  // matlab inputs
+  //  prhs[1]   (optional) layout used by the objective function
+  //            'rows'      feature vectors as stored (default)
+  //            'columnar'  also build a copy of the feature vectors 
+  //                        grouped by block labels (see fv_layout)
+
+  checkM(nrhs == 1 || nrhs == 2, "Expected 0 or 1 inputs");
   checkM(nlhs == 0, "Expected 0 outputs");
 
+  bool columnar = false;
+  if (nrhs == 2) {
+    char *layout = mxArrayToString(prhs[1]);
+    checkM(layout != NULL, "Invalid input: layout");
+    const string layout_str(layout);
+    mxFree(layout);
+    if (layout_str == "columnar")
+      columnar = true;
+    else
+      checkM(layout_str == "rows", "Unknown layout");
+  }
+
   build_ex_cache();
+  if (columnar)
+    build_fv_layout();
 }
 
 
@@ -728,12 +1024,16 @@ static void load_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prh
 
   checkM(gctx.is_initialized, ERR_STR_INIT);
 
+  // The example cache refers to entries of F
+  free_ex_cache();
+
   char *filename = mxArrayToString(prhs[1]);
   ifstream in(filename, ios::binary);
 
   int size;
+  long long file_byte_size;
   in.read((char *)&size, sizeof(int));
-  in.read((char *)&(gctx.byte_size), sizeof(long long));
+  in.read((char *)&file_byte_size, sizeof(long long));
 
   for (int i = 0; i < size; i++) {
     fv f;
@@ -741,6 +1041,15 @@ static void load_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prh
     gctx.F.push_back(f);
   }
 
+  // The byte size in the file is ignored: the cache may already hold 
+  // entries and the file may have been saved with another storage 
+  // format, so recount the memory used by all entries
+  gctx.byte_size = 0;
+  for (fv_iter i = gctx.F.begin(), i_end = gctx.F.end(); i != i_end; ++i)
+    if (!i->is_zero)
+      gctx.byte_size += 
+        sizeof(float)*fv::feat_pool.chunk_size(fv::storage_dim(i->feat_dim));
+
   in.close();
   mxFree(filename);
 }
@@ -15,6 +15,7 @@
 
 #include "mex.h"
 #include "mempool.h"
+#include "half.h"
 #include <string>
 #include <sstream>
 #include <fstream>
@@ -23,6 +24,7 @@
 #include <algorithm>
 #include <numeric>
 #include <cmath>
+#include <cstring>
 
 using namespace std;
 
@@ -60,9 +62,14 @@ struct fv {
   int     num_blocks;
   int     feat_dim;
   bool    is_unique;
+  // Added (or loaded) since the example cache was last built, so the
+  // saved pruning state of its example does not cover it
+  bool    is_new;
   int     *block_labels;
   float   *feat;
   double  norm;
+  // 64-bit hash of the block labels and feature values
+  uint64_t hash;
 
   // For wl-ssvm
   bool    is_zero;
@@ -72,8 +79,15 @@ struct fv {
   double  loss;
   double  margin;
 
+  // Feature storage formats (selected by fv_cache('init', ...))
+  //  STORE_SINGLE  feat holds feat_dim floats
+  //  STORE_HALF    feat holds feat_dim halves (see half.h), padded 
+  //                with a zero to a whole number of floats
+  enum { STORE_SINGLE = 0, STORE_HALF };
+  static int storage;
+
   // Feature vector memory pool
-  static mempool<float> feat_pool;
+  static sized_mempool<float> feat_pool;
   // Block label list memory pool
   static mempool<int> block_label_pool;
 
@@ -86,9 +100,11 @@ struct fv {
     num_blocks    = 0;
     feat_dim      = 0;
     is_unique     = false;
+    is_new        = false;
     feat          = NULL;
     block_labels  = NULL;
     norm          = 0;
+    hash          = 0;
     is_zero       = false;
     is_belief     = false;
     is_mined      = false;
@@ -107,25 +123,28 @@ struct fv {
           const int _feat_dim, const float *_feat, const bool _is_belief,
           const bool _is_mined, const double _loss) {
     is_unique     = true;
+    is_new        = true;
     num_blocks    = _num_blocks;
     feat_dim      = _feat_dim;
     if (num_blocks > 0 && feat_dim > 0) {
-      checkM((uint64_t)feat_dim <= feat_pool.chunk_size,
-             "Feature vector is larger than feat_pool.chunk_size.");
+      checkM((uint64_t)storage_dim(feat_dim) <= feat_pool.max_size(),
+             "Feature vector is larger than feat_pool.max_size().");
       checkM((uint64_t)num_blocks <= block_label_pool.chunk_size,
              "Number of blocks is larger than block_label_pool.chunk_size");
-      feat = feat_pool.get();
+      feat = feat_pool.get(storage_dim(feat_dim));
       if (feat == NULL)
         return -1;
       block_labels = block_label_pool.get();
       if (block_labels == NULL) {
-        feat_pool.put(feat);
+        feat_pool.put(storage_dim(feat_dim), feat);
+        feat = NULL;
         return -1;
       }
-      copy(_feat, _feat+_feat_dim, feat);
+      store_feat(_feat);
       copy(_bls, _bls+_num_blocks, block_labels);
-      norm = sqrt(inner_product(feat, feat+feat_dim, feat, 0.0));
+      norm = feat_norm();
     }
+    hash = content_hash(num_blocks, block_labels, feat_dim, feat);
     copy(_key, _key+KEY_LEN, key);
 
     is_zero   = (num_blocks == 0) ? true : false;
@@ -135,7 +154,7 @@ struct fv {
 
     return (is_zero)
            ? 0
-           : sizeof(float)*feat_pool.chunk_size;
+           : sizeof(float)*feat_pool.chunk_size(storage_dim(feat_dim));
   }
 
   /** -----------------------------------------------------------------
@@ -143,10 +162,10 @@ struct fv {
    **/
   int free() {
     int freed = (is_zero)
-                ? 0 : sizeof(float)*feat_pool.chunk_size;
+                ? 0 : sizeof(float)*feat_pool.chunk_size(storage_dim(feat_dim));
     
     if (feat != NULL)
-      feat_pool.put(feat);
+      feat_pool.put(storage_dim(feat_dim), feat);
 
     if (block_labels != NULL)
       block_label_pool.put(block_labels);
@@ -156,9 +175,11 @@ struct fv {
     feat_dim      = 0;
     num_blocks    = 0;
     norm          = 0;
+    hash          = 0;
     is_zero       = false;
     is_belief     = false;
     is_mined      = false;
+    is_new        = false;
     loss          = 0;
     return freed;
   }
@@ -174,7 +195,14 @@ struct fv {
     out.write((char *)&score,       sizeof(double));
     if (num_blocks > 0) {
       out.write((char *)block_labels, sizeof(int)*num_blocks);
-      out.write((char *)feat,         sizeof(float)*feat_dim);
+      if (storage == STORE_SINGLE) {
+        out.write((char *)feat,       sizeof(float)*feat_dim);
+      } else {
+        // files always hold single precision features
+        vector<float> buf(feat_dim);
+        load_feat(&buf[0]);
+        out.write((char *)&buf[0],    sizeof(float)*feat_dim);
+      }
     }
     out.write((char *)&norm,        sizeof(double));
     out.write((char *)&is_zero,     sizeof(bool));
@@ -192,15 +220,22 @@ struct fv {
     in.read((char *)&feat_dim,   sizeof(int));
     in.read((char *)&is_unique,  sizeof(bool));
     in.read((char *)&score,      sizeof(double));
+    is_new = true;
 
     if (num_blocks > 0) {
       block_labels = block_label_pool.get();
       check(block_labels != NULL);
       in.read((char *)block_labels, sizeof(int)*num_blocks);
 
-      feat = feat_pool.get();
+      feat = feat_pool.get(storage_dim(feat_dim));
       check(feat != NULL);
-      in.read((char *)feat, sizeof(float)*feat_dim);
+      if (storage == STORE_SINGLE) {
+        in.read((char *)feat, sizeof(float)*feat_dim);
+      } else {
+        vector<float> buf(feat_dim);
+        in.read((char *)&buf[0], sizeof(float)*feat_dim);
+        store_feat(&buf[0]);
+      }
     }
 
     in.read((char *)&norm,      sizeof(double));
@@ -208,6 +243,58 @@ struct fv {
     in.read((char *)&is_belief, sizeof(bool));
     in.read((char *)&is_mined,  sizeof(bool));
     in.read((char *)&loss,      sizeof(double));
+
+    // the norm must match the stored (possibly rounded) features
+    if (storage != STORE_SINGLE && feat != NULL)
+      norm = feat_norm();
+    hash = content_hash(num_blocks, block_labels, feat_dim, feat);
+  }
+
+  /** -----------------------------------------------------------------
+   ** Number of floats of pool memory used to store feat_dim features
+   **/
+  static inline int storage_dim(int feat_dim) {
+    return (storage == STORE_HALF) ? (feat_dim + 1) / 2 : feat_dim;
+  }
+
+  /** -----------------------------------------------------------------
+   ** Store features in the current storage format
+   **/
+  void store_feat(const float *src) {
+    if (storage == STORE_SINGLE) {
+      copy(src, src+feat_dim, feat);
+    } else {
+      half_t *h = (half_t *)feat;
+      float_to_half(src, feat_dim, h);
+      // zero the padding so that duplicates are byte identical
+      if (feat_dim & 1)
+        h[feat_dim] = 0;
+    }
+  }
+
+  /** -----------------------------------------------------------------
+   ** Read the stored features back as floats
+   **/
+  void load_feat(float *dst) const {
+    if (storage == STORE_SINGLE)
+      copy(feat, feat+feat_dim, dst);
+    else
+      half_to_float((const half_t *)feat, feat_dim, dst);
+  }
+
+  /** -----------------------------------------------------------------
+   ** L2 norm of the stored features
+   **/
+  double feat_norm() const {
+    if (storage == STORE_SINGLE)
+      return sqrt(inner_product(feat, feat+feat_dim, feat, 0.0));
+    const half_t *h = (const half_t *)feat;
+    double val = 0;
+    for (int i = 0; i < feat_dim; i++) {
+      const double x = half_to_float(h[i]);
+      val += x*x;
+    }
+    return sqrt(val);
   }
 
   /** -----------------------------------------------------------------
@@ -233,10 +320,39 @@ struct fv {
     return 0;
   }
 
+  /** -----------------------------------------------------------------
+   ** 64-bit hash of a feature vector's content (FNV-1a over 32-bit 
+   ** words, followed by a final avalanche)
+   **/
+  static uint64_t content_hash(int num_blocks, const int *bls,
+                               int feat_dim, const float *feat) {
+    const int words_dim = storage_dim(feat_dim);
+    const uint64_t prime = 1099511628211ULL;
+    uint64_t h = 14695981039346656037ULL;
+    h = (h ^ (uint32_t)num_blocks) * prime;
+    h = (h ^ (uint32_t)feat_dim) * prime;
+    if (bls != NULL)
+      for (int i = 0; i < num_blocks; i++)
+        h = (h ^ (uint32_t)bls[i]) * prime;
+    if (feat != NULL) {
+      const uint32_t *words = (const uint32_t *)feat;
+      for (int i = 0; i < words_dim; i++)
+        h = (h ^ words[i]) * prime;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
   /** -----------------------------------------------------------------
    ** Compare two cache entries to see if they are duplicates
-   ** entries are considered duplicates if they have the same key and 
-   ** feature vectors
+   ** entries are considered duplicates if they have the same key, 
+   ** block labels and feature vectors
+   **
+   ** Entries are ordered by key and then by content hash, so the 
+   ** contents are only compared when the hashes are equal (i.e., for
+   ** duplicates and hash collisions)
    **/
   static int cmp_total(const fv &a, const fv &b) {
     // compare example keys
@@ -246,19 +362,34 @@ struct fv {
     else if (c > 0)
       return 1;
 
+    // compare content hashes
+    if (a.hash < b.hash)
+      return -1;
+    else if (a.hash > b.hash)
+      return 1;
+
     // compare feature vector lengths
     if (a.feat_dim < b.feat_dim)
       return -1;
     else if (a.feat_dim > b.feat_dim)
       return 1;
+    if (a.num_blocks < b.num_blocks)
+      return -1;
+    else if (a.num_blocks > b.num_blocks)
+      return 1;
 
-    // compare feature vectors (duplicates are byte identical
-    // so floating point equality is correct here)
-    for (int i = 0; i < a.feat_dim; i++)
-      if (a.feat[i] < b.feat[i])
-        return -1;
-      else if (a.feat[i] > b.feat[i])
-        return 1;
+    // compare block labels and feature vectors (duplicates are byte 
+    // identical)
+    if (a.block_labels != NULL && b.block_labels != NULL) {
+      c = memcmp(a.block_labels, b.block_labels, sizeof(int)*a.num_blocks);
+      if (c != 0)
+        return (c < 0) ? -1 : 1;
+    }
+    if (a.feat != NULL && b.feat != NULL) {
+      c = memcmp(a.feat, b.feat, sizeof(float)*storage_dim(a.feat_dim));
+      if (c != 0)
+        return (c < 0) ? -1 : 1;
+    }
 
     return 0;
   }
@@ -300,9 +431,95 @@ struct ex {
   double max_nonbelief_norm;
 
   int hist;
+
+  // Sum of the content hashes of the feature vectors (identifies the
+  // set of feature vectors in this example; only compared for examples
+  // without new feature vectors, whose flags and losses are unchanged)
+  uint64_t signature;
+
+  // Value of model::w_version when fv::score was last computed for
+  // the feature vectors of this example (-1 => never)
+  int score_version;
 };
 
 typedef vector<ex> ex_cache;
 typedef ex_cache::iterator ex_iter;
 
+
+/** -----------------------------------------------------------------
+ ** Feature vectors that share the same block labels (e.g., those 
+ ** from the same mixture component), stored as the rows of a dense 
+ ** matrix
+ **/
+struct fv_group {
+  // Block labels shared by all rows
+  vector<int> block_labels;
+  // Row length (sum of the block sizes)
+  int dim;
+  // Row-major matrix of features (num rows x dim)
+  vector<float> X;
+  // Cache entry and example (index into the example cache) of each row
+  vector<fv_iter> rows;
+  vector<int> exs;
+  // Gradient multiplier of each row (all zero between gradient calls)
+  vector<double> coef;
+  // The weight blocks of block_labels laid end to end, and the value
+  // of model::w_version they were copied at
+  vector<double> w;
+  int w_version;
+};
+
+
+/** -----------------------------------------------------------------
+ ** Block-columnar copy of the example cache
+ **
+ ** Optionally built by fv_cache('ex_prepare', 'columnar') and freed 
+ ** with the example cache. Scoring a group is then a matrix-vector 
+ ** product with the group's weights and accumulating the gradient of
+ ** its rows is a product with the transpose (see obj_func.cc), 
+ ** instead of one pass over the weight blocks per feature vector.
+ **/
+struct fv_layout {
+  // A range of rows [begin, end) of a group (unit of parallel work)
+  struct chunk {
+    int group;
+    int begin;
+    int end;
+  };
+
+  bool is_built;
+  vector<fv_group> groups;
+  vector<chunk> chunks;
+  // Group and row of each entry of the fv cache, indexed by the 
+  // offset from base (-1 for zero feature vectors)
+  fv_iter base;
+  vector<int> group_of;
+  vector<int> row_of;
+
+  fv_layout() {
+    is_built = false;
+  }
+
+  /** -----------------------------------------------------------------
+   ** Memory used by the feature matrices
+   **/
+  uint64_t byte_size() const {
+    uint64_t bytes = 0;
+    for (int g = 0; g < (int)groups.size(); g++)
+      bytes += sizeof(float)*groups[g].X.size();
+    return bytes;
+  }
+
+  /** -----------------------------------------------------------------
+   ** Free the layout
+   **/
+  void free() {
+    is_built = false;
+    vector<fv_group>().swap(groups);
+    vector<chunk>().swap(chunks);
+    vector<int>().swap(group_of);
+    vector<int>().swap(row_of);
+  }
+};
+
 #endif // FV_CACHE_H
@@ -50,6 +50,7 @@ end
 
 mexcmd = [mexcmd ' CXXFLAGS="\$CXXFLAGS -Wall -fopenmp"'];
 mexcmd = [mexcmd ' LDFLAGS="\$LDFLAGS -Wall -fopenmp"'];
+benchcmd = [mexcmd ' fv_cache/fv_bench.cc'];
 mexcmd = [mexcmd ' fv_cache/fv_cache.cc fv_cache/obj_func.cc'];
 
 try
@@ -61,3 +62,6 @@ catch e
   % unlocking the binary.
   warning(e.identifier, 'Maybe you need to call fv_cache(''unlock'') first?');
 end
+
+% Microbenchmark for model::score_fv (see fv_cache/fv_bench.cc)
+eval(benchcmd);
@@ -0,0 +1,87 @@
+function [obj, ap] = fv_storage_compare(cls, n, testyear)
+% Compare training with single and half precision feature vector storage.
+%   [obj, ap] = fv_storage_compare(cls, n, testyear)
+%
+%   Trains the same model twice, once with conf.training.fv_storage set
+%   to 'single' and once set to 'half', evaluates both on the test set
+%   and reports the final cache objective and the AP of each, along
+%   with the gap between them. Each run uses its own project directory
+%   (<project>-fv_single and <project>-fv_half), so no cached models
+%   are shared between the two runs.
+%
+% Return values
+%   obj       Final cache objective [single half]
+%   ap        AP without bounding box prediction [single half]
+%
+% Arguments
+%   cls       Object class to train and evaluate
+%   n         Number of aspect ratio clusters to use
+%   testyear  Test set year (default: conf.pascal.year)
+
+% AUTORIGHTS
+% -------------------------------------------------------
+% Copyright (C) 2011-2012 Ross Girshick
+%
+% This file is part of the voc-releaseX code
+% (http://people.cs.uchicago.edu/~rbg/latent/)
+% and is available under the terms of an MIT-like license
+% provided in COPYING. Please retain this notice and
+% COPYING if you use this file (or a portion of it) in
+% your project.
+% -------------------------------------------------------
+
+startup;
+
+global VOC_CONFIG_OVERRIDE;
+prev_override = VOC_CONFIG_OVERRIDE;
+restore = onCleanup(@() restore_override(prev_override));
+
+conf = voc_config();
+if nargin < 3
+  testyear = conf.pascal.year;
+end
+testset = conf.eval.test_set;
+
+storage = {'single', 'half'};
+obj = zeros(1, 2);
+ap = zeros(1, 2);
+for i = 1:2
+  project = [conf.project '-fv_' storage{i}];
+  VOC_CONFIG_OVERRIDE = @() storage_override(prev_override, project, ...
+                                             storage{i});
+
+  th = tic;
+  model = pascal_train(cls, n, ['fv_storage = ' storage{i}]);
+  fprintf('Trained with %s storage in %.1f seconds\n', storage{i}, toc(th));
+  fv_cache('free');
+  obj(i) = model.stats.cache_obj(end, 4);
+
+  model.thresh = min(conf.eval.max_thresh, model.thresh);
+  model.interval = conf.eval.interval;
+  ds = pascal_test(model, testset, testyear, testyear);
+  ap(i) = pascal_eval(cls, ds, testset, testyear, testyear);
+end
+
+fprintf('\n%s: storage comparison (n = %d)\n', cls, n);
+fprintf('  %-8s objective %.6f  AP %.4f\n', storage{1}, obj(1), ap(1));
+fprintf('  %-8s objective %.6f  AP %.4f\n', storage{2}, obj(2), ap(2));
+fprintf('  gap      objective %.6f (%.3f%%)  AP %.4f\n', ...
+        obj(2) - obj(1), 100*(obj(2) - obj(1))/obj(1), ap(2) - ap(1));
+
+
+% -------------------------------------------------------------------
+% Config override for one run (applied on top of any existing override)
+function conf = storage_override(prev_override, project, storage)
+conf = struct();
+if ~isempty(prev_override)
+  conf = prev_override();
+end
+conf.project = project;
+conf.training.fv_storage = storage;
+
+
+% -------------------------------------------------------------------
+% Put back the config override that was set before this function ran
+function restore_override(prev_override)
+global VOC_CONFIG_OVERRIDE;
+VOC_CONFIG_OVERRIDE = prev_override;
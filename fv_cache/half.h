@@ -0,0 +1,119 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef HALF_H
+#define HALF_H
+
+#include <emmintrin.h>
+#include <stdint.h>
+#include <cstring>
+
+/** -----------------------------------------------------------------
+ ** IEEE half precision (fp16) conversion
+ **
+ ** Used by fv_cache to store feature vectors in half the memory.
+ ** Conversions only use SSE2 (F16C is not assumed to be available):
+ ** decoding shifts the exponent and mantissa into place and rescales
+ ** with a single multiply by 2^112, which also handles denormals.
+ ** Encoding rounds to nearest even and saturates to the largest
+ ** finite half, so inf and NaN are never stored and the decoder
+ ** does not have to handle them. Below 65520 the result is the same
+ ** as F16C (vcvtps2ph); from 65520 up F16C gives inf instead.
+ **/
+typedef uint16_t half_t;
+
+
+/** -----------------------------------------------------------------
+ ** Convert a float to half precision
+ **/
+static inline half_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = x & 0x80000000u;
+  x ^= sign;
+
+  uint32_t h;
+  if (x >= 0x477ff000u) {
+    // would round above 65504, the largest finite half (or inf/nan)
+    h = 0x7bff;
+  } else if (x < 0x38800000u) {
+    // half denormal or zero: let the float adder do the rounding
+    float t;
+    memcpy(&t, &x, sizeof(t));
+    t += 0.5f;
+    memcpy(&h, &t, sizeof(h));
+    h -= 0x3f000000u;
+  } else {
+    // normal: rebias the exponent and round the mantissa
+    const uint32_t mant_odd = (x >> 13) & 1;
+    x += ((uint32_t)(15 - 127) << 23) + 0xfff + mant_odd;
+    h = x >> 13;
+  }
+  return (half_t)(h | (sign >> 16));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Convert 4 halves (in the low 16 bits of each 32-bit lane) to
+ ** floats
+ **/
+static inline __m128 half4_to_float(__m128i h) {
+  const __m128i mask = _mm_set1_epi32(0x7fff);
+  const __m128 magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+  const __m128i expmant = _mm_and_si128(h, mask);
+  const __m128i sign = _mm_slli_epi32(_mm_xor_si128(h, expmant), 16);
+  const __m128 f = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(expmant, 13)),
+                              magic);
+  return _mm_or_ps(f, _mm_castsi128_ps(sign));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Convert 8 halves to floats
+ **/
+static inline void half8_to_float(const half_t *h, __m128 &lo, __m128 &hi) {
+  const __m128i x = _mm_loadu_si128((const __m128i *)h);
+  const __m128i zero = _mm_setzero_si128();
+  lo = half4_to_float(_mm_unpacklo_epi16(x, zero));
+  hi = half4_to_float(_mm_unpackhi_epi16(x, zero));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Convert a half to a float
+ **/
+static inline float half_to_float(half_t h) {
+  return _mm_cvtss_f32(half4_to_float(_mm_cvtsi32_si128(h)));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Convert n floats to halves and back
+ **/
+static inline void float_to_half(const float *src, int n, half_t *dst) {
+  for (int i = 0; i < n; i++)
+    dst[i] = float_to_half(src[i]);
+}
+
+static inline void half_to_float(const half_t *src, int n, float *dst) {
+  int i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m128 lo, hi;
+    half8_to_float(src + i, lo, hi);
+    _mm_storeu_ps(dst + i, lo);
+    _mm_storeu_ps(dst + i + 4, hi);
+  }
+  for (; i < n; i++)
+    dst[i] = half_to_float(src[i]);
+}
+
+#endif // HALF_H
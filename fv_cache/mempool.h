@@ -14,90 +14,189 @@
 #define MEMPOOL_H
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <stdint.h>
+#include <pthread.h>
 
 using namespace std;
 
+/** -----------------------------------------------------------------
+ ** A memory budget (in bytes) that can be shared by several pools
+ */
+struct mempool_budget {
+  uint64_t max_bytes;
+  uint64_t bytes;
+  pthread_mutex_t mutex;
+
+  mempool_budget() {
+    max_bytes = 0;
+    bytes     = 0;
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  /** ---------------------------------------------------------------
+   ** Reserve up to n units of unit bytes each. Returns the number of
+   ** units reserved.
+   */
+  uint64_t reserve(uint64_t n, uint64_t unit) {
+    pthread_mutex_lock(&mutex);
+    uint64_t avail = (bytes < max_bytes) ? (max_bytes - bytes) / unit : 0;
+    if (n > avail)
+      n = avail;
+    bytes += n*unit;
+    pthread_mutex_unlock(&mutex);
+    return n;
+  }
+
+  void release(uint64_t b) {
+    pthread_mutex_lock(&mutex);
+    bytes -= b;
+    pthread_mutex_unlock(&mutex);
+  }
+};
+
+
 /** -----------------------------------------------------------------
  ** A simple templated memory pool to avoid fragmentation.
+ **
+ ** The pool hands out chunks of a fixed size. Memory is allocated in
+ ** slabs as it is needed, up to a maximum number of chunks (the
+ ** memory budget), so the memory used tracks the working set. All
+ ** operations are thread safe (a mutex guards the free list); the
+ ** bulk versions of get and put take the lock only once.
+ **
+ ** Slabs are allocated with calloc instead of mxCalloc so that the
+ ** pool can grow from any thread. Slabs are allocated lazily (the 
+ ** first get allocates the first slab) and compact() moves live 
+ ** chunks out of sparsely used slabs so that they can be freed.
  */
 template<class T>
 struct mempool {
-  // The pool is one large block of memory that is divided into chunks
-  // of a fixed size. The free block list is stored as a linked list
-  // embedded inside the free blocks.
-  T *data;
+  // Free chunks are kept in a linked list embedded inside the free
+  // chunks.
+
+  // Slabs of memory allocated so far and their sizes (in chunks)
+  vector<T *> slabs;
+  vector<uint64_t> slab_sizes;
 
   // Pointer to the free block at the head of the free list
   T *free_head;
-  
+
   // Size of the fixed-size chunks that can be allocated from this pool
   uint64_t chunk_size;
 
-  // Number of chunks in the pool
+  // Distance between chunks (chunk_size rounded up to a multiple of
+  // 16 bytes, so every chunk is 16-byte aligned)
+  uint64_t stride;
+
+  // Number of chunks in the pool (in all slabs)
   uint64_t num_chunks;
 
+  // Maximum number of chunks the pool may grow to
+  uint64_t max_chunks;
+
+  // Number of chunks per slab
+  uint64_t slab_chunks;
+
+  // Optional budget shared with other pools (NULL => none)
+  mempool_budget *budget;
+
+  // Guards everything above
+  pthread_mutex_t mutex;
+
 
   /** ---------------------------------------------------------------
    ** Constructor
    */
   mempool() {
-    data       = NULL;
-    free_head  = NULL;
-    chunk_size = 0;
-    num_chunks = 0;
+    free_head   = NULL;
+    chunk_size  = 0;
+    stride      = 0;
+    num_chunks  = 0;
+    max_chunks  = 0;
+    slab_chunks = 0;
+    budget      = NULL;
+    pthread_mutex_init(&mutex, NULL);
   }
 
 
   /** ---------------------------------------------------------------
-   ** Allocates _num_chunks*_chunk_size*sizeof(T) bytes of memory
-   ** and initializes the free-block list
+   ** Set up a pool of up to _max_chunks chunks of _chunk_size*sizeof(T)
+   ** bytes, which grows by (about) slab_bytes at a time. If 
+   ** _budget is given, slabs are also charged to it.
    */
-  bool init(uint64_t _num_chunks, uint64_t _chunk_size) {
-    num_chunks = _num_chunks;
-    chunk_size = _chunk_size;
-
-    // Allocate memory block
-    data = (T *)mxCalloc(num_chunks, chunk_size*sizeof(T));
-    if (data == NULL)
-      return false;
-    mexMakeMemoryPersistent(data);
+  bool init(uint64_t _max_chunks, uint64_t _chunk_size,
+            uint64_t slab_bytes = 64 << 20, 
+            mempool_budget *_budget = NULL) {
+    free();
 
-    // Build free-block list stored as pointers embedded in the 
-    // free blocks
-    for (uint64_t i = 0; i < num_chunks-1; i++) {
-      T *chunk_start = data + i*chunk_size;
-      T *next_chunk = chunk_start + chunk_size;
-      *((T **)(chunk_start)) = next_chunk;
-    }
-    *((T **)(data + (num_chunks-1)*chunk_size)) = NULL;
-
-    free_head = data;
+    chunk_size = _chunk_size;
+    max_chunks = _max_chunks;
+    budget     = _budget;
+    // A free chunk holds a pointer
+    uint64_t bytes = chunk_size*sizeof(T);
+    if (bytes < sizeof(T *))
+      bytes = sizeof(T *);
+    bytes = (bytes + 15) & ~(uint64_t)15;
+    stride = bytes / sizeof(T);
+    slab_chunks = slab_bytes / bytes;
+    if (slab_chunks < 1)
+      slab_chunks = 1;
 
-    return true;
+    return chunk_size > 0;
   }
 
 
   /** ---------------------------------------------------------------
    ** Get a pointer to the next free chunk, or NULL if the pool is
-   ** empty
+   ** empty and can't grow
    */
   T *get() {
-    if (free_head == NULL)
-      return NULL;
-
-    T *data = free_head;
-    free_head = *((T **)data);
+    T *data = NULL;
+    get(1, &data);
     return data;
   }
 
 
+  /** ---------------------------------------------------------------
+   ** Get n chunks (stored in out[0] ... out[n-1]). Returns the number
+   ** of chunks actually obtained (< n if the pool is exhausted).
+   */
+  uint64_t get(uint64_t n, T **out) {
+    pthread_mutex_lock(&mutex);
+    uint64_t i = 0;
+    for (; i < n; i++) {
+      if (free_head == NULL && !grow())
+        break;
+      out[i] = free_head;
+      free_head = *((T **)free_head);
+    }
+    pthread_mutex_unlock(&mutex);
+    return i;
+  }
+
+
   /** ---------------------------------------------------------------
    ** Release a chunk back into the pool
    */
   void put(T *data) {
-    *((T **)data) = free_head;
-    free_head = data;
+    put(1, &data);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Release n chunks back into the pool
+   */
+  void put(uint64_t n, T *const *data) {
+    pthread_mutex_lock(&mutex);
+    for (uint64_t i = 0; i < n; i++) {
+      *((T **)data[i]) = free_head;
+      free_head = data[i];
+    }
+    pthread_mutex_unlock(&mutex);
   }
 
 
@@ -105,11 +204,111 @@ struct mempool {
    ** Free all memory allocated by the pool
    */
   void free() {
-    mxFree(data);
-    data       = NULL;
-    free_head  = NULL;
-    num_chunks = 0;
-    chunk_size = 0;
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < slabs.size(); i++)
+      ::free(slabs[i]);
+    if (budget != NULL)
+      budget->release(num_chunks*stride*sizeof(T));
+    vector<T *>().swap(slabs);
+    vector<uint64_t>().swap(slab_sizes);
+    free_head   = NULL;
+    num_chunks  = 0;
+    max_chunks  = 0;
+    pthread_mutex_unlock(&mutex);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Move the live chunks into as few slabs as possible and free the
+   ** slabs that are left empty
+   ** 
+   ** refs holds the address of every pointer to a live chunk (chunks
+   ** that aren't referenced are considered free); the pointers are 
+   ** updated when chunks move. Returns the number of bytes freed.
+   */
+  uint64_t compact(const vector<T **> &refs) {
+    pthread_mutex_lock(&mutex);
+    const int num_slabs = slabs.size();
+
+    // Slabs sorted by address (to find the slab of a chunk)
+    vector<pair<T *, int> > by_addr(num_slabs);
+    for (int i = 0; i < num_slabs; i++)
+      by_addr[i] = make_pair(slabs[i], i);
+    sort(by_addr.begin(), by_addr.end());
+
+    // Slab of each live chunk and which chunks of each slab are live
+    vector<int> ref_slab(refs.size());
+    vector<vector<char> > live(num_slabs);
+    vector<uint64_t> num_live(num_slabs, 0);
+    for (int i = 0; i < num_slabs; i++)
+      live[i].assign(slab_sizes[i], 0);
+    for (size_t r = 0; r < refs.size(); r++) {
+      T *p = *refs[r];
+      int j = upper_bound(by_addr.begin(), by_addr.end(),
+                          make_pair(p, num_slabs)) - by_addr.begin() - 1;
+      int s = by_addr[j].second;
+      ref_slab[r] = s;
+      live[s][(p - slabs[s]) / stride] = 1;
+      num_live[s]++;
+    }
+
+    // Keep the fullest slabs that are needed to hold the live chunks
+    uint64_t total_live = refs.size();
+    vector<pair<uint64_t, int> > order(num_slabs);
+    for (int i = 0; i < num_slabs; i++)
+      order[i] = make_pair(num_live[i], i);
+    sort(order.rbegin(), order.rend());
+    vector<char> keep(num_slabs, 0);
+    uint64_t capacity = 0;
+    for (int k = 0; k < num_slabs && capacity < total_live; k++) {
+      keep[order[k].second] = 1;
+      capacity += slab_sizes[order[k].second];
+    }
+
+    // Free chunks in the kept slabs
+    vector<T *> free_chunks;
+    for (int i = 0; i < num_slabs; i++)
+      if (keep[i])
+        for (uint64_t c = 0; c < slab_sizes[i]; c++)
+          if (!live[i][c])
+            free_chunks.push_back(slabs[i] + c*stride);
+
+    // Move chunks out of the slabs that will be freed
+    for (size_t r = 0; r < refs.size(); r++) {
+      if (keep[ref_slab[r]])
+        continue;
+      T *dst = free_chunks.back();
+      free_chunks.pop_back();
+      memcpy(dst, *refs[r], chunk_size*sizeof(T));
+      *refs[r] = dst;
+    }
+
+    // Free the other slabs and rebuild the free list
+    uint64_t freed_chunks = 0;
+    vector<T *> new_slabs;
+    vector<uint64_t> new_sizes;
+    for (int i = 0; i < num_slabs; i++) {
+      if (keep[i]) {
+        new_slabs.push_back(slabs[i]);
+        new_sizes.push_back(slab_sizes[i]);
+      } else {
+        ::free(slabs[i]);
+        freed_chunks += slab_sizes[i];
+      }
+    }
+    slabs.swap(new_slabs);
+    slab_sizes.swap(new_sizes);
+    num_chunks -= freed_chunks;
+    if (budget != NULL)
+      budget->release(freed_chunks*stride*sizeof(T));
+    free_head = NULL;
+    for (size_t i = free_chunks.size(); i-- > 0; ) {
+      *((T **)free_chunks[i]) = free_head;
+      free_head = free_chunks[i];
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return freed_chunks*stride*sizeof(T);
   }
 
 
@@ -117,13 +316,175 @@ struct mempool {
    ** For debugging
    */
   void print() {
+    pthread_mutex_lock(&mutex);
     int num_free = 0;
     T *iter = free_head;
     while (iter != NULL) {
       num_free++;
       iter = *((T **)iter);
     }
-    cout << "Free: " << num_free << endl;
+    pthread_mutex_unlock(&mutex);
+    cout << "Free: " << num_free << " of " << num_chunks
+         << " (" << slabs.size() << " slabs)" << endl;
+  }
+
+
+private:
+  /** ---------------------------------------------------------------
+   ** Add a slab and put its chunks on the free list (the mutex must
+   ** be held). Returns false if the budget is used up or the
+   ** allocation fails.
+   */
+  bool grow() {
+    if (num_chunks >= max_chunks)
+      return false;
+    uint64_t n = max_chunks - num_chunks;
+    if (n > slab_chunks)
+      n = slab_chunks;
+    if (budget != NULL)
+      n = budget->reserve(n, stride*sizeof(T));
+    if (n == 0)
+      return false;
+
+    T *slab = (T *)calloc(n, stride*sizeof(T));
+    if (slab == NULL) {
+      if (budget != NULL)
+        budget->release(n*stride*sizeof(T));
+      return false;
+    }
+    slabs.push_back(slab);
+    slab_sizes.push_back(n);
+    num_chunks += n;
+
+    // Build free-block list stored as pointers embedded in the
+    // free blocks
+    for (uint64_t i = 0; i < n-1; i++) {
+      T *chunk_start = slab + i*stride;
+      *((T **)(chunk_start)) = chunk_start + stride;
+    }
+    *((T **)(slab + (n-1)*stride)) = free_head;
+    free_head = slab;
+    return true;
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Memory pools for variable-size arrays
+ **
+ ** An array of length n is stored in the smallest size class that 
+ ** holds it. The class sizes grow geometrically (by about 25%) up to
+ ** the maximum length, so at most ~20% of a chunk is wasted. All 
+ ** classes share one memory budget.
+ */
+template<class T>
+struct sized_mempool {
+  // Chunk size of each class (increasing)
+  vector<uint64_t> sizes;
+
+  // One pool per class (pools aren't copyable)
+  vector<mempool<T> *> pools;
+
+  // Budget shared by the pools
+  mempool_budget budget;
+
+
+  /** ---------------------------------------------------------------
+   ** Set up classes for lengths up to max_size within max_bytes of 
+   ** memory
+   */
+  bool init(uint64_t max_bytes, uint64_t max_size,
+            uint64_t min_size = 32, uint64_t slab_bytes = 8 << 20) {
+    free();
+    budget.max_bytes = max_bytes;
+
+    for (uint64_t s = max_size; ; s = s*4/5) {
+      sizes.push_back(s);
+      if (s <= min_size || s <= 1)
+        break;
+    }
+    reverse(sizes.begin(), sizes.end());
+
+    bool ok = true;
+    for (size_t c = 0; c < sizes.size(); c++) {
+      mempool<T> *p = new mempool<T>;
+      ok = p->init(max_bytes / (sizes[c]*sizeof(T)) + 1, sizes[c],
+                   slab_bytes, &budget) && ok;
+      pools.push_back(p);
+    }
+    return ok;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Class of an array of length n (n must be <= max_size())
+   */
+  int size_class(uint64_t n) const {
+    return lower_bound(sizes.begin(), sizes.end(), n) - sizes.begin();
+  }
+
+  uint64_t max_size() const {
+    return sizes.empty() ? 0 : sizes.back();
+  }
+
+  /** ---------------------------------------------------------------
+   ** Number of elements allocated for an array of length n
+   */
+  uint64_t chunk_size(uint64_t n) const {
+    return sizes[size_class(n)];
+  }
+
+  /** ---------------------------------------------------------------
+   ** Get memory for an array of length n, or NULL if the budget is 
+   ** used up
+   */
+  T *get(uint64_t n) {
+    return pools[size_class(n)]->get();
+  }
+
+  /** ---------------------------------------------------------------
+   ** Release an array of length n
+   */
+  void put(uint64_t n, T *data) {
+    pools[size_class(n)]->put(data);
+  }
+
+  /** ---------------------------------------------------------------
+   ** Compact each class (see mempool::compact)
+   ** refs[i] is the address of a pointer to a live array of length
+   ** lens[i]. Returns the number of bytes freed.
+   */
+  uint64_t compact(const vector<T **> &refs, const vector<uint64_t> &lens) {
+    vector<vector<T **> > by_class(sizes.size());
+    for (size_t i = 0; i < refs.size(); i++)
+      by_class[size_class(lens[i])].push_back(refs[i]);
+    uint64_t freed = 0;
+    for (size_t c = 0; c < sizes.size(); c++)
+      freed += pools[c]->compact(by_class[c]);
+    return freed;
+  }
+
+  /** ---------------------------------------------------------------
+   ** Bytes currently allocated from the system
+   */
+  uint64_t bytes() {
+    pthread_mutex_lock(&budget.mutex);
+    uint64_t b = budget.bytes;
+    pthread_mutex_unlock(&budget.mutex);
+    return b;
+  }
+
+  /** ---------------------------------------------------------------
+   ** Free all memory
+   */
+  void free() {
+    for (size_t c = 0; c < pools.size(); c++) {
+      pools[c]->free();
+      delete pools[c];
+    }
+    pools.clear();
+    sizes.clear();
+    budget.bytes = 0;
   }
 };
 
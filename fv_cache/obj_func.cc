@@ -29,11 +29,81 @@ static const double inv_beta = 1.0 / beta;
 // foreground examples, and the regularization term
 enum { OBJ_VAL_BG = 0, OBJ_VAL_FG, OBJ_VAL_RG, OBJ_VAL_LEN };
 
+/** -----------------------------------------------------------------
+ ** Make sure fv::score is current for the feature vectors of an 
+ ** example. Scores computed by an earlier pass at the same weights 
+ ** (e.g., the last gradient() call of an L-BFGS solve) are reused.
+ **/
+static inline void score_example(ex &e, const model &M) {
+  if (e.score_version == M.w_version)
+    return;
+  for (fv_iter m = e.begin; m != e.end; ++m)
+    m->score = M.score_fv(*m);
+  e.score_version = M.w_version;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Make sure fv::score is current for the given examples (all if 
+ ** active is NULL) by scoring the rows of the columnar layout. Each 
+ ** row is scored with one dot product against the group's weight 
+ ** blocks laid end to end.
+ **/
+static void score_layout(fv_layout &L, ex_cache &E, const model &M,
+                         const vector<int> *active) {
+  const int num_examples = E.size();
+  vector<char> stale(num_examples, 0);
+  if (active == NULL) {
+    for (int q = 0; q < num_examples; q++)
+      stale[q] = (E[q].score_version != M.w_version);
+  } else {
+    for (int a = 0; a < (int)active->size(); a++) {
+      const int q = (*active)[a];
+      stale[q] = (E[q].score_version != M.w_version);
+    }
+  }
+
+  // Lay out the weights of each group
+  for (int k = 0; k < (int)L.groups.size(); k++) {
+    fv_group &g = L.groups[k];
+    if (g.w_version == M.w_version)
+      continue;
+    g.w.resize(g.dim);
+    int off = 0;
+    for (int j = 0; j < (int)g.block_labels.size(); j++) {
+      const int b = g.block_labels[j];
+      checkM(off + M.block_sizes[b] <= g.dim, 
+             "Model blocks don't match the cached feature vectors");
+      copy(M.w[b], M.w[b] + M.block_sizes[b], &g.w[off]);
+      off += M.block_sizes[b];
+    }
+    check(off == g.dim);
+    g.w_version = M.w_version;
+  }
+
+  const int num_chunks = L.chunks.size();
+  #pragma omp parallel for schedule(dynamic)
+  for (int c = 0; c < num_chunks; c++) {
+    const fv_layout::chunk &C = L.chunks[c];
+    fv_group &g = L.groups[C.group];
+    for (int r = C.begin; r < C.end; r++)
+      if (stale[g.exs[r]])
+        g.rows[r]->score = model::dot_block(&g.w[0], 
+                                            &g.X[(uint64_t)r * g.dim],
+                                            g.dim);
+  }
+
+  for (int q = 0; q < num_examples; q++)
+    if (stale[q])
+      E[q].score_version = M.w_version;
+}
+
+
 /** -----------------------------------------------------------------
  ** Compute the value of the object function on the cache
  **/
-void obj_val(double out[OBJ_VAL_LEN], ex_cache &E, model &M) {
-  // TODO: consider merging with gradient()
+void obj_val(double out[OBJ_VAL_LEN], ex_cache &E, model &M, 
+             fv_layout &L) {
   double **w = M.w;
 
   out[OBJ_VAL_BG] = 0.0; // background examples (from neg)
@@ -86,52 +156,64 @@ void obj_val(double out[OBJ_VAL_LEN], ex_cache &E, model &M) {
     out[OBJ_VAL_RG] = max_hnrm2 + inv_beta * log(Z);
   }
 
-  for (ex_iter i = E.begin(), i_end = E.end(); i != i_end; ++i) {
-    fv_iter I = i->begin;
-    fv_iter belief_I = i->begin;
+  const int num_examples = E.size();
+  double val_bg = 0;
+  double val_fg = 0;
+
+  if (L.is_built)
+    score_layout(L, E, M, NULL);
+
+  #pragma omp parallel for schedule(dynamic, 64) reduction(+:val_bg, val_fg)
+  for (int q = 0; q < num_examples; q++) {
+    ex &i = E[q];
+    score_example(i, M);
+
     double V = -INFINITY;
     double belief_score = 0;
-    int subset = OBJ_VAL_FG;
-    for (fv_iter m = i->begin; m != i->end; ++m) {
-      double score = M.score_fv(*m);
+    bool is_bg = false;
+    for (fv_iter m = i.begin; m != i.end; ++m) {
+      double score = m->score;
 
       if (m->is_belief) {
         belief_score = score;
-        belief_I = m;
         if (m->is_zero)
-          subset = OBJ_VAL_BG;
+          is_bg = true;
       }
       
       score += m->loss;
-      if (score > V) {
-        I = m;
+      if (score > V)
         V = score;
-      }
     }
-    out[subset] += M.C * (V - belief_score);
+    if (is_bg)
+      val_bg += M.C * (V - belief_score);
+    else
+      val_fg += M.C * (V - belief_score);
   }
+  out[OBJ_VAL_BG] = val_bg;
+  out[OBJ_VAL_FG] = val_fg;
 }
 
 
 /** -----------------------------------------------------------------
  ** Compute score and margin for each feature vector.
  */
-void compute_info(const ex_cache &E, fv_cache &F, const model &M) {
+void compute_info(ex_cache &E, fv_cache &F, const model &M, 
+                  fv_layout &L) {
   const int num_examples = E.size();
 
-  //#pragma omp parallel for schedule(static)
+  if (L.is_built)
+    score_layout(L, E, M, NULL);
+
+  #pragma omp parallel for schedule(dynamic, 64)
   for (int q = 0; q < num_examples; q++) {
-    ex i = E[q];
-    double belief_score = 0;
-    for (fv_iter m = i.begin; m != i.end; ++m) {
-      double score = M.score_fv(*m);
+    ex &i = E[q];
+    score_example(i, M);
 
-      // record score of belief
+    // record score of belief
+    double belief_score = 0;
+    for (fv_iter m = i.begin; m != i.end; ++m)
       if (m->is_belief)
-        belief_score = score;
-
-      m->score = score;
-    }
+        belief_score = m->score;
 
     // compute margin for each entry in this example
     for (fv_iter m = i.begin; m != i.end; ++m)
@@ -140,120 +222,337 @@ void compute_info(const ex_cache &E, fv_cache &F, const model &M) {
 }
 
 
+/** -----------------------------------------------------------------
+ ** (Re)allocate the buffers for model M and num_threads threads
+ ** Nothing is done if they already have the right shape.
+ */
+void gradient_buffers::init(const model &M, int _num_threads) {
+  bool same = (num_threads == _num_threads 
+               && (int)block_offsets.size() == M.num_blocks+1);
+  for (int b = 0; same && b < M.num_blocks; b++)
+    same = (block_offsets[b+1] - block_offsets[b] == M.block_sizes[b]);
+  if (same)
+    return;
+
+  num_threads = _num_threads;
+  block_offsets.resize(M.num_blocks+1);
+  block_offsets[0] = 0;
+  for (int b = 0; b < M.num_blocks; b++)
+    block_offsets[b+1] = block_offsets[b] + M.block_sizes[b];
+  grad.assign(num_threads, vector<double>(block_offsets.back(), 0.0));
+  dirty.assign(num_threads, vector<char>(M.num_blocks, 0));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Free the buffers
+ */
+void gradient_buffers::free() {
+  num_threads = 0;
+  vector<int>().swap(block_offsets);
+  vector< vector<double> >().swap(grad);
+  vector< vector<char> >().swap(dirty);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Add mult times a half precision feature block to a gradient block
+ ** (the features are decoded 8 at a time with SSE2)
+ */
+static inline void add_block(double *grad, const half_t *feat, int n,
+                             double mult) {
+  const __m128d m = _mm_set1_pd(mult);
+  int k = 0;
+  for (; k+8 <= n; k += 8) {
+    __m128 f0, f1;
+    half8_to_float(feat + k, f0, f1);
+    __m128d g;
+    g = _mm_add_pd(_mm_loadu_pd(grad + k), 
+                   _mm_mul_pd(m, _mm_cvtps_pd(f0)));
+    _mm_storeu_pd(grad + k, g);
+    g = _mm_add_pd(_mm_loadu_pd(grad + k + 2), 
+                   _mm_mul_pd(m, _mm_cvtps_pd(_mm_movehl_ps(f0, f0))));
+    _mm_storeu_pd(grad + k + 2, g);
+    g = _mm_add_pd(_mm_loadu_pd(grad + k + 4), 
+                   _mm_mul_pd(m, _mm_cvtps_pd(f1)));
+    _mm_storeu_pd(grad + k + 4, g);
+    g = _mm_add_pd(_mm_loadu_pd(grad + k + 6), 
+                   _mm_mul_pd(m, _mm_cvtps_pd(_mm_movehl_ps(f1, f1))));
+    _mm_storeu_pd(grad + k + 6, g);
+  }
+  for (; k < n; k++)
+    grad[k] += mult * half_to_float(feat[k]);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Add mult times a single precision feature block to a gradient 
+ ** block
+ */
+static inline void add_block(double *grad, const float *feat, int n,
+                             double mult) {
+  const __m128d m = _mm_set1_pd(mult);
+  int k = 0;
+  for (; k+4 <= n; k += 4) {
+    const __m128 f = _mm_loadu_ps(feat + k);
+    __m128d g;
+    g = _mm_add_pd(_mm_loadu_pd(grad + k), 
+                   _mm_mul_pd(m, _mm_cvtps_pd(f)));
+    _mm_storeu_pd(grad + k, g);
+    g = _mm_add_pd(_mm_loadu_pd(grad + k + 2), 
+                   _mm_mul_pd(m, _mm_cvtps_pd(_mm_movehl_ps(f, f))));
+    _mm_storeu_pd(grad + k + 2, g);
+  }
+  for (; k < n; k++)
+    grad[k] += mult * feat[k];
+}
+
+
 /** -----------------------------------------------------------------
  ** Update the gradient by adding to it the subgradient from one
- ** example.
+ ** example. Blocks that are updated are marked in dirty.
  */
 static inline void update_gradient(const model &M, const fv_iter I, 
-                                   double **grad_blocks, double mult) {
+                                   double *grad, const int *block_offsets,
+                                   char *dirty, double mult) {
   // short circuit if the feat vector is zero
   if (I->is_zero)
     return;
 
-  const float *feat = I->feat;
   int nbls          = I->num_blocks;
   const int *bls    = I->block_labels;
 
+  if (fv::storage == fv::STORE_HALF) {
+    const half_t *feat = (const half_t *)I->feat;
+    for (int j = 0; j < nbls; j++) {
+      int b = bls[j];
+      if (M.learn_mult[b] != 0) {
+        add_block(grad + block_offsets[b], feat, M.block_sizes[b], mult);
+        dirty[b] = 1;
+      }
+      feat += M.block_sizes[b];
+    }
+    return;
+  }
+
+  const float *feat = I->feat;
   for (int j = 0; j < nbls; j++) {
     int b             = bls[j];
-    double *ptr_grad  = grad_blocks[b];
-    if (M.learn_mult[b] != 0)
+    double *ptr_grad  = grad + block_offsets[b];
+    if (M.learn_mult[b] != 0) {
       for (int k = 0; k < M.block_sizes[b]; k++)
         *(ptr_grad++) += mult * feat[k];
+      dirty[b] = 1;
+    }
     feat += M.block_sizes[b];
   }
 }
 
 
+/** -----------------------------------------------------------------
+ ** Columnar version of update_gradient(): only records mult as the 
+ ** gradient multiplier of the feature vector's row (see 
+ ** add_layout_gradient())
+ */
+static inline void update_coef(fv_layout &L, const fv_iter I, 
+                               double mult) {
+  const int i = I - L.base;
+  const int k = L.group_of[i];
+  if (k >= 0)
+    L.groups[k].coef[L.row_of[i]] += mult;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Add the subgradients recorded by update_coef() to the per-thread
+ ** gradients: for each chunk of rows, X^T * coef is accumulated in a 
+ ** row-length buffer and then added to the gradient blocks. The 
+ ** multipliers are zeroed for the next call.
+ */
+static void add_layout_gradient(fv_layout &L, const model &M,
+                                gradient_buffers &G) {
+  const int *block_offsets = &G.block_offsets[0];
+  const int num_chunks = L.chunks.size();
+
+  #pragma omp parallel shared(G)
+  {
+    const int th_id = omp_get_thread_num();
+    double *grad_th = &G.grad[th_id][0];
+    char *dirty_th  = &G.dirty[th_id][0];
+    vector<double> acc;
+
+    #pragma omp for schedule(dynamic)
+    for (int c = 0; c < num_chunks; c++) {
+      const fv_layout::chunk &C = L.chunks[c];
+      fv_group &g = L.groups[C.group];
+      bool touched = false;
+      for (int r = C.begin; r < C.end; r++) {
+        if (g.coef[r] == 0)
+          continue;
+        if (!touched) {
+          acc.assign(g.dim, 0.0);
+          touched = true;
+        }
+        add_block(&acc[0], &g.X[(uint64_t)r * g.dim], g.dim, g.coef[r]);
+        g.coef[r] = 0;
+      }
+      if (!touched)
+        continue;
+
+      const double *src = &acc[0];
+      for (int j = 0; j < (int)g.block_labels.size(); j++) {
+        const int b = g.block_labels[j];
+        const int s = M.block_sizes[b];
+        if (M.learn_mult[b] != 0) {
+          double *dst = grad_th + block_offsets[b];
+          for (int k = 0; k < s; k++)
+            dst[k] += src[k];
+          dirty_th[b] = 1;
+        }
+        src += s;
+      }
+    }
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Select the examples that gradient() has to visit and split them
+ ** into contiguous ranges of roughly equal cost.
+ **
+ ** The margin-bound pruning test (see Appendix B of my dissertation)
+ ** is applied here, so pruned examples cost nothing later. The cost 
+ ** of an active example is its number of feature vectors (+1 for the
+ ** per-example overhead). Range r covers active[ranges[r]] ... 
+ ** active[ranges[r+1]-1].
+ */
+static void partition_examples(ex_cache &E, const model &M, 
+                               int num_ranges, vector<int> &active,
+                               vector<int> &ranges) {
+  const int num_examples = E.size();
+  active.clear();
+  active.reserve(num_examples);
+  vector<int64_t> cost;
+  cost.reserve(num_examples);
+  int64_t total = 0;
+  for (int q = 0; q < num_examples; q++) {
+    E[q].hist++;
+    int hist = E[q].hist;
+    if (hist < model::hist_size) {
+      double skip = E[q].margin_bound
+                    - M.dw_norm_hist[hist] 
+                      * (E[q].belief_norm + E[q].max_nonbelief_norm);
+      if (skip > 0)
+        continue;
+    } 
+    active.push_back(q);
+    total += (E[q].end - E[q].begin) + 1;
+    cost.push_back(total);
+  }
+
+  // Cut after the example at which the cumulative cost reaches 
+  // each multiple of total/num_ranges
+  ranges.clear();
+  ranges.push_back(0);
+  const int num_active = active.size();
+  int r = 1;
+  for (int a = 0; a < num_active && r < num_ranges; a++) {
+    if (cost[a] * num_ranges >= total * r) {
+      ranges.push_back(a+1);
+      while (r < num_ranges && cost[a] * num_ranges >= total * r)
+        r++;
+    }
+  }
+  if (ranges.back() != num_active)
+    ranges.push_back(num_active);
+}
+
+
 /** -----------------------------------------------------------------
  ** Compute the gradient and value of the objective function at the
  ** point M.w.
  */
 void gradient(double *obj_val_out, double *grad, const int dim, 
-              ex_cache &E, const model &M, int num_threads) {
-  // Gradient per thread
-  double **grad_threads = new (nothrow) double*[num_threads];
-  check(grad_threads != NULL);
-  
-  // Pointer to the start of each block in each per-thread gradient
-  double ***grad_blocks = new (nothrow) double**[num_threads];
-  check(grad_blocks != NULL);
+              ex_cache &E, const model &M, int num_threads,
+              gradient_buffers &G, fv_layout &L) {
+  // Gradient per thread (all zero between calls)
+  G.init(M, num_threads);
+  check(G.block_offsets.back() == dim);
+  const int *block_offsets = &G.block_offsets[0];
   
   // Objective function value per thread
   double *obj_vals = new (nothrow) double[num_threads];
   check(obj_vals != NULL);
   fill(obj_vals, obj_vals+num_threads, 0);
 
-  #pragma omp parallel shared(grad_threads, grad_blocks, obj_vals)
-  {
-    double *grad_th = new (nothrow) double[dim];
-    check(grad_th != NULL);
-    fill(grad_th, grad_th+dim, 0);
+  // Examples vary from one to dozens of feature vectors and many are 
+  // pruned, so split the active examples into cost-balanced ranges 
+  // and hand them out dynamically (several per thread so that a slow
+  // range can be compensated for)
+  vector<int> active, ranges;
+  partition_examples(E, M, 8*num_threads, active, ranges);
+  const int num_ranges = ranges.size() - 1;
 
-    double **grad_blocks_th = new (nothrow) double*[M.num_blocks];
-    check(grad_blocks_th != NULL);
-    int off = 0;
-    for (int i = 0; i < M.num_blocks; i++) {
-      grad_blocks_th[i] = grad_th + off;
-      off += M.block_sizes[i];
-    }
+  if (L.is_built)
+    score_layout(L, E, M, &active);
 
+  #pragma omp parallel shared(G, obj_vals)
+  {
     const int th_id = omp_get_thread_num();
-    grad_threads[th_id] = grad_th;
-    grad_blocks[th_id]  = grad_blocks_th;
-
-    const int num_examples = E.size();
-
-    #pragma omp for schedule(static)
-    for (int q = 0; q < num_examples; q++) {
-      // Check margin-bound pruning condition
-      // See Appendix B of my dissertation for details
-      E[q].hist++;
-      int hist = E[q].hist;
-      if (hist < model::hist_size) {
-        double skip = E[q].margin_bound
-                      - M.dw_norm_hist[hist] 
-                        * (E[q].belief_norm + E[q].max_nonbelief_norm);
-        if (skip > 0)
-          continue;
-      } 
-
-      ex i = E[q];
-
-      fv_iter I = i.begin;
-      fv_iter belief_I = i.begin;
-      double V = -INFINITY;
-      double belief_score = 0;
-      double max_nonbelief_score = -INFINITY;
-      for (fv_iter m = i.begin; m != i.end; ++m) {
-        double score = M.score_fv(*m);
-        double loss_adj_score = score + m->loss;
-
-        // record score of belief
-        if (m->is_belief) {
-          belief_score = score;
-          belief_I = m;
-        } else if (loss_adj_score > max_nonbelief_score) {
-          max_nonbelief_score = loss_adj_score;
-        }
-        
-        if (loss_adj_score > V) {
-          I = m;
-          V = loss_adj_score;
+    double *grad_th = &G.grad[th_id][0];
+    char *dirty_th  = &G.dirty[th_id][0];
+
+    #pragma omp for schedule(dynamic, 1)
+    for (int r = 0; r < num_ranges; r++) {
+      for (int a = ranges[r]; a < ranges[r+1]; a++) {
+        const int q = active[a];
+        ex &i = E[q];
+        score_example(i, M);
+
+        fv_iter I = i.begin;
+        fv_iter belief_I = i.begin;
+        double V = -INFINITY;
+        double belief_score = 0;
+        double max_nonbelief_score = -INFINITY;
+        for (fv_iter m = i.begin; m != i.end; ++m) {
+          double score = m->score;
+          double loss_adj_score = score + m->loss;
+
+          // record score of belief
+          if (m->is_belief) {
+            belief_score = score;
+            belief_I = m;
+          } else if (loss_adj_score > max_nonbelief_score) {
+            max_nonbelief_score = loss_adj_score;
+          }
+          
+          if (loss_adj_score > V) {
+            I = m;
+            V = loss_adj_score;
+          }
         }
-      }
-
-      obj_vals[th_id] += M.C * (V - belief_score);
-      E[q].margin_bound = belief_score - max_nonbelief_score;
-      E[q].hist = 0;
 
-      if (I != belief_I) {
-        update_gradient(M, I, grad_blocks_th, M.C);
-        update_gradient(M, belief_I, grad_blocks_th, -1.0 * M.C);
+        obj_vals[th_id] += M.C * (V - belief_score);
+        E[q].margin_bound = belief_score - max_nonbelief_score;
+        E[q].hist = 0;
+
+        if (I != belief_I) {
+          if (L.is_built) {
+            update_coef(L, I, M.C);
+            update_coef(L, belief_I, -1.0 * M.C);
+          } else {
+            update_gradient(M, I, grad_th, block_offsets, dirty_th, M.C);
+            update_gradient(M, belief_I, grad_th, block_offsets, dirty_th,
+                            -1.0 * M.C);
+          }
+        }
       }
     }
   }
 
+  if (L.is_built)
+    add_layout_gradient(L, M, G);
+
   double obj_val = -INFINITY;
 
   if (M.reg_type == model::REG_L2) {
@@ -263,7 +562,7 @@ void gradient(double *obj_val_out, double *grad, const int dim,
     for (int b = 0; b < M.num_blocks; b++) {
       const double *wb  = w[b];
       double reg_mult   = M.reg_mult[b];
-      double *ptr_grad  = grad_blocks[0][b];
+      double *ptr_grad  = grad + block_offsets[b];
       double learn_mult = (M.learn_mult[b] == 0) ? 0 : 1;
       for (int k = 0; k < M.block_sizes[b]; k++) {
         *(ptr_grad++) += wb[k] * reg_mult * learn_mult;
@@ -321,7 +620,7 @@ void gradient(double *obj_val_out, double *grad, const int dim,
         int b = M.component_blocks[c][i];
         double reg_mult = M.reg_mult[b];
         double *wb = w[b];
-        double *ptr_grad = grad_blocks[0][b];
+        double *ptr_grad = grad + block_offsets[b];
         if (M.learn_mult[b] != 0)
           for (int k = 0; k < M.block_sizes[b]; k++)
             *(ptr_grad++) += wb[k] * reg_mult * cmult;
@@ -329,18 +628,29 @@ void gradient(double *obj_val_out, double *grad, const int dim,
     }
   }
 
-  for (int t = 0; t < num_threads; t++) {
+  for (int t = 0; t < num_threads; t++)
     obj_val += obj_vals[t];
-    double *ptr_grad = grad_threads[t];
-    for (int i = 0; i < dim; i++)
-      grad[i] += ptr_grad[i];
-    delete [] grad_threads[t];
-    delete [] grad_blocks[t];
-  }
-  delete [] grad_threads;
-  delete [] grad_blocks;
   delete [] obj_vals;
 
+  // Sum the per-thread gradients in parallel over blocks, skipping
+  // blocks a thread didn't touch and zeroing the ones it did for the
+  // next call
+  #pragma omp parallel for schedule(dynamic)
+  for (int b = 0; b < M.num_blocks; b++) {
+    double *dst = grad + block_offsets[b];
+    const int s = M.block_sizes[b];
+    for (int t = 0; t < G.num_threads; t++) {
+      if (!G.dirty[t][b])
+        continue;
+      double *src = &G.grad[t][block_offsets[b]];
+      for (int k = 0; k < s; k++) {
+        dst[k] += src[k];
+        src[k] = 0;
+      }
+      G.dirty[t][b] = 0;
+    }
+  }
+
   *obj_val_out = obj_val;
 }
 
@@ -27,21 +27,50 @@
 /** -----------------------------------------------------------------
  ** Compute the objective function value
  **/ 
-void obj_val(double out[3], ex_cache &E, model &M);
+void obj_val(double out[3], ex_cache &E, model &M, fv_layout &L);
+
+
+/** -----------------------------------------------------------------
+ ** Per-thread gradient accumulators that persist across calls to
+ ** gradient()
+ **
+ ** Each thread adds its subgradients to its own buffer and marks the
+ ** blocks it touches as dirty. gradient() sums the dirty blocks in 
+ ** parallel over blocks and zeros them again, so the buffers are all
+ ** zero between calls.
+ **/
+struct gradient_buffers {
+  int num_threads;
+  // Offset of each block in a gradient vector (num_blocks+1 entries)
+  vector<int> block_offsets;
+  // Gradient per thread
+  vector< vector<double> > grad;
+  // Blocks of each thread's gradient that may be nonzero
+  vector< vector<char> > dirty;
+
+  gradient_buffers() {
+    num_threads = 0;
+  }
+
+  void init(const model &M, int num_threads);
+  void free();
+};
 
 
 /** -----------------------------------------------------------------
  ** Compute the LSVM function value and gradient at M.w over the 
- ** cache
+ ** cache (through the columnar layout L if it is built)
  **/ 
 void gradient(double *obj_val, double *grad, int dim, ex_cache &E, 
-              const model &M, int num_threads);
+              const model &M, int num_threads, gradient_buffers &G,
+              fv_layout &L);
 
 
 /** -----------------------------------------------------------------
  ** Update various (objective function specific) bits of information 
  ** about each feature vector
  **/
-void compute_info(const ex_cache &E, fv_cache &F, const model &M);
+void compute_info(ex_cache &E, fv_cache &F, const model &M, 
+                  fv_layout &L);
 
 #endif // OBJ_FUNC_H
@@ -0,0 +1,60 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef CANDIDATES_H
+#define CANDIDATES_H
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/** -----------------------------------------------------------------
+ ** Start symbol location above the threshold
+ **/
+struct candidate {
+  double score;
+  int level;
+  int index;    // linear (column-major) index into the level's table
+};
+
+
+/** -----------------------------------------------------------------
+ ** Is a ranked before b?
+ ** (used as the heap comparator, so the heap top is the candidate
+ ** that is ranked last)
+ **/
+static inline bool ranked_before(const candidate &a, const candidate &b) {
+  if (a.score != b.score)
+    return a.score > b.score;
+  if (a.level != b.level)
+    return a.level < b.level;
+  return a.index < b.index;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Add c to the bounded heap h (keeps the best max_num candidates)
+ **/
+static inline void heap_add(vector<candidate> &h, const candidate &c,
+                            size_t max_num) {
+  if (h.size() < max_num) {
+    h.push_back(c);
+    push_heap(h.begin(), h.end(), ranked_before);
+  } else if (ranked_before(c, h.front())) {
+    pop_heap(h.begin(), h.end(), ranked_before);
+    h.back() = c;
+    push_heap(h.begin(), h.end(), ranked_before);
+  }
+}
+
+#endif // CANDIDATES_H
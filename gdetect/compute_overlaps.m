@@ -39,6 +39,15 @@ num_comps = length(model.rules{model.start});
 num_boxes = size(boxes, 1);
 overlaps = [];
 
+% Compute all overlaps in one call if compute_overlaps_mex has been
+% compiled (see compile.m)
+if exist('compute_overlaps_mex') == 3  % 3 ==> MEX function
+  [detwins, shifts, dims, scales] = window_geometry(pyra, model);
+  overlaps = compute_overlaps_mex(boxes, detwins, shifts, dims, scales, ...
+                                  pyra.padx, pyra.pady, pyra.imsize);
+  return;
+end
+
 for comp = 1:num_comps
   detwin = model.rules{model.start}(comp).detwindow;
   shift = model.rules{model.start}(comp).shiftwindow;
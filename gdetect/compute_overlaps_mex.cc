@@ -0,0 +1,110 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2009-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "mex.h"
+#include "overlap.h"
+#include <omp.h>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Batched version of compute_overlap.cc used by compute_overlaps.m.
+ *
+ * Computes the overlap maps of every (component, box, level) triple
+ * in one call; the triples are processed in parallel. Each map is
+ * computed from separable x/y terms (see overlap.h), with the same
+ * arithmetic as compute_overlap.cc, so the results are identical.
+ */
+
+
+/** -----------------------------------------------------------------
+ ** One overlap map to compute
+ **/
+struct overlap_job {
+  int comp;
+  int box;
+  int level;
+  double *o;      // output (dims of the level, zero filled)
+};
+
+
+// matlab entry point
+//                                     0      1        2       3     4
+// overlaps = compute_overlaps_mex(boxes, detwins, shifts, dims, scales,
+//                                 5     6     7
+//                                 padx, pady, imsize)
+// boxes    bounding boxes (one per row) in image coordinates
+//          [x1 y1 x2 y2 ...]
+// detwins  num_comps x 2 matrix of detection window sizes [rows cols]
+// shifts   num_comps x 2 matrix of detection window shifts [y x]
+// dims     num_levels x 2 x num_comps array of score table sizes
+//          [rows cols]; levels with 0 rows are skipped
+// scales   image scale each feature map was computed at (sbin/scale)
+// padx     x padding added to feature maps
+// pady     y padding added to feature maps
+// imsize   size of the image [h w]
+//
+// overlaps(c).box(b).o{l}  see compute_overlaps.m ([] if there are no
+//                          boxes)
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs != 8)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs > 1)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  window_geometry A;
+  A.read(prhs);
+  if (A.num_boxes == 0 || A.num_comps == 0) {
+    plhs[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+    return;
+  }
+
+  // Create all outputs (from this thread) and collect the jobs
+  const char *comp_fields[] = { "box" };
+  const char *box_fields[]  = { "o" };
+  mxArray *mx_overlaps = mxCreateStructMatrix(1, A.num_comps, 1, comp_fields);
+  vector<overlap_job> jobs;
+  for (int c = 0; c < A.num_comps; c++) {
+    mxArray *mx_box = mxCreateStructMatrix(1, A.num_boxes, 1, box_fields);
+    mxSetField(mx_overlaps, c, "box", mx_box);
+    for (int b = 0; b < A.num_boxes; b++) {
+      mxArray *mx_o = mxCreateCellMatrix(A.num_levels, 1);
+      mxSetField(mx_box, b, "o", mx_o);
+      for (int l = 0; l < A.num_levels; l++) {
+        if (A.rows(c, l) == 0)
+          continue;
+        mxArray *mx_map = mxCreateDoubleMatrix(A.rows(c, l), A.cols(c, l),
+                                               mxREAL);
+        mxSetCell(mx_o, l, mx_map);
+        overlap_job J = { c, b, l, mxGetPr(mx_map) };
+        jobs.push_back(J);
+      }
+    }
+  }
+
+  #pragma omp parallel
+  {
+    overlap_terms T;
+    #pragma omp for schedule(dynamic)
+    for (int i = 0; i < (int)jobs.size(); i++) {
+      const overlap_job &J = jobs[i];
+      A.terms(J.comp, J.box, J.level, T);
+      // (the map is zero filled, so empty columns are skipped)
+      for (int x = 0; x < T.cols; x++)
+        if (!T.column_empty(x))
+          T.column(x, J.o + x*T.rows);
+    }
+  }
+
+  plhs[0] = mx_overlaps;
+}
@@ -0,0 +1,153 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "mex.h"
+#include "candidates.h"
+#include <omp.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/*
+ * Top scoring start symbol locations.
+ *
+ * Replaces the find/concatenate/sort loop in gdetect_parse.m. The
+ * score tables of all levels are scanned in parallel (in chunks of
+ * columns) and each thread keeps a bounded heap with its max_num
+ * best locations above the threshold. The per-thread heaps are
+ * merged and sorted at the end, so the work per location is a
+ * compare (plus a heap update for locations that make the cut).
+ *
+ * Candidates are ordered by decreasing score; ties are broken by
+ * level and then by linear index, which is the order produced by
+ * the (stable) sort in gdetect_parse.m.
+ */
+
+// Number of table elements per parallel chunk
+static const int CHUNK_SIZE = 1<<16;
+
+
+/** -----------------------------------------------------------------
+ ** Part of one level's score table scanned by a single thread
+ **/
+struct chunk {
+  int level;
+  int begin;
+  int end;
+};
+
+
+// matlab entry point
+//                                      0       1       2        3
+// [X, Y, L, S] = detection_candidates(scores, thresh, max_num, num_threads)
+// scores       model.symbols(model.start).score (cell array, one table
+//              per level)
+// thresh       detection threshold (scores must be > thresh)
+// max_num      maximum number of candidates to return (inf => all)
+// num_threads  number of threads (optional; default: all processors)
+//
+// X, Y, L      int32 column vectors of 1-based locations and levels
+// S            scores (sorted in decreasing order)
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 3 || nrhs > 4)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs != 4)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  const mxArray *mx_scores = prhs[0];
+  if (!mxIsCell(mx_scores))
+    mexErrMsgTxt("Invalid input: scores must be a cell array");
+  const double thresh = mxGetScalar(prhs[1]);
+  const double in_max = mxGetScalar(prhs[2]);
+  int num_threads = omp_get_max_threads();
+  if (nrhs > 3)
+    num_threads = max(1, (int)mxGetScalar(prhs[3]));
+
+  const int num_levels = mxGetNumberOfElements(mx_scores);
+  vector<const double *> tables(num_levels, (const double *)NULL);
+  vector<int> rows(num_levels, 0);
+  vector<chunk> chunks;
+  size_t total = 0;
+  for (int l = 0; l < num_levels; l++) {
+    const mxArray *mx_s = mxGetCell(mx_scores, l);
+    if (mx_s == NULL || mxIsEmpty(mx_s))
+      continue;
+    if (mxGetClassID(mx_s) != mxDOUBLE_CLASS)
+      mexErrMsgTxt("Invalid input: score tables must be double precision");
+    tables[l] = mxGetPr(mx_s);
+    rows[l]   = mxGetM(mx_s);
+    const int n = mxGetNumberOfElements(mx_s);
+    total += n;
+    for (int i = 0; i < n; i += CHUNK_SIZE) {
+      chunk c = { l, i, min(n, i + CHUNK_SIZE) };
+      chunks.push_back(c);
+    }
+  }
+
+  // No more candidates than locations can be returned
+  size_t max_num = total;
+  if (in_max < (double)total)
+    max_num = (size_t)max(0.0, in_max);
+
+  vector<vector<candidate> > heaps(num_threads);
+  if (max_num > 0) {
+    #pragma omp parallel num_threads(num_threads)
+    {
+      vector<candidate> &h = heaps[omp_get_thread_num()];
+      #pragma omp for schedule(dynamic)
+      for (int i = 0; i < (int)chunks.size(); i++) {
+        const chunk &c = chunks[i];
+        const double *s = tables[c.level];
+        for (int j = c.begin; j < c.end; j++) {
+          // once the heap is full, most locations fail this test
+          if (s[j] > thresh) {
+            candidate cand = { s[j], c.level, j };
+            heap_add(h, cand, max_num);
+          }
+        }
+      }
+    }
+  }
+
+  // Merge the per-thread heaps and keep the best max_num
+  vector<candidate> &all = heaps[0];
+  for (int t = 1; t < num_threads; t++)
+    all.insert(all.end(), heaps[t].begin(), heaps[t].end());
+  sort(all.begin(), all.end(), ranked_before);
+  if (all.size() > max_num)
+    all.resize(max_num);
+
+  const int n = all.size();
+  mxArray *mx_X = mxCreateNumericMatrix(n, 1, mxINT32_CLASS, mxREAL);
+  mxArray *mx_Y = mxCreateNumericMatrix(n, 1, mxINT32_CLASS, mxREAL);
+  mxArray *mx_L = mxCreateNumericMatrix(n, 1, mxINT32_CLASS, mxREAL);
+  mxArray *mx_S = mxCreateNumericMatrix(n, 1, mxDOUBLE_CLASS, mxREAL);
+  int32_t *X = (int32_t *)mxGetData(mx_X);
+  int32_t *Y = (int32_t *)mxGetData(mx_Y);
+  int32_t *L = (int32_t *)mxGetData(mx_L);
+  double *S  = mxGetPr(mx_S);
+  for (int i = 0; i < n; i++) {
+    const candidate &c = all[i];
+    X[i] = c.index / rows[c.level] + 1;
+    Y[i] = c.index % rows[c.level] + 1;
+    L[i] = c.level + 1;
+    S[i] = c.score;
+  }
+
+  plhs[0] = mx_X;
+  plhs[1] = mx_Y;
+  plhs[2] = mx_L;
+  plhs[3] = mx_S;
+}
@@ -0,0 +1,1194 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef DP_H
+#define DP_H
+
+#include "mex.h"
+#include "grammar.h"
+#include "dp_sched.h"
+#include <xmmintrin.h>
+#include <omp.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/** -----------------------------------------------------------------
+ ** Native implementation of the dynamic programming algorithm in
+ ** gdetect_dp.m
+ **
+ ** Score tables are stored in column-major order (same as matlab).
+ ** All score tables at a pyramid level have the same dimensions:
+ ** the size of the largest filter response at that level (or 1x1
+ ** if the level is not valid). The engine does not own the tables;
+ ** the caller points it at storage of the right size (see
+ ** table_size()) before calling run().
+ **/
+
+/** -----------------------------------------------------------------
+ ** 2^p
+ **/
+static inline int dp_pow2(int p) { return (1<<p); }
+
+
+/** -----------------------------------------------------------------
+ ** x^2
+ **/
+static inline int dp_square(int x) { return x*x; }
+
+
+/** -----------------------------------------------------------------
+ ** Feature pyramid (pointers into the matlab pyra struct)
+ **/
+struct dp_pyramid {
+  int num_levels;
+  int padx;
+  int pady;
+  vector<const float *> feat;
+  // [rows cols features] for each level
+  vector<int> feat_dims;
+  vector<bool> valid;
+};
+
+
+/** -----------------------------------------------------------------
+ ** Model parameters (pointers into matlab arrays prepared by
+ ** gdetect_dp.m)
+ **/
+struct dp_params {
+  // Filters (single precision, already flipped) and their
+  // dimensions [rows cols features]
+  vector<const float *> filters;
+  vector<int> filter_dims;
+  // Per-rule offset + scale prior score for each level
+  // (indexed by grammar rule)
+  vector<const double *> offsets;
+  // Per-rule deformation parameters [ax bx ay by]
+  // (indexed by grammar rule; NULL for structural rules)
+  vector<const double *> defs;
+};
+
+
+/** -----------------------------------------------------------------
+ ** Rectangular region [y0, y1) x [x0, x1) of a score table
+ **/
+struct dp_rect {
+  int y0, y1, x0, x1;
+
+  dp_rect() : y0(0), y1(0), x0(0), x1(0) {}
+  dp_rect(int y0_, int y1_, int x0_, int x1_)
+    : y0(y0_), y1(y1_), x0(x0_), x1(x1_) {}
+
+  bool empty() const { return y0 >= y1 || x0 >= x1; }
+
+  bool full(int rows, int cols) const {
+    return y0 <= 0 && x0 <= 0 && y1 >= rows && x1 >= cols;
+  }
+
+  // Grow to the smallest rectangle containing this one and r
+  void join(const dp_rect &r) {
+    if (r.empty())
+      return;
+    if (empty()) {
+      *this = r;
+      return;
+    }
+    y0 = min(y0, r.y0);
+    y1 = max(y1, r.y1);
+    x0 = min(x0, r.x0);
+    x1 = max(x1, r.x1);
+  }
+
+  // Intersection with [0, rows) x [0, cols)
+  dp_rect clip(int rows, int cols) const {
+    return dp_rect(max(y0, 0), min(y1, rows), max(x0, 0), min(x1, cols));
+  }
+
+  dp_rect expand(int d) const {
+    return dp_rect(y0-d, y1+d, x0-d, x1+d);
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Set everything outside of region R (clipped to the table) to -inf
+ **/
+static inline void dp_mask(double *vals, int rows, int cols,
+                           const dp_rect &R) {
+  if (R.empty()) {
+    fill(vals, vals + rows*cols, -INFINITY);
+    return;
+  }
+  fill(vals, vals + R.x0*rows, -INFINITY);
+  for (int x = R.x0; x < R.x1; x++) {
+    double *col = vals + x*rows;
+    fill(col, col + R.y0, -INFINITY);
+    fill(col + R.y1, col + rows, -INFINITY);
+  }
+  fill(vals + R.x1*rows, vals + cols*rows, -INFINITY);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Scratch space used by one worker thread
+ **/
+struct dp_scratch {
+  vector<double>  M;
+  vector<int32_t> Ix;
+  vector<int32_t> Iy;
+  vector<int>     v;
+  vector<double>  z;
+  vector<double>  t;
+  // argmax tables for distance transforms whose argmaxes are not kept
+  vector<int32_t> dt_Ix;
+  vector<int32_t> dt_Iy;
+
+  void reserve(int max_area, int max_dim) {
+    M.resize(max_area);
+    Ix.resize(max_area);
+    Iy.resize(max_area);
+    dt_Ix.resize(max_area);
+    dt_Iy.resize(max_area);
+    v.resize(max_dim);
+    z.resize(max_dim+1);
+    t.resize(max_dim);
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Add a shifted and subsampled view of src into dst:
+ **   dst(y,x) += src(y0 + step*y, x0 + step*x)
+ ** where the source location is inside src. All other locations
+ ** in dst are set to -inf.
+ **/
+static inline void shift_accumulate(double *dst, int dst_h, int dst_w,
+                                    const double *src, int src_h, int src_w,
+                                    int y0, int x0, int step) {
+  // [lo, hi) range of output indices that sample inside src
+  int ylo = (y0 >= 0) ? 0 : (-y0 + step - 1) / step;
+  int yhi = (src_h - y0 <= 0) ? 0 : (src_h - y0 + step - 1) / step;
+  int xlo = (x0 >= 0) ? 0 : (-x0 + step - 1) / step;
+  int xhi = (src_w - x0 <= 0) ? 0 : (src_w - x0 + step - 1) / step;
+  ylo = min(ylo, dst_h);
+  xlo = min(xlo, dst_w);
+  yhi = max(ylo, min(yhi, dst_h));
+  xhi = max(xlo, min(xhi, dst_w));
+
+  fill(dst, dst + xlo*dst_h, -INFINITY);
+  for (int x = xlo; x < xhi; x++) {
+    double *d = dst + x*dst_h;
+    const double *s = src + (x0 + step*x)*src_h + y0;
+    fill(d, d + ylo, -INFINITY);
+    if (step == 1) {
+      for (int y = ylo; y < yhi; y++)
+        d[y] += s[y];
+    } else {
+      for (int y = ylo; y < yhi; y++)
+        d[y] += s[step*y];
+    }
+    fill(d + yhi, d + dst_h, -INFINITY);
+  }
+  fill(dst + xhi*dst_h, dst + dst_w*dst_h, -INFINITY);
+}
+
+
+/** -----------------------------------------------------------------
+ ** 1D bounded distance transform (see fast_bounded_dt.cc)
+ **/
+static inline void dp_dt1d(const double *src, int step, double *dst,
+                           int dst_step, int32_t *ptr, int n,
+                           double a, double b, double range,
+                           int *v, double *z, const double *t) {
+  static const double eps = 0.00001;
+  int k     = 0;
+  v[0]      = 0;
+  z[0]      = -INFINITY;
+  z[1]      = +INFINITY;
+
+  double a_inv = 1/a;
+
+  for (int q = 1; q <= n-1; q++) {
+    // compute unbounded point of intersection
+    double s = 0.5 * ((src[q*step] - src[v[k]*step]) * t[q - v[k]]
+                      + q + v[k]
+                      - b * a_inv);
+
+    // bound point of intersection; +/- eps to handle boundary conditions
+    s = min(v[k]+range+eps, max(q-range-eps, s));
+
+    while (s <= z[k]) {
+      // delete dominiated parabola
+      k--;
+      s = 0.5 * ((src[q*step] - src[v[k]*step]) * t[q - v[k]]
+                  + q + v[k]
+                  - b * a_inv);
+      s = min(v[k]+range+eps, max(q-range-eps, s));
+    }
+    k++;
+    v[k]   = q;
+    z[k]   = s;
+  }
+  z[k+1] = INFINITY;
+
+  k = 0;
+  for (int q = 0; q <= n-1; q++) {
+    while (z[k+1] < q)
+      k++;
+    dst[q*dst_step] = a*dp_square(q-v[k]) + b*(q-v[k]) + src[v[k]*step];
+    ptr[q*step] = v[k];
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** 2D bounded distance transform computed in place on the block B
+ ** of vals (a rows x cols table). Outside of B, vals, Ix and Iy are
+ ** not touched. Ix and Iy receive 1-based argmax locations in the
+ ** full table (same as fast_bounded_dt.cc when B is the whole table).
+ **/
+static inline void dp_bounded_dt(double *vals, int rows, int cols,
+                                 const dp_rect &B,
+                                 const double *def, double range,
+                                 int32_t *Ix, int32_t *Iy, dp_scratch &sc) {
+  const double ax = def[0];
+  const double bx = def[1];
+  const double ay = def[2];
+  const double by = def[3];
+  const int bh    = B.y1 - B.y0;
+  const int bw    = B.x1 - B.x0;
+  double *base    = vals + B.x0*rows + B.y0;
+
+  double  *tmpM  = &sc.M[0];
+  int32_t *tmpIx = &sc.Ix[0];
+  int32_t *tmpIy = &sc.Iy[0];
+  int     *v     = &sc.v[0];
+  double  *z     = &sc.z[0];
+  double  *t     = &sc.t[0];
+
+  // cache divisive factors used in 1d distance transforms
+  t[0] = INFINITY;
+  for (int y = 1; y < bh; y++)
+    t[y] = 1 / (-ay * y);
+
+  for (int x = 0; x < bw; x++)
+    dp_dt1d(base+x*rows, 1, tmpM+x*bh, 1, tmpIy+x*bh, bh,
+            -ay, -by, range, v, z, t);
+
+  for (int x = 1; x < bw; x++)
+    t[x] = 1 / (-ax * x);
+
+  for (int y = 0; y < bh; y++)
+    dp_dt1d(tmpM+y, bh, base+y, rows, tmpIx+y, bw,
+            -ax, -bx, range, v, z, t);
+
+  // get argmaxes and adjust for matlab indexing from 1
+  for (int x = 0; x < bw; x++) {
+    for (int y = 0; y < bh; y++) {
+      const int p = x*bh+y;
+      const int q = (B.x0+x)*rows + B.y0+y;
+      Ix[q] = B.x0 + tmpIx[p]+1;
+      Iy[q] = B.y0 + tmpIy[tmpIx[p]*bh+y]+1;
+    }
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** 16-byte aligned float buffer that only grows
+ **/
+struct dp_aligned_buffer {
+  float *data;
+  size_t capacity;
+
+  dp_aligned_buffer() : data(NULL), capacity(0) {}
+  ~dp_aligned_buffer() { release(); }
+
+  float *reserve(size_t n) {
+    if (n > capacity) {
+      release();
+      data = (float *)_mm_malloc(n*sizeof(float), 16);
+      if (data == NULL)
+        mexErrMsgTxt("Out of memory");
+      capacity = n;
+    }
+    return data;
+  }
+
+  void release() {
+    if (data != NULL)
+      _mm_free(data);
+    data = NULL;
+    capacity = 0;
+  }
+
+private:
+  dp_aligned_buffer(const dp_aligned_buffer &);
+  dp_aligned_buffer &operator=(const dp_aligned_buffer &);
+};
+
+
+/** -----------------------------------------------------------------
+ ** Number of floats used by dp_prepare for a map of size dims
+ ** (a multiple of 4, so consecutive maps stay 16-byte aligned)
+ **/
+static inline size_t dp_prepared_size(const int *dims, int nf4) {
+  return (size_t)dims[0]*dims[1]*nf4;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Copy a column-major feature map (or filter) into F using an
+ ** interleaved layout with the feature dimension padded to a
+ ** multiple of 4 (see fconv_sse_meta.cc). F must be 16-byte aligned
+ ** and hold dp_prepared_size(dims, nf4) floats.
+ **/
+static inline void dp_prepare(const float *in, const int *dims, int nf4,
+                              float *F) {
+  float *p = F;
+  for (int x = 0; x < dims[1]; x++) {
+    for (int y = 0; y < dims[0]; y++) {
+      for (int f = 0; f < dims[2]; f++)
+        *(p++) = in[y + f*dims[0]*dims[1] + x*dims[0]];
+      for (int f = dims[2]; f < nf4; f++)
+        *(p++) = 0;
+    }
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Filter response of prepared filter B on prepared feature map A
+ ** The response is written into the upper-left corner of C, which
+ ** has size out_h x out_w. Only locations inside region R are
+ ** computed; the rest of C is filled with -inf.
+ **/
+static inline void dp_conv(const float *A, const int *A_dims,
+                           const float *B, const int *B_dims, int nf4,
+                           double *C, int out_h, int out_w,
+                           const dp_rect &R) {
+  const int h   = A_dims[0] - B_dims[0] + 1;
+  const int w   = A_dims[1] - B_dims[1] + 1;
+  const int len = B_dims[0]*nf4;
+  const dp_rect V = R.clip(min(h, out_h), min(w, out_w));
+
+  if (!V.full(out_h, out_w))
+    fill(C, C + out_h*out_w, -INFINITY);
+
+  for (int x = V.x0; x < V.x1; x++) {
+    double *dst = C + x*out_h;
+    for (int y = V.y0; y < V.y1; y++) {
+      __m128 accum = _mm_setzero_ps();
+      const float *A_src = A + (y + x*A_dims[0])*nf4;
+      const float *B_src = B;
+      for (int xp = 0; xp < B_dims[1]; xp++) {
+        // filter column xp is a contiguous run of len floats in both
+        // the feature map and the filter
+        for (int k = 0; k < len; k += 4) {
+          __m128 a = _mm_load_ps(A_src + k);
+          __m128 b = _mm_load_ps(B_src + k);
+          accum = _mm_add_ps(accum, _mm_mul_ps(a, b));
+        }
+        A_src += A_dims[0]*nf4;
+        B_src += len;
+      }
+      float buf[4] __attribute__ ((aligned (16)));
+      _mm_store_ps(buf, accum);
+      dst[y] = buf[0]+buf[1]+buf[2]+buf[3];
+    }
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** L2 norm of each cell (all features at one location) of a
+ ** column-major feature map or filter; N is dims[0] x dims[1]
+ ** If positive_only is set, only the positive entries are counted.
+ ** Returns true if no entry is negative.
+ **/
+static inline bool dp_cell_norms(const float *feat, const int *dims,
+                                 bool positive_only, vector<double> &N) {
+  const int area = dims[0]*dims[1];
+  bool nonneg = true;
+  N.assign(area, 0);
+  for (int k = 0; k < dims[2]; k++) {
+    const float *f = feat + k*area;
+    for (int i = 0; i < area; i++) {
+      if (f[i] < 0) {
+        nonneg = false;
+        if (positive_only)
+          continue;
+      }
+      N[i] += (double)f[i]*f[i];
+    }
+  }
+  for (int i = 0; i < area; i++)
+    N[i] = sqrt(N[i]);
+  return nonneg;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Upper bound on the response of a filter from the cell norms of
+ ** the filter (B_norms) and of the feature map (A_norms):
+ **   <w, x> = sum_c <w_c, x_c> <= sum_c |w_c| |x_c|
+ ** When the features are nonnegative (e.g., HOG) the filter cell
+ ** norms can be taken over the positive weights only. This is a
+ ** single channel correlation, so it is much cheaper than the
+ ** filter response itself. The bound is inflated slightly to cover
+ ** rounding in the single precision convolution. Output layout is
+ ** the same as dp_conv.
+ **/
+static inline void dp_filter_bound(const vector<double> &A_norms,
+                                   const int *A_dims,
+                                   const vector<double> &B_norms,
+                                   const int *B_dims,
+                                   double *C, int out_h, int out_w) {
+  static const double slack = 1e-3;
+  const int h  = A_dims[0] - B_dims[0] + 1;
+  const int w  = A_dims[1] - B_dims[1] + 1;
+  const int bh = B_dims[0];
+  const int bw = B_dims[1];
+
+  fill(C, C + out_h*out_w, -INFINITY);
+  for (int x = 0; x < min(w, out_w); x++) {
+    double *dst = C + x*out_h;
+    for (int y = 0; y < min(h, out_h); y++) {
+      double val = 0;
+      for (int xp = 0; xp < bw; xp++) {
+        const double *a = &A_norms[(x+xp)*A_dims[0] + y];
+        const double *b = &B_norms[xp*bh];
+        for (int yp = 0; yp < bh; yp++)
+          val += a[yp]*b[yp];
+      }
+      dst[y] = val*(1 + slack) + slack;
+    }
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Dynamic programming engine
+ **/
+struct dp_engine {
+  const grammar *G;
+  int num_levels;
+
+  // [rows cols] of every score table at each level
+  vector<int> dims;
+
+  // Terminal symbol for each filter
+  vector<int> filter_symbols;
+
+  // Table storage (provided by the caller)
+  //  sym_score[s*num_levels + l]   score of symbol s at level l
+  //  rule_score[r*num_levels + l]  score of rule r at level l
+  //  rule_Ix, rule_Iy              argmax tables ('D' rules only)
+  //  sym_rule[s*num_levels + l]    argmax rule of symbol s at level l
+  //                                (1-based index into model.rules{s};
+  //                                optional, NULL => not recorded)
+  vector<double *>  sym_score;
+  vector<double *>  rule_score;
+  vector<int32_t *> rule_Ix;
+  vector<int32_t *> rule_Iy;
+  vector<uint8_t *> sym_rule;
+
+  // Score-bound pruning (see prune())
+  //  region[s*num_levels + l]  part of the tables of symbol s (and of
+  //                            the rules with lhs s) at level l that
+  //                            is computed; the rest is set to -inf
+  //  done[s*num_levels + l]    table was already computed by prune()
+  vector<dp_rect> region;
+  vector<char> done;
+
+  // Upper bound on the start symbol score at each level (set by
+  // prune(); -inf for levels without locations above the threshold,
+  // +inf if prune() was not run)
+  vector<double> level_bound;
+
+  // Half-width of the bounded distance transform window
+  static const int dt_range = 4;
+
+
+  /** ---------------------------------------------------------------
+   ** Constructor
+   **/
+  dp_engine() {
+    G             = NULL;
+    num_levels    = 0;
+    num_workers   = 1;
+    graph_version = 0;
+    graph_levels  = -1;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Compute the size of the score tables at each pyramid level
+   **/
+  void init(const grammar &g, const dp_pyramid &P, const dp_params &W) {
+    G          = &g;
+    num_levels = P.num_levels;
+    dims.assign(2*num_levels, 1);
+
+    filter_symbols.assign(G->num_filters, -1);
+    for (int s = 0; s < G->num_symbols; s++)
+      if (G->symbols[s].type == 'T')
+        filter_symbols[G->symbols[s].filter] = s;
+
+    for (int l = 0; l < num_levels; l++) {
+      if (!P.valid[l])
+        continue;
+      const int *A_dims = &P.feat_dims[3*l];
+      int rows = 0, cols = 0;
+      for (int i = 0; i < G->num_filters; i++) {
+        const int *B_dims = &W.filter_dims[3*i];
+        if (A_dims[2] != B_dims[2])
+          mexErrMsgTxt("Filter feature dimension doesn't match feature map");
+        int h = A_dims[0] - B_dims[0] + 1;
+        int w = A_dims[1] - B_dims[1] + 1;
+        if (h < 1 || w < 1)
+          mexErrMsgTxt("Filter is too large for feature map");
+        rows = max(rows, h);
+        cols = max(cols, w);
+      }
+      dims[2*l+0] = rows;
+      dims[2*l+1] = cols;
+    }
+
+    sym_score.assign(G->num_symbols*num_levels, (double *)NULL);
+    rule_score.assign(G->rules.size()*num_levels, (double *)NULL);
+    rule_Ix.assign(G->rules.size()*num_levels, (int32_t *)NULL);
+    rule_Iy.assign(G->rules.size()*num_levels, (int32_t *)NULL);
+    sym_rule.assign(G->num_symbols*num_levels, (uint8_t *)NULL);
+
+    region.resize(G->num_symbols*num_levels);
+    for (int s = 0; s < G->num_symbols; s++)
+      for (int l = 0; l < num_levels; l++)
+        region[s*num_levels + l] = dp_rect(0, dims[2*l], 0, dims[2*l+1]);
+    done.assign(G->num_symbols*num_levels, 0);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Number of elements in each score table at level l
+   **/
+  int table_size(int l) const { return dims[2*l]*dims[2*l+1]; }
+
+
+  /** ---------------------------------------------------------------
+   ** Does symbol s need a score table?
+   ** (terminals and nonterminals reachable from the start symbol)
+   **/
+  bool has_table(int s) const {
+    if (G->symbols[s].type == 'T')
+      return true;
+    return find(G->order.begin(), G->order.end(), s) != G->order.end();
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Can the argmax rule of symbol s be recorded in a uint8 table?
+   **/
+  bool has_rule_table(int s) const {
+    const int n = G->symbols[s].rules.size();
+    return n > 0 && n <= 255 && has_table(s);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Build the (symbol, level) task graph
+   **
+   ** Task s*num_levels + l computes the score of symbol s at level l:
+   ** the filter response for a terminal, or all rules with lhs s
+   ** followed by the pointwise max for a nonterminal. Deformation
+   ** rules read their rhs at the same level and structural rules
+   ** read rhs j at level l - interval*ds_j, so everything except
+   ** those reads is independent across levels.
+   **/
+  void build_task_graph(dp_task_graph &g) const {
+    g.init(G->num_symbols*num_levels);
+    for (int s = 0; s < G->num_symbols; s++) {
+      if (!has_table(s))
+        continue;
+      for (int l = 0; l < num_levels; l++)
+        g.active[s*num_levels + l] = 1;
+    }
+
+    for (int i = 0; i < (int)G->order.size(); i++) {
+      const int s = G->order[i];
+      const vector<int> &srules = G->symbols[s].rules;
+      for (int j = 0; j < (int)srules.size(); j++) {
+        const grammar::rule &r = G->rules[srules[j]];
+        for (int k = 0; k < (int)r.rhs.size(); k++) {
+          const int ds = (r.type == 'S') ? r.anchor_ds(k) : 0;
+          for (int l = 0; l < num_levels; l++) {
+            const int level = l - G->interval*ds;
+            if (level >= 0)
+              g.add_dep(r.rhs[k]*num_levels + level, s*num_levels + l);
+          }
+        }
+      }
+    }
+    g.finalize();
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Runs a single (symbol, level) task for the scheduler
+   **/
+  struct task_runner {
+    dp_engine *E;
+    const dp_pyramid *P;
+    const dp_params *W;
+    // Prepared (SSE layout) feature maps and filters
+    const vector<float *> *A;
+    const vector<float *> *B;
+    int nf4;
+    vector<dp_scratch> *scratch;
+    // Bound pass (see prune()): terminals that are not exact get an
+    // upper bound on their filter response
+    bool bound;
+    const vector<char> *exact;
+    const vector<vector<double> > *feat_norms;
+    const vector<vector<double> > *filter_norms;
+
+    void run_task(int task, int worker) {
+      const int s = task / E->num_levels;
+      const int l = task % E->num_levels;
+      const grammar::symbol &sym = E->G->symbols[s];
+      if (E->done[task])
+        return;
+      if (sym.type == 'T') {
+        if (bound && !(*exact)[s])
+          E->filter_bound(*P, *W, (*feat_norms)[l],
+                          (*filter_norms)[sym.filter], sym.filter, l);
+        else
+          E->filter_response(*P, *W, (*A)[l], (*B)[sym.filter], nf4,
+                             sym.filter, l);
+        return;
+      }
+      dp_scratch &sc = (*scratch)[worker];
+      for (int j = 0; j < (int)sym.rules.size(); j++) {
+        const int ri = sym.rules[j];
+        const grammar::rule &r = E->G->rules[ri];
+        if (r.type == 'S')
+          E->apply_structural_rule(r, ri, l, *P, *W);
+        else
+          E->apply_deformation_rule(r, ri, l, *W, sc);
+      }
+      E->symbol_score(s, l);
+    }
+  };
+
+
+  // Buffers kept between runs. A run on a pyramid and grammar that
+  // are no larger than in a previous run does not allocate memory.
+  vector<dp_scratch> scratch;
+  dp_aligned_buffer prepared;
+  vector<float *> prep_A;
+  vector<float *> prep_B;
+  dp_task_graph graph;
+  // The task graph only depends on the grammar and the number of
+  // levels; it is rebuilt when either changes (graph_active holds
+  // its task set, which run_level() overwrites)
+  unsigned int graph_version;
+  int graph_levels;
+  vector<char> graph_active;
+  dp_scheduler<task_runner> sched;
+  task_runner runner;
+  int num_workers;
+  // prune() state
+  vector<char> exact;
+  vector<char> visited;
+  vector<char> nonneg;
+  vector<vector<double> > feat_norms;
+  vector<vector<double> > filter_norms;
+  vector<double> bound_storage;
+  vector<double *> real_sym_score;
+  vector<double *> real_rule_score;
+  vector<int32_t *> real_rule_Ix;
+  vector<int32_t *> real_rule_Iy;
+  vector<uint8_t *> real_sym_rule;
+  vector<dp_rect> bound_region;
+
+
+  /** ---------------------------------------------------------------
+   ** Run the dynamic program
+   **/
+  void run(const dp_pyramid &P, const dp_params &W, int num_threads,
+           double thresh = -INFINITY) {
+    begin(P, W, num_threads, thresh, false);
+    sched.run(graph, runner, num_workers);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Prepare a run of the dynamic program without computing any
+   ** tables; they are then computed by sched.run() (all levels, see
+   ** run()) or level by level with run_level(). If bounds is set,
+   ** prune() is run even when thresh is -inf, so that level_bound
+   ** is available.
+   **/
+  void begin(const dp_pyramid &P, const dp_params &W, int num_threads,
+             double thresh, bool bounds) {
+    num_threads = max(1, num_threads);
+    num_workers = num_threads;
+
+    // Per-thread scratch space sized for the largest level
+    int max_area = 1, max_dim = 1;
+    for (int l = 0; l < num_levels; l++) {
+      max_area = max(max_area, table_size(l));
+      max_dim  = max(max_dim, max(dims[2*l], dims[2*l+1]));
+    }
+    if ((int)scratch.size() < num_threads)
+      scratch.resize(num_threads);
+    for (int t = 0; t < num_threads; t++)
+      scratch[t].reserve(max_area, max_dim);
+
+    // Convert filters and feature maps to the layout used by dp_conv
+    // (all in one buffer)
+    const int nf = (W.filter_dims.empty()) ? 0 : W.filter_dims[2];
+    const int nf4 = 4*((nf+3)/4);
+    size_t prepared_size = 0;
+    for (int i = 0; i < G->num_filters; i++)
+      prepared_size += dp_prepared_size(&W.filter_dims[3*i], nf4);
+    for (int l = 0; l < num_levels; l++)
+      if (P.valid[l])
+        prepared_size += dp_prepared_size(&P.feat_dims[3*l], nf4);
+    float *p = prepared.reserve(prepared_size);
+    prep_B.assign(G->num_filters, (float *)NULL);
+    prep_A.assign(num_levels, (float *)NULL);
+    for (int i = 0; i < G->num_filters; i++) {
+      prep_B[i] = p;
+      p += dp_prepared_size(&W.filter_dims[3*i], nf4);
+    }
+    for (int l = 0; l < num_levels; l++) {
+      if (P.valid[l]) {
+        prep_A[l] = p;
+        p += dp_prepared_size(&P.feat_dims[3*l], nf4);
+      }
+    }
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int i = 0; i < G->num_filters; i++)
+      dp_prepare(W.filters[i], &W.filter_dims[3*i], nf4, prep_B[i]);
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int l = 0; l < num_levels; l++)
+      if (P.valid[l])
+        dp_prepare(P.feat[l], &P.feat_dims[3*l], nf4, prep_A[l]);
+
+    if (graph_version != G->version || graph_levels != num_levels) {
+      build_task_graph(graph);
+      graph_active  = graph.active;
+      graph_version = G->version;
+      graph_levels  = num_levels;
+    } else {
+      graph.active = graph_active;
+    }
+
+    runner.E       = this;
+    runner.P       = &P;
+    runner.W       = &W;
+    runner.A       = &prep_A;
+    runner.B       = &prep_B;
+    runner.nf4     = nf4;
+    runner.scratch = &scratch;
+    runner.bound   = false;
+
+    level_bound.assign(num_levels, INFINITY);
+    if (thresh > -INFINITY || bounds)
+      prune(runner, num_threads, thresh);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Compute the start symbol table at level l and all tables it
+   ** depends on that haven't been computed yet (call after begin()).
+   ** Tables that no run_level() call computes are left uninitialized.
+   **/
+  void run_level(int l) {
+    fill(graph.active.begin(), graph.active.end(), 0);
+    activate(G->start, l);
+    sched.run(graph, runner, num_workers);
+    for (int t = 0; t < graph.num_tasks; t++)
+      if (graph.active[t])
+        done[t] = 1;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Number of symbol and rule score table entries computed so far
+   ** by prune() and run_level()
+   **/
+  size_t done_cells() const {
+    size_t cells = 0;
+    for (int t = 0; t < (int)done.size(); t++) {
+      if (done[t]) {
+        const int s = t / num_levels;
+        cells += table_size(t % num_levels)*(1 + G->symbols[s].rules.size());
+      }
+    }
+    return cells;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Activate the task of symbol s at level l and all of the tasks
+   ** it depends on (see build_task_graph())
+   **/
+  void activate(int s, int l) {
+    const int t = s*num_levels + l;
+    if (graph.active[t])
+      return;
+    graph.active[t] = 1;
+    const vector<int> &srules = G->symbols[s].rules;
+    for (int j = 0; j < (int)srules.size(); j++) {
+      const grammar::rule &r = G->rules[srules[j]];
+      for (int k = 0; k < (int)r.rhs.size(); k++) {
+        const int ds    = (r.type == 'S') ? r.anchor_ds(k) : 0;
+        const int level = l - G->interval*ds;
+        if (level >= 0)
+          activate(r.rhs[k], level);
+      }
+    }
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Response of filter i at level l
+   **/
+  void filter_response(const dp_pyramid &P, const dp_params &W,
+                       const float *A, const float *B, int nf4,
+                       int i, int l) {
+    const int t = filter_symbols[i]*num_levels + l;
+    double *C = sym_score[t];
+    if (!P.valid[l]) {
+      // not processing this level, so set default value
+      C[0] = -INFINITY;
+      return;
+    }
+    dp_conv(A, &P.feat_dims[3*l], B, &W.filter_dims[3*i], nf4,
+            C, dims[2*l], dims[2*l+1], region[t]);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Upper bound on the response of filter i at level l
+   **/
+  void filter_bound(const dp_pyramid &P, const dp_params &W,
+                    const vector<double> &feat_norms,
+                    const vector<double> &filter_norms, int i, int l) {
+    double *C = sym_score[filter_symbols[i]*num_levels + l];
+    if (!P.valid[l]) {
+      C[0] = -INFINITY;
+      return;
+    }
+    dp_filter_bound(feat_norms, &P.feat_dims[3*l],
+                    filter_norms, &W.filter_dims[3*i],
+                    C, dims[2*l], dims[2*l+1]);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Mark the terminals reached from symbol s without changing
+   ** pyramid level (e.g., root filters reached from the start symbol)
+   **/
+  void mark_exact(int s, vector<char> &exact, vector<char> &visited) const {
+    if (visited[s])
+      return;
+    visited[s] = 1;
+    if (G->symbols[s].type == 'T') {
+      exact[s] = 1;
+      return;
+    }
+    const vector<int> &srules = G->symbols[s].rules;
+    for (int j = 0; j < (int)srules.size(); j++) {
+      const grammar::rule &r = G->rules[srules[j]];
+      for (int k = 0; k < (int)r.rhs.size(); k++)
+        if (r.type == 'D' || r.anchor_ds(k) == 0)
+          mark_exact(r.rhs[k], exact, visited);
+    }
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Score-bound pruning
+   **
+   ** Runs the dynamic program once on upper bounds: the terminals
+   ** reached from the start symbol at its own level (the root
+   ** filters) get their exact responses, and every other terminal
+   ** gets the bound sum_c |w_c| |x_c| computed from the norms of
+   ** the filter and feature map cells (see dp_filter_bound). With
+   ** nonnegative features only the positive filter weights count.
+   ** Structural rules, bounded distance transforms and max are all
+   ** monotone, so the result bounds the score of the start symbol
+   ** everywhere.
+   **
+   ** Locations where the bound is <= thresh can't be detections.
+   ** The bounding box of the remaining locations at each level is
+   ** propagated down the grammar to give the region of each table
+   ** that the real pass has to compute (levels with no remaining
+   ** locations get empty regions). Inside those regions the real
+   ** pass computes exact scores, so all start symbol scores > thresh
+   ** are unchanged; everything else is -inf.
+   **
+   ** The exact root filter responses are kept and not recomputed.
+   **/
+  void prune(task_runner &runner, int num_threads, double thresh) {
+    const dp_pyramid &P = *runner.P;
+    const dp_params &W  = *runner.W;
+    const int L         = num_levels;
+
+    exact.assign(G->num_symbols, 0);
+    visited.assign(G->num_symbols, 0);
+    mark_exact(G->start, exact, visited);
+
+    if ((int)feat_norms.size() < L)
+      feat_norms.resize(L);
+    nonneg.assign(L, 1);
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int l = 0; l < L; l++)
+      if (P.valid[l])
+        nonneg[l] = dp_cell_norms(P.feat[l], &P.feat_dims[3*l], false,
+                                  feat_norms[l]);
+    const bool positive_only =
+      (find(nonneg.begin(), nonneg.end(), 0) == nonneg.end());
+
+    if ((int)filter_norms.size() < G->num_filters)
+      filter_norms.resize(G->num_filters);
+    for (int i = 0; i < G->num_filters; i++)
+      dp_cell_norms(W.filters[i], &W.filter_dims[3*i], positive_only,
+                    filter_norms[i]);
+
+    // Point the engine at bound tables (exact terminals are computed
+    // directly into their final tables)
+    real_sym_score  = sym_score;
+    real_rule_score = rule_score;
+    real_rule_Ix    = rule_Ix;
+    real_rule_Iy    = rule_Iy;
+    real_sym_rule   = sym_rule;
+
+    int level_area = 0;
+    for (int l = 0; l < L; l++)
+      level_area += table_size(l);
+    bound_storage.resize((G->num_symbols + G->rules.size())*level_area);
+    double *p = bound_storage.empty() ? NULL : &bound_storage[0];
+    for (int s = 0; s < G->num_symbols; s++) {
+      for (int l = 0; l < L; l++) {
+        if (!exact[s])
+          sym_score[s*L + l] = p;
+        p += table_size(l);
+      }
+    }
+    for (int ri = 0; ri < (int)G->rules.size(); ri++) {
+      for (int l = 0; l < L; l++) {
+        rule_score[ri*L + l] = p;
+        p += table_size(l);
+      }
+    }
+    rule_Ix.assign(rule_Ix.size(), (int32_t *)NULL);
+    rule_Iy.assign(rule_Iy.size(), (int32_t *)NULL);
+    sym_rule.assign(sym_rule.size(), (uint8_t *)NULL);
+
+    runner.bound        = true;
+    runner.exact        = &exact;
+    runner.feat_norms   = &feat_norms;
+    runner.filter_norms = &filter_norms;
+    sched.run(graph, runner, num_threads);
+    runner.bound        = false;
+
+    // Region of each start symbol table that can score above thresh
+    bound_region.assign(G->num_symbols*L, dp_rect());
+    const int start = G->start;
+    for (int l = 0; l < L; l++) {
+      const int rows = dims[2*l];
+      const int cols = dims[2*l+1];
+      const double *ub = sym_score[start*L + l];
+      dp_rect &R = bound_region[start*L + l];
+      double &B  = level_bound[l];
+      B = -INFINITY;
+      for (int x = 0; x < cols; x++) {
+        for (int y = 0; y < rows; y++) {
+          if (ub[x*rows + y] > thresh) {
+            R.join(dp_rect(y, y+1, x, x+1));
+            B = max(B, ub[x*rows + y]);
+          }
+        }
+      }
+    }
+
+    // Propagate regions from each symbol to its rhs symbols (parents
+    // are visited before their children in reverse topological order)
+    for (int i = (int)G->order.size()-1; i >= 0; i--) {
+      const int s = G->order[i];
+      const vector<int> &srules = G->symbols[s].rules;
+      for (int l = 0; l < L; l++) {
+        const dp_rect R = bound_region[s*L + l];
+        if (R.empty())
+          continue;
+        for (int j = 0; j < (int)srules.size(); j++) {
+          const grammar::rule &r = G->rules[srules[j]];
+          if (r.type == 'D') {
+            dp_rect C = R.expand(dt_range).clip(dims[2*l], dims[2*l+1]);
+            bound_region[r.rhs[0]*L + l].join(C);
+            continue;
+          }
+          for (int k = 0; k < (int)r.rhs.size(); k++) {
+            const int ds    = r.anchor_ds(k);
+            const int level = l - G->interval*ds;
+            if (level < 0)
+              continue;
+            const int step = dp_pow2(ds);
+            const int y0   = r.anchor_y(k) - (step-1)*P.pady;
+            const int x0   = r.anchor_x(k) - (step-1)*P.padx;
+            dp_rect C(y0 + step*R.y0, y0 + step*(R.y1-1) + 1,
+                      x0 + step*R.x0, x0 + step*(R.x1-1) + 1);
+            C = C.clip(dims[2*level], dims[2*level+1]);
+            bound_region[r.rhs[k]*L + level].join(C);
+          }
+        }
+      }
+    }
+
+    sym_score  = real_sym_score;
+    rule_score = real_rule_score;
+    rule_Ix    = real_rule_Ix;
+    rule_Iy    = real_rule_Iy;
+    sym_rule   = real_sym_rule;
+    region     = bound_region;
+
+    for (int s = 0; s < G->num_symbols; s++) {
+      if (!exact[s])
+        continue;
+      for (int l = 0; l < L; l++) {
+        region[s*L + l] = dp_rect(0, dims[2*l], 0, dims[2*l+1]);
+        done[s*L + l] = 1;
+      }
+    }
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Structural rule: shift, subsample, and sum rhs symbol scores
+   **/
+  void apply_structural_rule(const grammar::rule &r, int ri, int l,
+                             const dp_pyramid &P, const dp_params &W) {
+    const int rows = dims[2*l];
+    const int cols = dims[2*l+1];
+    double *score  = rule_score[ri*num_levels + l];
+    const dp_rect &R = region[r.lhs*num_levels + l];
+    if (R.empty()) {
+      fill(score, score + rows*cols, -INFINITY);
+      return;
+    }
+    fill(score, score + rows*cols, W.offsets[ri][l]);
+
+    for (int j = 0; j < (int)r.rhs.size(); j++) {
+      const int ds    = r.anchor_ds(j);
+      const int level = l - G->interval*ds;
+      if (level < 0) {
+        fill(score, score + rows*cols, -INFINITY);
+        continue;
+      }
+      // step size for down sampling
+      const int step = dp_pow2(ds);
+      // starting points (simulates additional padding at finer scales)
+      const int y0 = r.anchor_y(j) - (step-1)*P.pady;
+      const int x0 = r.anchor_x(j) - (step-1)*P.padx;
+      shift_accumulate(score, rows, cols,
+                       sym_score[r.rhs[j]*num_levels + level],
+                       dims[2*level], dims[2*level+1], y0, x0, step);
+    }
+    if (!R.full(rows, cols))
+      dp_mask(score, rows, cols, R);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Deformation rule: bounded distance transform of the rhs score
+   **/
+  void apply_deformation_rule(const grammar::rule &r, int ri, int l,
+                              const dp_params &W, dp_scratch &sc) {
+    const int rows      = dims[2*l];
+    const int cols      = dims[2*l+1];
+    const double offset = W.offsets[ri][l];
+    const double *src   = sym_score[r.rhs[0]*num_levels + l];
+    double *score       = rule_score[ri*num_levels + l];
+    const dp_rect &R    = region[r.lhs*num_levels + l];
+    if (R.empty()) {
+      fill(score, score + rows*cols, -INFINITY);
+      return;
+    }
+
+    // The transform at R reads the rhs scores within dt_range of R
+    const dp_rect B = R.expand(dt_range).clip(rows, cols);
+    for (int x = B.x0; x < B.x1; x++)
+      for (int y = B.y0; y < B.y1; y++)
+        score[x*rows + y] = src[x*rows + y] + offset;
+
+    int32_t *Ix = rule_Ix[ri*num_levels + l];
+    int32_t *Iy = rule_Iy[ri*num_levels + l];
+    if (Ix == NULL) {
+      Ix = &sc.dt_Ix[0];
+      Iy = &sc.dt_Iy[0];
+    }
+    dp_bounded_dt(score, rows, cols, B, W.defs[ri], dt_range, Ix, Iy, sc);
+    if (!R.full(rows, cols))
+      dp_mask(score, rows, cols, R);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Symbol score: pointwise max over the rules with s on the lhs
+   **
+   ** If sym_rule has a table for (s, l), the argmax rule is recorded
+   ** too. Ties go to the first rule, which is the rule found by the
+   ** score equality search in get_detection_trees.cc.
+   **/
+  void symbol_score(int s, int l) {
+    const vector<int> &srules = G->symbols[s].rules;
+    const int n = table_size(l);
+    double *score = sym_score[s*num_levels + l];
+    if (srules.empty()) {
+      fill(score, score + n, -INFINITY);
+      return;
+    }
+    const double *first = rule_score[srules[0]*num_levels + l];
+    copy(first, first + n, score);
+    uint8_t *argmax = sym_rule[s*num_levels + l];
+    if (argmax == NULL) {
+      for (int j = 1; j < (int)srules.size(); j++) {
+        const double *rs = rule_score[srules[j]*num_levels + l];
+        for (int i = 0; i < n; i++)
+          score[i] = max(score[i], rs[i]);
+      }
+      return;
+    }
+    fill(argmax, argmax + n, 1);
+    for (int j = 1; j < (int)srules.size(); j++) {
+      const double *rs = rule_score[srules[j]*num_levels + l];
+      const uint8_t r  = j + 1;
+      for (int i = 0; i < n; i++) {
+        if (rs[i] > score[i]) {
+          score[i]  = rs[i];
+          argmax[i] = r;
+        }
+      }
+    }
+  }
+};
+
+#endif // DP_H
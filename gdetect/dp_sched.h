@@ -0,0 +1,361 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef DP_SCHED_H
+#define DP_SCHED_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/** -----------------------------------------------------------------
+ ** Task dependency graph
+ **
+ ** Tasks are numbered 0 ... num_tasks-1. A task may only run after
+ ** all of its predecessors have finished. Successor lists are stored
+ ** in compressed form: the successors of task t are
+ ** succ[succ_begin[t]] ... succ[succ_begin[t+1]-1].
+ **/
+struct dp_task_graph {
+  int num_tasks;
+  // Does task t exist? (tasks that don't exist are never run)
+  vector<char> active;
+  // Number of predecessors of each task
+  vector<int> num_deps;
+  vector<int> succ_begin;
+  vector<int> succ;
+
+  // Edges collected by add_dep() before finalize() is called
+  vector<pair<int, int> > edges;
+
+
+  /** ---------------------------------------------------------------
+   ** Start a graph with n (inactive) tasks
+   **/
+  void init(int n) {
+    num_tasks = n;
+    active.assign(n, 0);
+    num_deps.assign(n, 0);
+    succ_begin.assign(n+1, 0);
+    succ.clear();
+    edges.clear();
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Task b must wait for task a
+   **/
+  void add_dep(int a, int b) {
+    edges.push_back(make_pair(a, b));
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Remove duplicate edges and build the successor lists
+   **/
+  void finalize() {
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+    succ.resize(edges.size());
+    for (int i = 0; i < (int)edges.size(); i++) {
+      succ_begin[edges[i].first+1]++;
+      num_deps[edges[i].second]++;
+    }
+    for (int t = 0; t < num_tasks; t++)
+      succ_begin[t+1] += succ_begin[t];
+    for (int i = 0; i < (int)edges.size(); i++)
+      succ[i] = edges[i].second;
+    edges.clear();
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Work-stealing thread pool that runs a task graph
+ **
+ ** Each worker owns a deque of ready tasks. A worker takes tasks
+ ** from the back of its own deque and, when that is empty, steals
+ ** from the front of another worker's deque. When a task finishes,
+ ** its successors that become ready are pushed onto the deque of the
+ ** worker that ran it (so they tend to run while their inputs are
+ ** still in cache). The calling thread acts as worker 0.
+ **
+ ** Every task is pushed at most once per run, so each deque is a
+ ** flat array with room for all tasks and [head, tail) indices. The
+ ** scheduler keeps its buffers between runs; running a graph that
+ ** is no larger than a previous one does not allocate memory.
+ **
+ ** Worker threads are persistent: they are started the first time
+ ** a run needs them and then sleep on a condition variable between
+ ** runs. shutdown() stops and joins them (call it before the mex
+ ** file is unloaded).
+ **
+ ** Runner must provide: void run_task(int task, int worker)
+ ** run_task() is called from worker threads and must not call into
+ ** the matlab API.
+ **/
+template<class Runner>
+class dp_scheduler {
+public:
+  /** ---------------------------------------------------------------
+   ** Run all active tasks of g and wait for them to finish
+   **/
+  void run(const dp_task_graph &g, Runner &runner, int num_workers) {
+    // Start any missing pool threads before touching the run state
+    // (new threads wait for the next generation)
+    const int num_pool = max(1, num_workers) - 1;
+    while ((int)threads_.size() < num_pool) {
+      worker_arg *a = new worker_arg;
+      a->sched = this;
+      a->id    = (int)threads_.size() + 1;
+      a->seen  = generation_;
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, pool_main, (void *)a)) {
+        delete a;
+        shutdown();
+        mexErrMsgTxt("Error creating thread");
+      }
+      threads_.push_back(thread);
+      args_.push_back(a);
+    }
+
+    g_           = &g;
+    runner_      = &runner;
+    num_workers_ = num_pool + 1;
+
+    if ((int)queues_.size() < num_workers_) {
+      for (int w = 0; w < (int)queues_.size(); w++)
+        pthread_mutex_destroy(&queues_[w].lock);
+      queues_.resize(num_workers_);
+      for (int w = 0; w < (int)queues_.size(); w++)
+        pthread_mutex_init(&queues_[w].lock, NULL);
+    }
+    for (int w = 0; w < num_workers_; w++) {
+      worker_queue &q = queues_[w];
+      if ((int)q.tasks.size() < g.num_tasks)
+        q.tasks.resize(g.num_tasks);
+      q.head = 0;
+      q.tail = 0;
+    }
+
+    pending_.assign(g.num_deps.begin(), g.num_deps.end());
+    remaining_ = 0;
+    for (int t = 0; t < g.num_tasks; t++)
+      if (g.active[t])
+        remaining_++;
+
+    // Seed the deques with the tasks that are ready to run
+    int next = 0;
+    for (int t = 0; t < g.num_tasks; t++) {
+      if (g.active[t] && pending_[t] == 0) {
+        worker_queue &q = queues_[next];
+        q.tasks[q.tail++] = t;
+        next = (next + 1) % num_workers_;
+      }
+    }
+
+    // Wake the pool threads that take part in this run
+    pthread_mutex_lock(&pool_lock_);
+    generation_++;
+    busy_ = num_pool;
+    pthread_cond_broadcast(&wake_);
+    pthread_mutex_unlock(&pool_lock_);
+
+    work(0);
+
+    pthread_mutex_lock(&pool_lock_);
+    while (busy_ > 0)
+      pthread_cond_wait(&idle_, &pool_lock_);
+    pthread_mutex_unlock(&pool_lock_);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Stop and join all pool threads
+   **/
+  void shutdown() {
+    pthread_mutex_lock(&pool_lock_);
+    stop_ = true;
+    pthread_cond_broadcast(&wake_);
+    pthread_mutex_unlock(&pool_lock_);
+    for (int i = 0; i < (int)threads_.size(); i++)
+      pthread_join(threads_[i], NULL);
+    for (int i = 0; i < (int)args_.size(); i++)
+      delete args_[i];
+    threads_.clear();
+    args_.clear();
+    stop_ = false;
+  }
+
+
+  dp_scheduler() : g_(NULL), runner_(NULL), num_workers_(0), remaining_(0),
+                   generation_(0), busy_(0), stop_(false) {
+    pthread_mutex_init(&pool_lock_, NULL);
+    pthread_cond_init(&wake_, NULL);
+    pthread_cond_init(&idle_, NULL);
+  }
+
+
+  ~dp_scheduler() {
+    shutdown();
+    for (int w = 0; w < (int)queues_.size(); w++)
+      pthread_mutex_destroy(&queues_[w].lock);
+    pthread_cond_destroy(&idle_);
+    pthread_cond_destroy(&wake_);
+    pthread_mutex_destroy(&pool_lock_);
+  }
+
+private:
+  struct worker_queue {
+    pthread_mutex_t lock;
+    vector<int> tasks;
+    int head;
+    int tail;
+  };
+
+  struct worker_arg {
+    dp_scheduler *sched;
+    int id;
+    // Last generation seen (set before the thread starts so that it
+    // can't miss the run that started it)
+    unsigned int seen;
+  };
+
+  const dp_task_graph *g_;
+  Runner *runner_;
+  int num_workers_;
+  vector<worker_queue> queues_;
+  vector<int> pending_;
+  volatile int remaining_;
+
+  // Persistent pool: thread i has worker id i+1. Its argument is
+  // heap allocated so that growing the pool doesn't move it.
+  vector<pthread_t> threads_;
+  vector<worker_arg *> args_;
+  // pool_lock_ guards generation_, busy_ and stop_. A run bumps
+  // generation_ to wake the pool and waits on idle_ until the busy_
+  // threads that take part in it are done.
+  pthread_mutex_t pool_lock_;
+  pthread_cond_t wake_;
+  pthread_cond_t idle_;
+  unsigned int generation_;
+  int busy_;
+  bool stop_;
+
+  // Not copyable (owns mutexes and threads)
+  dp_scheduler(const dp_scheduler &);
+  dp_scheduler &operator=(const dp_scheduler &);
+
+
+  /** ---------------------------------------------------------------
+   ** Take a task from the back of worker w's own deque
+   **/
+  bool pop(int w, int &task) {
+    worker_queue &q = queues_[w];
+    bool found = false;
+    pthread_mutex_lock(&q.lock);
+    if (q.tail > q.head) {
+      task = q.tasks[--q.tail];
+      found = true;
+    }
+    pthread_mutex_unlock(&q.lock);
+    return found;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Steal a task from the front of another worker's deque
+   **/
+  bool steal(int w, int &task) {
+    for (int i = 1; i < num_workers_; i++) {
+      worker_queue &q = queues_[(w + i) % num_workers_];
+      bool found = false;
+      pthread_mutex_lock(&q.lock);
+      if (q.tail > q.head) {
+        task = q.tasks[q.head++];
+        found = true;
+      }
+      pthread_mutex_unlock(&q.lock);
+      if (found)
+        return true;
+    }
+    return false;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Mark task t as finished and release its successors
+   **/
+  void finish(int w, int t) {
+    worker_queue &q = queues_[w];
+    const dp_task_graph &g = *g_;
+    for (int i = g.succ_begin[t]; i < g.succ_begin[t+1]; i++) {
+      const int u = g.succ[i];
+      if (__sync_sub_and_fetch(&pending_[u], 1) == 0 && g.active[u]) {
+        pthread_mutex_lock(&q.lock);
+        q.tasks[q.tail++] = u;
+        pthread_mutex_unlock(&q.lock);
+      }
+    }
+    __sync_sub_and_fetch(&remaining_, 1);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Run tasks as worker w until all tasks of the graph are done
+   **/
+  void work(int w) {
+    int task;
+    while (remaining_ > 0) {
+      if (pop(w, task) || steal(w, task)) {
+        runner_->run_task(task, w);
+        finish(w, task);
+      } else {
+        sched_yield();
+      }
+    }
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Pool thread main loop
+   **/
+  static void *pool_main(void *arg) {
+    worker_arg *a = (worker_arg *)arg;
+    dp_scheduler *self = a->sched;
+    const int w = a->id;
+    unsigned int seen = a->seen;
+    pthread_mutex_lock(&self->pool_lock_);
+    for (;;) {
+      while (!self->stop_ && self->generation_ == seen)
+        pthread_cond_wait(&self->wake_, &self->pool_lock_);
+      if (self->stop_)
+        break;
+      seen = self->generation_;
+      // Threads beyond this run's worker count sit it out
+      const bool take_part = (w < self->num_workers_);
+      pthread_mutex_unlock(&self->pool_lock_);
+      if (take_part)
+        self->work(w);
+      pthread_mutex_lock(&self->pool_lock_);
+      if (take_part && --self->busy_ == 0)
+        pthread_cond_signal(&self->idle_);
+    }
+    pthread_mutex_unlock(&self->pool_lock_);
+    return NULL;
+  }
+};
+
+#endif // DP_SCHED_H
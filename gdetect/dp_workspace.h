@@ -0,0 +1,156 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef DP_WORKSPACE_H
+#define DP_WORKSPACE_H
+
+#include "grammar.h"
+#include "dp.h"
+#include <vector>
+
+using namespace std;
+
+/** -----------------------------------------------------------------
+ ** Persistent dynamic programming workspace
+ **
+ ** Holds everything the native dynamic program needs across calls:
+ ** the grammar, pyramid and parameter views, the engine (with its
+ ** scratch space, prepared filters, task graph and scheduler) and an
+ ** arena from which all score and argmax tables are carved. The
+ ** arena grows to fit the largest pyramid seen and is never shrunk,
+ ** so in steady state (e.g., frames of a video) the dynamic program
+ ** does not allocate memory.
+ **/
+struct dp_workspace {
+  grammar G;
+  dp_pyramid P;
+  dp_params W;
+  dp_engine E;
+
+  // Table arena
+  vector<double>  score_arena;
+  vector<int32_t> argmax_arena;
+  vector<uint8_t> rule_arena;
+
+  // Do the engine's table pointers point into the arena?
+  bool has_tables;
+  // Tables that 'get' copies out, by [symbol*num_levels + level]
+  // (after level by level detection: the tables on derivations of
+  // the candidates; empty => all tables)
+  vector<char> keep;
+  // Measured time to copy one table entry out of the arena (seconds;
+  // used to leave time for the copy before a detection deadline)
+  double copy_rate;
+
+
+  /** ---------------------------------------------------------------
+   ** Constructor
+   **/
+  dp_workspace() {
+    has_tables = false;
+    copy_rate  = 0;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Point the engine at tables carved from the arena (call after
+   ** E.init()). Every symbol that has a table and every rule with a
+   ** lhs that has a table gets one table per level, and so does the
+   ** argmax rule of every symbol with E.has_rule_table().
+   **/
+  void carve() {
+    const int L = E.num_levels;
+    size_t level_area = 0;
+    for (int l = 0; l < L; l++)
+      level_area += E.table_size(l);
+
+    size_t num_score_tables = 0, num_argmax_tables = 0, num_rule_tables = 0;
+    for (int s = 0; s < G.num_symbols; s++) {
+      if (!E.has_table(s))
+        continue;
+      num_score_tables++;
+      if (E.has_rule_table(s))
+        num_rule_tables++;
+      const vector<int> &srules = G.symbols[s].rules;
+      for (int j = 0; j < (int)srules.size(); j++) {
+        num_score_tables++;
+        if (G.rules[srules[j]].type == 'D')
+          num_argmax_tables += 2;
+      }
+    }
+
+    if (score_arena.size() < num_score_tables*level_area)
+      score_arena.resize(num_score_tables*level_area);
+    if (argmax_arena.size() < num_argmax_tables*level_area)
+      argmax_arena.resize(num_argmax_tables*level_area);
+    if (rule_arena.size() < num_rule_tables*level_area)
+      rule_arena.resize(num_rule_tables*level_area);
+
+    double  *p = score_arena.empty() ? NULL : &score_arena[0];
+    int32_t *q = argmax_arena.empty() ? NULL : &argmax_arena[0];
+    uint8_t *u = rule_arena.empty() ? NULL : &rule_arena[0];
+    for (int s = 0; s < G.num_symbols; s++) {
+      if (!E.has_table(s))
+        continue;
+      for (int l = 0; l < L; l++) {
+        E.sym_score[s*L + l] = p;
+        p += E.table_size(l);
+      }
+      if (E.has_rule_table(s)) {
+        for (int l = 0; l < L; l++) {
+          E.sym_rule[s*L + l] = u;
+          u += E.table_size(l);
+        }
+      }
+      const vector<int> &srules = G.symbols[s].rules;
+      for (int j = 0; j < (int)srules.size(); j++) {
+        const int ri = srules[j];
+        for (int l = 0; l < L; l++) {
+          E.rule_score[ri*L + l] = p;
+          p += E.table_size(l);
+        }
+        if (G.rules[ri].type != 'D')
+          continue;
+        for (int l = 0; l < L; l++) {
+          E.rule_Ix[ri*L + l] = q;
+          q += E.table_size(l);
+          E.rule_Iy[ri*L + l] = q;
+          q += E.table_size(l);
+        }
+      }
+    }
+    has_tables = true;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Bytes held by the table arena
+   **/
+  size_t arena_bytes() const {
+    return score_arena.capacity()*sizeof(double)
+           + argmax_arena.capacity()*sizeof(int32_t)
+           + rule_arena.capacity()*sizeof(uint8_t);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Release the table arena
+   **/
+  void free_arena() {
+    vector<double>().swap(score_arena);
+    vector<int32_t>().swap(argmax_arena);
+    vector<uint8_t>().swap(rule_arena);
+    has_tables = false;
+  }
+};
+
+#endif // DP_WORKSPACE_H
@@ -0,0 +1,71 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef FCONV_OUTPUT_H
+#define FCONV_OUTPUT_H
+
+#include "mex.h"
+#include <math.h>
+#include <algorithm>
+
+/*
+ * Output arrays for the fconv routines.
+ *
+ * All fconv routines take an optional 5th argument out_size = [rows
+ * cols]. When it is given, every filter response is returned in an
+ * array of that size: the response occupies the top-left block and
+ * the rest is set to -inf. This is the layout gdetect_dp.m used to
+ * create with post_pad, without the extra copy.
+ */
+
+
+/** -----------------------------------------------------------------
+ ** Read the optional output size (returns false if not given)
+ **/
+static inline bool fconv_out_size(int nrhs, const mxArray *prhs[],
+                                  mwSize out_dims[2]) {
+  if (nrhs < 5 || mxIsEmpty(prhs[4]))
+    return false;
+  if (mxGetNumberOfElements(prhs[4]) != 2)
+    mexErrMsgTxt("Invalid input: out_size must be [rows cols]");
+  const double *sz = mxGetPr(prhs[4]);
+  out_dims[0] = (mwSize)sz[0];
+  out_dims[1] = (mwSize)sz[1];
+  return true;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Create the output array for a response of size C_dims
+ ** If out_dims is NULL the array has size C_dims; otherwise it has
+ ** size out_dims and everything outside of the response is -inf.
+ ** The response is zero filled and has leading dimension *C_rows.
+ **/
+static inline mxArray *fconv_create_output(const mwSize C_dims[2],
+                                           const mwSize *out_dims,
+                                           mwSize *C_rows) {
+  if (out_dims == NULL) {
+    *C_rows = C_dims[0];
+    return mxCreateNumericArray(2, C_dims, mxDOUBLE_CLASS, mxREAL);
+  }
+  if (out_dims[0] < C_dims[0] || out_dims[1] < C_dims[1])
+    mexErrMsgTxt("Invalid input: out_size is smaller than a filter response");
+  mxArray *mxC = mxCreateNumericArray(2, out_dims, mxDOUBLE_CLASS, mxREAL);
+  double *C = (double *)mxGetPr(mxC);
+  for (mwSize x = 0; x < C_dims[1]; x++)
+    std::fill(C + x*out_dims[0] + C_dims[0], C + (x+1)*out_dims[0], -INFINITY);
+  std::fill(C + C_dims[1]*out_dims[0], C + out_dims[1]*out_dims[0], -INFINITY);
+  *C_rows = out_dims[0];
+  return mxC;
+}
+
+#endif // FCONV_OUTPUT_H
@@ -17,6 +17,7 @@
  */
 
 #include "mex.h"
+#include "fconv_output.h"
 #include <pthread.h>
 #include <xmmintrin.h>
 
@@ -32,6 +33,7 @@ struct thread_data {
   const mwSize *A_dims;
   const mwSize *B_dims;
   mwSize C_dims[2];
+  mwSize C_rows;
 };
 
 // Convolve A (feature map) and B (filter)
@@ -45,9 +47,9 @@ void *process(void *thread_arg) {
   const mwSize *C_dims = args->C_dims;
 
   __m128 a, b, c;
-  double *dst = C;
   // Loop over output positions (y, x)
   for (int x = 0; x < C_dims[1]; x++) {
+    double *dst = C + x*args->C_rows;
     for (int y = 0; y < C_dims[0]; y++) {
       __m128 accum = _mm_setzero_ps();
       const float *A_src = A + y*NUM_FEATURES + x*A_dims[0]*NUM_FEATURES;
@@ -106,13 +108,14 @@ float *prepare(float *in, const mwSize *dims) {
 }
 
 // matlab entry point
-// C = fconv(A, B, start, end);
+// C = fconv(A, B, start, end, out_size);
 // A        Nx x Ny x 32 dimensional HOG feature map (class: single)
 // B        cell array of filters (class: single)
 // start    starting index in B
 // end      ending index in B (filters in B{start:end} will be used)
+// out_size optional [rows cols] size of every output (see fconv_output.h)
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) { 
-  if (nrhs < 4)
+  if (nrhs < 4 || nrhs > 5)
     mexErrMsgTxt("Wrong number of inputs"); 
   if (nlhs != 1)
     mexErrMsgTxt("Wrong number of outputs");
@@ -142,6 +145,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   if (start < 0 || end >= num_bs || start > end)
     mexErrMsgTxt("Inputs start and end exceed boundaries");
 
+  // Size of the outputs (NULL => size of each response)
+  mwSize out_size[2];
+  const mwSize *out_dims = fconv_out_size(nrhs, prhs, out_size) ? out_size : NULL;
+
   // Start one thread per filter
   thread_data *td = (thread_data *)mxCalloc(len, sizeof(thread_data));
   pthread_t *ts = (pthread_t *)mxCalloc(len, sizeof(pthread_t));
@@ -167,7 +174,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
       mexErrMsgTxt("Filter is too large for feature map");
     td[i].C_dims[0] = height;
     td[i].C_dims[1] = width;
-    td[i].mxC       = mxCreateNumericArray(2, td[i].C_dims, mxDOUBLE_CLASS, mxREAL);
+    td[i].mxC       = fconv_create_output(td[i].C_dims, out_dims, &td[i].C_rows);
     td[i].C         = (double *)mxGetPr(td[i].mxC);
 
     if (pthread_create(&ts[i], NULL, process, (void *)&td[i]))
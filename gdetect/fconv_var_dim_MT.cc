@@ -12,6 +12,7 @@
 // -------------------------------------------------------
 
 #include "mex.h"
+#include "fconv_output.h"
 #include <pthread.h>
 #include <math.h>
 #include <string.h>
@@ -31,6 +32,7 @@ struct thread_data {
   const mwSize *A_dims;
   const mwSize *B_dims;
   mwSize C_dims[2];
+  mwSize C_rows;
 };
 
 // convolve A and B
@@ -45,10 +47,10 @@ void *process(void *thread_arg) {
   int num_features = args->A_dims[2];
 
   for (int f = 0; f < num_features; f++) {
-    double *dst = C;
     float *A_src = A + f*A_dims[0]*A_dims[1];      
     float *B_src = B + f*B_dims[0]*B_dims[1];
     for (int x = 0; x < C_dims[1]; x++) {
+      double *dst = C + x*args->C_rows;
       for (int y = 0; y < C_dims[0]; y++) {
         double val = 0;
         for (int xp = 0; xp < B_dims[1]; xp++) {
@@ -90,9 +92,10 @@ void *process(void *thread_arg) {
 }
 
 // matlab entry point
-// C = fconv(A, cell of B, start, end);
+// C = fconv(A, cell of B, start, end, out_size);
+// out_size is optional (see fconv_output.h)
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) { 
-  if (nrhs != 4)
+  if (nrhs < 4 || nrhs > 5)
     mexErrMsgTxt("Wrong number of inputs"); 
   if (nlhs != 1)
     mexErrMsgTxt("Wrong number of outputs");
@@ -112,6 +115,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     mexErrMsgTxt("Invalid input: start/end");
   int len = end-start+1;
 
+  // size of the outputs (NULL => size of each response)
+  mwSize out_size[2];
+  const mwSize *out_dims = fconv_out_size(nrhs, prhs, out_size) ? out_size : NULL;
+
   // start threads
   thread_data *td = (thread_data *)mxCalloc(len, sizeof(thread_data));
   pthread_t *ts = (pthread_t *)mxCalloc(len, sizeof(pthread_t));
@@ -135,7 +142,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
       mexErrMsgTxt("Invalid input: B should be smaller than A");
     td[i].C_dims[0] = height;
     td[i].C_dims[1] = width;
-    td[i].mxC = mxCreateNumericArray(2, td[i].C_dims, mxDOUBLE_CLASS, mxREAL);
+    td[i].mxC = fconv_create_output(td[i].C_dims, out_dims, &td[i].C_rows);
     td[i].C = (double *)mxGetPr(td[i].mxC);
 
     if (pthread_create(&ts[i], NULL, process, (void *)&td[i]))
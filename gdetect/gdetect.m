@@ -47,5 +47,5 @@ if nargin < 4
   max_num = inf;
 end
 
-model = gdetect_dp(pyra, model);
+model = gdetect_dp(pyra, model, thresh);
 [ds, bs, trees] = gdetect_parse(model, pyra, thresh, max_num);
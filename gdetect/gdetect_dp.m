@@ -1,6 +1,7 @@
-function model = gdetect_dp(pyra, model)
+function [model, cands] = gdetect_dp(pyra, model, thresh, max_num, deadline)
 % Compute dynamic programming tables used for finding detections.
-%   model = gdetect_dp(pyra, model)
+%   model = gdetect_dp(pyra, model, thresh)
+%   [model, cands] = gdetect_dp(pyra, model, thresh, max_num, deadline)
 %
 %   This function implements the dynamic programming algorithm for
 %   computing high-scoring derivations using an Object Detection Grammar.
@@ -8,12 +9,35 @@ function model = gdetect_dp(pyra, model)
 %   Grammar and therefore contains only structural schemas and deformation
 %   schemas.
 %
-% Return value
+% Return values
 %   model   Object model augmented to store the dynamic programming tables
+%           (the native implementation also stores the index of the
+%           argmax rule of each symbol in model.symbols(s).argmax_rule;
+%           get_detection_trees uses it when present)
+%   cands   (Second form; requires the native implementation) The
+%           tables are computed one pyramid level at a time, starting
+%           with the level that has the highest bound on its start
+%           symbol scores, until the max_num best start symbol
+%           locations are known or the deadline has passed. Only the
+%           tables on derivations of the candidates are stored (the
+%           others are empty). Fields:
+%             X, Y, L, S  locations, levels and scores of the (at most
+%                         max_num) best start symbol locations found,
+%                         in the format of detection_candidates
+%             levels      levels(l) is true if level l was computed
+%             final       true if the candidates are the max_num best
+%                         start symbol locations in the whole pyramid
 %
 % Arguments
 %   pyra    Feature pyramid returned by featpyramid.m
 %   model   Object model
+%   thresh  Detection threshold (optional). If given, the native
+%           implementation may skip locations whose start symbol score
+%           can be shown to be <= thresh; their table entries are -inf.
+%           Scores > thresh are unchanged.
+%   max_num Maximum number of candidates (second form; default: inf)
+%   deadline  No level is started after deadline seconds (second form;
+%             default: inf)
 
 % AUTORIGHTS
 % -------------------------------------------------------
@@ -27,6 +51,30 @@ function model = gdetect_dp(pyra, model)
 % your project.
 % -------------------------------------------------------
 
+% Use the native implementation of the dynamic program if it
+% has been compiled (see compile.m)
+if exist('gdetect_dp_mex') == 3  % 3 ==> MEX function
+  if nargin < 3
+    thresh = -inf;
+  end
+  if nargout > 1
+    if nargin < 4
+      max_num = inf;
+    end
+    if nargin < 5
+      deadline = inf;
+    end
+    [model, cands] = native_dp(model, pyra, thresh, max_num, deadline);
+  else
+    model = native_dp(model, pyra, thresh);
+  end
+  return;
+end
+
+if nargout > 1
+  error('Computing candidates requires gdetect_dp_mex (see compile.m)');
+end
+
 % cache filter response
 model = filter_responses(model, pyra);
 
@@ -92,11 +140,30 @@ bias       = model_get_block(model, r.offset) * model.features.bias;
 loc_w      = model_get_block(model, r.loc);
 loc_f      = loc_feat(model, length(score));
 loc_scores = loc_w * loc_f;
+
+% sum scores from rhs (with appropriate shift and down sample)
+% in one pass per level if struct_rule_score has been compiled
+if exist('struct_rule_score') == 3  % 3 ==> MEX function
+  anchors = reshape(cat(2, r.anchor{:}), 3, []);
+  for i = 1:length(score)
+    rhs_scores = cell(length(r.rhs), 1);
+    for j = 1:length(r.rhs)
+      level = i - model.interval*anchors(3,j);
+      if level >= 1
+        rhs_scores{j} = model.symbols(r.rhs(j)).score{level};
+      end
+    end
+    score{i} = struct_rule_score(bias + loc_scores(i), size(score{i}), ...
+                                 rhs_scores, anchors, pady, padx);
+  end
+  model.rules{r.lhs}(r.i).score = score;
+  return;
+end
+
 for i = 1:length(score)
   score{i}(:) = bias + loc_scores(i);
 end
 
-% sum scores from rhs (with appropriate shift and down sample)
 for j = 1:length(r.rhs)
   ax = r.anchor{j}(1);
   ay = r.anchor{j}(2);
@@ -175,8 +242,10 @@ function model = filter_responses(model, pyra)
 
 % gather filters for computing match quality responses
 filters = cell(model.numfilters, 1);
+min_fsz = [inf inf];
 for i = 1:model.numfilters
   filters{i} = single(model_get_block(model, model.filters(i)));
+  min_fsz = min(min_fsz, [size(filters{i}, 1) size(filters{i}, 2)]);
 end
 
 for level = 1:length(pyra.feat)
@@ -201,25 +270,91 @@ for level = 1:length(pyra.feat)
     % Fall back to the slower version that works with any dimension
     fconv_fun = @fconv_var_dim;
   end
-  % compute filter response for all filters at this level
-  r = fconv_fun(pyra.feat{level}, filters, 1, length(filters));
+  % max response array size for this level
+  s = [size(pyra.feat{level}, 1) size(pyra.feat{level}, 2)] - min_fsz + 1;
 
-  % find max response array size for this level
-  s = cellfun(@size, r, 'UniformOutput', false);
-  s = max(cat(1, s{:}), [], 1);
+  % compute filter response for all filters at this level
+  % (all responses at this level are returned with the same dimension;
+  % locations beyond the valid part of a response are -inf)
+  r = fconv_fun(pyra.feat{level}, filters, 1, length(filters), s);
 
   % set filter response as the score for each filter terminal
   for i = 1:length(r)
-    % normalize response array size so all responses at this 
-    % level have the same dimension
-    spady = s(1) - size(r{i},1);
-    spadx = s(2) - size(r{i},2);
-    if spady > 0 || spadx > 0
-      r{i} = post_pad(r{i}, spady, spadx, -inf);
-      %r{i} = padarray(r{i}, [spady spady], -inf, 'both');
-    end
     fsym = model.filters(i).symbol;
     model.symbols(fsym).score{level} = r{i};
   end
   model.scoretpt{level} = zeros(s);
 end
+
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+% compute all dynamic programming tables with gdetect_dp_mex
+function [model, cands] = native_dp(model, pyra, thresh, max_num, deadline)
+% model    object model
+% pyra     feature pyramid
+% thresh   detection threshold used for pruning (-inf => no pruning)
+% max_num  number of candidates (level by level mode only)
+% deadline deadline in seconds (level by level mode only)
+
+% gather filters for computing match quality responses
+filters = cell(model.numfilters, 1);
+for i = 1:model.numfilters
+  filters{i} = single(model_get_block(model, model.filters(i)));
+end
+
+% gather offset + scale prior scores and deformation parameters
+% for each rule
+loc_f   = loc_feat(model, pyra.num_levels);
+offsets = cell(model.numsymbols, 1);
+defs    = cell(model.numsymbols, 1);
+for s = 1:length(model.rules)
+  n = length(model.rules{s});
+  offsets{s} = zeros(pyra.num_levels, n);
+  defs{s} = zeros(4, n);
+  for j = 1:n
+    r = model.rules{s}(j);
+    bias  = model_get_block(model, r.offset) * model.features.bias;
+    loc_w = model_get_block(model, r.loc);
+    offsets{s}(:, j) = bias + loc_w * loc_f;
+    if r.type == 'D'
+      defs{s}(:, j) = model_get_block(model, r.def);
+    end
+  end
+end
+
+if nargout > 1
+  % compute the tables level by level in the workspace and copy out
+  % the ones that backtracking the candidates needs
+  [cands.X, cands.Y, cands.L, cands.S, cands.levels, cands.final] ...
+    = gdetect_dp_mex('detect', model, pyra, filters, offsets, defs, ...
+                     [], thresh, max_num, deadline);
+  if isempty(cands.X)
+    syms = [];
+  else
+    % symbols that can appear in a derivation
+    syms = [model_sort(model) model.filters.symbol];
+  end
+  [sym_scores, rule_scores, rule_Ix, rule_Iy, model.scoretpt, sym_rules] ...
+    = gdetect_dp_mex('get', syms);
+else
+  % compute the tables in the workspace and copy them out
+  gdetect_dp_mex(model, pyra, filters, offsets, defs, [], thresh);
+  [sym_scores, rule_scores, rule_Ix, rule_Iy, model.scoretpt, sym_rules] ...
+    = gdetect_dp_mex('get');
+end
+
+% store tables in the model (same layout as the matlab implementation)
+for s = 1:model.numsymbols
+  if isempty(sym_scores{s})
+    continue;
+  end
+  model.symbols(s).score = sym_scores{s};
+  model.symbols(s).argmax_rule = sym_rules{s};
+  for j = 1:length(rule_scores{s})
+    model.rules{s}(j).score = rule_scores{s}{j};
+    if model.rules{s}(j).type == 'D'
+      model.rules{s}(j).Ix = rule_Ix{s}{j};
+      model.rules{s}(j).Iy = rule_Iy{s}{j};
+    end
+  end
+end
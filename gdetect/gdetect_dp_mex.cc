@@ -0,0 +1,621 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "mex.h"
+#include "grammar.h"
+#include "dp.h"
+#include "dp_workspace.h"
+#include "candidates.h"
+#include <omp.h>
+#include <string>
+
+using namespace std;
+
+/*
+ * Native version of the dynamic programming algorithm implemented
+ * in gdetect_dp.m. Filter responses, structural rules, deformation
+ * rules and symbol scores are all computed here. The matlab code in
+ * gdetect_dp.m prepares the (flipped) filters and the per-rule
+ * offset, scale prior and deformation parameters and stores the
+ * returned tables in the model.
+ *
+ * All working memory is kept in a persistent workspace (see
+ * dp_workspace.h) between calls, so the mex file is locked once it
+ * has been used (call gdetect_dp_mex('unlock') before recompiling).
+ * The tables are always computed in the workspace's arena, so the
+ * dynamic program does not allocate memory once the arena has grown
+ * to fit the largest pyramid. They stay there until the next call
+ * and are copied into matlab arrays when outputs are requested or
+ * with 'get' (which can copy just the symbols the caller needs). The
+ * grammar read from the model, the task graph and the worker threads
+ * are also kept, and are only rebuilt when the model changes.
+ *
+ * The 'detect' command computes the tables level by level, in order
+ * of decreasing upper bound on the start symbol score (see
+ * dp_engine::prune), and keeps the max_num best start symbol
+ * locations. It stops as soon as no remaining level can change them
+ * or when the deadline has passed. Afterwards 'get' only copies the
+ * tables that backtracking the candidates can reach; the time that
+ * takes is estimated from the previous copy and counted against the
+ * deadline.
+ */
+
+
+/** -----------------------------------------------------------------
+ ** Persistent state
+ **/
+struct context {
+  dp_workspace ws;
+  bool cleanup_reg;
+
+  context() {
+    cleanup_reg = false;
+  }
+};
+static context gctx;
+
+
+/** -----------------------------------------------------------------
+ ** Commands and handler functions
+ **/
+struct handler_registry {
+  string cmd;
+  void (*func)(int, mxArray **, int, const mxArray **);
+};
+
+/** -----------------------------------------------------------------
+ ** Read the feature pyramid from the matlab pyra struct
+ **/
+static void read_pyramid(const mxArray *mx_pyra, dp_pyramid &P) {
+  const mxArray *mx_feat  = mxGetField(mx_pyra, 0, "feat");
+  const mxArray *mx_valid = mxGetField(mx_pyra, 0, "valid_levels");
+  if (mx_feat == NULL || mx_valid == NULL)
+    mexErrMsgTxt("Invalid input: pyra");
+
+  P.num_levels = mxGetNumberOfElements(mx_feat);
+  P.padx       = (int)mxGetScalar(mxGetField(mx_pyra, 0, "padx"));
+  P.pady       = (int)mxGetScalar(mxGetField(mx_pyra, 0, "pady"));
+  P.feat.resize(P.num_levels);
+  P.feat_dims.resize(3*P.num_levels);
+  P.valid.resize(P.num_levels);
+
+  for (int l = 0; l < P.num_levels; l++) {
+    if (mxIsLogical(mx_valid))
+      P.valid[l] = mxGetLogicals(mx_valid)[l];
+    else
+      P.valid[l] = (mxGetPr(mx_valid)[l] != 0);
+
+    const mxArray *mx_f = mxGetCell(mx_feat, l);
+    if (mxGetNumberOfDimensions(mx_f) != 3 ||
+        mxGetClassID(mx_f) != mxSINGLE_CLASS)
+      mexErrMsgTxt("Feature map must be a 3D single precision array");
+    const mwSize *dims = mxGetDimensions(mx_f);
+    P.feat[l] = (const float *)mxGetData(mx_f);
+    P.feat_dims[3*l+0] = dims[0];
+    P.feat_dims[3*l+1] = dims[1];
+    P.feat_dims[3*l+2] = dims[2];
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Read filters and rule parameters
+ **/
+static void read_params(const grammar &G, const mxArray *mx_filters,
+                        const mxArray *mx_offsets, const mxArray *mx_defs,
+                        int num_levels, dp_params &W) {
+  if (mxGetNumberOfElements(mx_filters) != (mwSize)G.num_filters)
+    mexErrMsgTxt("Invalid input: filters");
+
+  W.filters.resize(G.num_filters);
+  W.filter_dims.resize(3*G.num_filters);
+  for (int i = 0; i < G.num_filters; i++) {
+    const mxArray *mx_B = mxGetCell(mx_filters, i);
+    if (mxGetNumberOfDimensions(mx_B) != 3 ||
+        mxGetClassID(mx_B) != mxSINGLE_CLASS)
+      mexErrMsgTxt("Filter must be a 3D single precision array");
+    const mwSize *dims = mxGetDimensions(mx_B);
+    W.filters[i] = (const float *)mxGetData(mx_B);
+    W.filter_dims[3*i+0] = dims[0];
+    W.filter_dims[3*i+1] = dims[1];
+    W.filter_dims[3*i+2] = dims[2];
+  }
+
+  W.offsets.resize(G.rules.size());
+  W.defs.resize(G.rules.size());
+  for (int ri = 0; ri < (int)G.rules.size(); ri++) {
+    const grammar::rule &r = G.rules[ri];
+    const mxArray *mx_off = mxGetCell(mx_offsets, r.lhs);
+    if (mx_off == NULL || mxGetM(mx_off) != (mwSize)num_levels)
+      mexErrMsgTxt("Invalid input: offsets");
+    W.offsets[ri] = mxGetPr(mx_off) + r.index*num_levels;
+
+    W.defs[ri] = NULL;
+    if (r.type == 'D') {
+      const mxArray *mx_def = mxGetCell(mx_defs, r.lhs);
+      if (mx_def == NULL || mxGetM(mx_def) != 4)
+        mexErrMsgTxt("Invalid input: defs");
+      W.defs[ri] = mxGetPr(mx_def) + r.index*4;
+    }
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Create a 1 x num_levels cell array with copies of the tables ptrs,
+ ** one per level. Only the levels marked in keep are copied (all if
+ ** keep is NULL); the others are empty.
+ **/
+template<class T>
+static mxArray *create_tables(const dp_engine &E, mxClassID class_id,
+                              T *const *ptrs, const char *keep) {
+  mxArray *mx_cell = mxCreateCellMatrix(1, E.num_levels);
+  for (int l = 0; l < E.num_levels; l++) {
+    mwSize dims[] = { 0, 0 };
+    if (keep == NULL || keep[l]) {
+      dims[0] = E.dims[2*l];
+      dims[1] = E.dims[2*l+1];
+    }
+    mxArray *mx_table = mxCreateNumericArray(2, dims, class_id, mxREAL);
+    mxSetCell(mx_cell, l, mx_table);
+    if (dims[0] > 0)
+      std::copy(ptrs[l], ptrs[l] + E.table_size(l), (T *)mxGetData(mx_table));
+  }
+  return mx_cell;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Create the matlab outputs for the symbols marked in want
+ ** (see mexFunction for the layout; the argmax rule tables are
+ ** only created if nlhs > 5). Returns the number of symbol and
+ ** rule score table entries copied.
+ **/
+static size_t create_outputs(const dp_workspace &ws, const vector<char> &want,
+                             int nlhs, mxArray *plhs[]) {
+  const grammar &G   = ws.G;
+  const dp_engine &E = ws.E;
+  const int L        = E.num_levels;
+  size_t cells       = 0;
+
+  mxArray *mx_sym_scores  = mxCreateCellMatrix(G.num_symbols, 1);
+  mxArray *mx_rule_scores = mxCreateCellMatrix(G.num_symbols, 1);
+  mxArray *mx_rule_Ix     = mxCreateCellMatrix(G.num_symbols, 1);
+  mxArray *mx_rule_Iy     = mxCreateCellMatrix(G.num_symbols, 1);
+  mxArray *mx_sym_rules   = NULL;
+  if (nlhs > 5)
+    mx_sym_rules = mxCreateCellMatrix(G.num_symbols, 1);
+  for (int s = 0; s < G.num_symbols; s++) {
+    if (!want[s] || !E.has_table(s))
+      continue;
+    const char *keep = ws.keep.empty() ? NULL : &ws.keep[s*L];
+    mxSetCell(mx_sym_scores, s,
+              create_tables(E, mxDOUBLE_CLASS, &E.sym_score[s*L], keep));
+    if (mx_sym_rules != NULL && E.has_rule_table(s))
+      mxSetCell(mx_sym_rules, s,
+                create_tables(E, mxUINT8_CLASS, &E.sym_rule[s*L], keep));
+
+    const vector<int> &srules = G.symbols[s].rules;
+    for (int l = 0; l < L; l++)
+      if (keep == NULL || keep[l])
+        cells += E.table_size(l)*(1 + srules.size());
+    if (srules.empty())
+      continue;
+    mxArray *mx_scores = mxCreateCellMatrix(1, srules.size());
+    mxArray *mx_Ix     = mxCreateCellMatrix(1, srules.size());
+    mxArray *mx_Iy     = mxCreateCellMatrix(1, srules.size());
+    for (int j = 0; j < (int)srules.size(); j++) {
+      const int ri = srules[j];
+      mxSetCell(mx_scores, j,
+                create_tables(E, mxDOUBLE_CLASS, &E.rule_score[ri*L], keep));
+      if (G.rules[ri].type == 'D') {
+        mxSetCell(mx_Ix, j,
+                  create_tables(E, mxINT32_CLASS, &E.rule_Ix[ri*L], keep));
+        mxSetCell(mx_Iy, j,
+                  create_tables(E, mxINT32_CLASS, &E.rule_Iy[ri*L], keep));
+      }
+    }
+    mxSetCell(mx_rule_scores, s, mx_scores);
+    mxSetCell(mx_rule_Ix, s, mx_Ix);
+    mxSetCell(mx_rule_Iy, s, mx_Iy);
+  }
+
+  // Template score table for each level
+  mxArray *mx_scoretpt = mxCreateCellMatrix(1, L);
+  for (int l = 0; l < L; l++) {
+    mwSize dims[] = { (mwSize)E.dims[2*l], (mwSize)E.dims[2*l+1] };
+    mxSetCell(mx_scoretpt, l,
+              mxCreateNumericArray(2, dims, mxDOUBLE_CLASS, mxREAL));
+  }
+
+  plhs[0] = mx_sym_scores;
+  plhs[1] = mx_rule_scores;
+  plhs[2] = mx_rule_Ix;
+  plhs[3] = mx_rule_Iy;
+  plhs[4] = mx_scoretpt;
+  if (mx_sym_rules != NULL)
+    plhs[5] = mx_sym_rules;
+  return cells;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Inputs of the dp and detect commands
+ **/
+enum {
+  IN_MODEL = 0,
+  IN_PYRA,
+  IN_FILTERS,
+  IN_OFFSETS,
+  IN_DEFS,
+  IN_NUM_THREADS,
+  IN_THRESH,
+  IN_MAX_NUM,
+  IN_DEADLINE
+};
+
+
+/** -----------------------------------------------------------------
+ ** Read the model, pyramid and parameters (in[IN_MODEL] ...
+ ** in[IN_DEFS]) and initialize the engine. Returns the number of
+ ** threads (in[IN_NUM_THREADS]) and sets thresh (in[IN_THRESH]).
+ ** The grammar is only read again when the model has changed.
+ **/
+static int setup(dp_workspace &ws, int nin, const mxArray *in[],
+                 double &thresh) {
+  ws.has_tables = false;
+  ws.keep.clear();
+
+  if (!ws.G.is_read_from(in[IN_MODEL]))
+    ws.G.init(in[IN_MODEL]);
+  read_pyramid(in[IN_PYRA], ws.P);
+  read_params(ws.G, in[IN_FILTERS], in[IN_OFFSETS], in[IN_DEFS],
+              ws.P.num_levels, ws.W);
+
+  int num_threads = omp_get_max_threads();
+  if (nin > IN_NUM_THREADS && !mxIsEmpty(in[IN_NUM_THREADS]))
+    num_threads = (int)mxGetScalar(in[IN_NUM_THREADS]);
+
+  thresh = -INFINITY;
+  if (nin > IN_THRESH && !mxIsEmpty(in[IN_THRESH]))
+    thresh = mxGetScalar(in[IN_THRESH]);
+
+  ws.E.init(ws.G, ws.P, ws.W);
+  return num_threads;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Run the dynamic program
+ **/
+static void dp_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 5 || nrhs > 7)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs != 0 && nlhs != 5 && nlhs != 6)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  dp_workspace &ws = gctx.ws;
+  double thresh;
+  const int num_threads = setup(ws, nrhs, prhs, thresh);
+
+  // Compute in the workspace (so the dynamic program doesn't
+  // allocate memory) and copy the tables out if they were asked for
+  ws.carve();
+  ws.E.run(ws.P, ws.W, num_threads, thresh);
+  if (nlhs > 0) {
+    vector<char> want(ws.G.num_symbols, 1);
+    create_outputs(ws, want, nlhs, plhs);
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Orders levels by decreasing bound (then by level)
+ **/
+struct level_order {
+  const vector<double> *bound;
+
+  bool operator()(int a, int b) const {
+    if ((*bound)[a] != (*bound)[b])
+      return (*bound)[a] > (*bound)[b];
+    return a < b;
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Compute the best start symbol locations level by level
+ **/
+static void detect_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  // matlab inputs
+  //  prhs[1] ... prhs[9]   see mexFunction
+  if (nrhs < 6 || nrhs > 10)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs != 6)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  // The deadline includes reading the inputs and the bound pass
+  const double start_time = omp_get_wtime();
+
+  const int nin = nrhs-1;
+  const mxArray **in = prhs+1;
+  dp_workspace &ws = gctx.ws;
+  double thresh;
+  const int num_threads = setup(ws, nin, in, thresh);
+
+  double in_max = INFINITY;
+  if (nin > IN_MAX_NUM && !mxIsEmpty(in[IN_MAX_NUM]))
+    in_max = mxGetScalar(in[IN_MAX_NUM]);
+  double deadline = INFINITY;
+  if (nin > IN_DEADLINE && !mxIsEmpty(in[IN_DEADLINE]))
+    deadline = mxGetScalar(in[IN_DEADLINE]);
+
+  dp_engine &E = ws.E;
+  const int L = E.num_levels;
+  ws.carve();
+  E.begin(ws.P, ws.W, num_threads, thresh, true);
+
+  // Levels that may have start symbol scores > thresh
+  vector<int> levels;
+  size_t total = 0;
+  for (int l = 0; l < L; l++) {
+    if (E.level_bound[l] > thresh) {
+      levels.push_back(l);
+      total += E.table_size(l);
+    }
+  }
+  level_order order = { &E.level_bound };
+  sort(levels.begin(), levels.end(), order);
+
+  size_t max_num = total;
+  if (in_max < (double)total)
+    max_num = (size_t)max(0.0, in_max);
+
+  // The max_num best candidates are final once the worst of them
+  // beats the bound of the next level (levels are in order of
+  // decreasing bound, so it beats all remaining levels too). The
+  // deadline leaves time to copy the tables computed so far out
+  // with 'get' (estimated from the last copy).
+  vector<char> completed(L, 0);
+  vector<candidate> best;
+  bool final = true;
+  const int start = ws.G.start;
+  for (int i = 0; i < (int)levels.size(); i++) {
+    const int l = levels[i];
+    if (best.size() == max_num &&
+        (max_num == 0 || best.front().score > E.level_bound[l]))
+      break;
+    const double copy_time = ws.copy_rate*E.done_cells();
+    if (omp_get_wtime() - start_time + copy_time > deadline) {
+      final = false;
+      break;
+    }
+    E.run_level(l);
+    completed[l] = 1;
+
+    const double *s = E.sym_score[start*L + l];
+    const int n = E.table_size(l);
+    for (int j = 0; j < n; j++) {
+      if (s[j] > thresh) {
+        candidate c = { s[j], l, j };
+        heap_add(best, c, max_num);
+      }
+    }
+  }
+  sort(best.begin(), best.end(), ranked_before);
+
+  // Only the tables on derivations of the candidates are copied out
+  // by 'get' (all of them were computed by run_level())
+  fill(E.graph.active.begin(), E.graph.active.end(), 0);
+  for (int i = 0; i < (int)best.size(); i++)
+    E.activate(start, best[i].level);
+  ws.keep.assign(E.graph.active.begin(), E.graph.active.end());
+
+  const int n = best.size();
+  mxArray *mx_X = mxCreateNumericMatrix(n, 1, mxINT32_CLASS, mxREAL);
+  mxArray *mx_Y = mxCreateNumericMatrix(n, 1, mxINT32_CLASS, mxREAL);
+  mxArray *mx_L = mxCreateNumericMatrix(n, 1, mxINT32_CLASS, mxREAL);
+  mxArray *mx_S = mxCreateNumericMatrix(n, 1, mxDOUBLE_CLASS, mxREAL);
+  int32_t *X = (int32_t *)mxGetData(mx_X);
+  int32_t *Y = (int32_t *)mxGetData(mx_Y);
+  int32_t *Lv = (int32_t *)mxGetData(mx_L);
+  double *S  = mxGetPr(mx_S);
+  for (int i = 0; i < n; i++) {
+    const candidate &c = best[i];
+    const int rows = E.dims[2*c.level];
+    X[i]  = c.index / rows + 1;
+    Y[i]  = c.index % rows + 1;
+    Lv[i] = c.level + 1;
+    S[i]  = c.score;
+  }
+
+  mxArray *mx_completed = mxCreateLogicalMatrix(1, L);
+  mxLogical *C = mxGetLogicals(mx_completed);
+  for (int l = 0; l < L; l++)
+    C[l] = completed[l];
+
+  plhs[0] = mx_X;
+  plhs[1] = mx_Y;
+  plhs[2] = mx_L;
+  plhs[3] = mx_S;
+  plhs[4] = mx_completed;
+  plhs[5] = mxCreateLogicalScalar(final);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Copy tables from the workspace into matlab arrays
+ **/
+static void get_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  // matlab inputs
+  //  prhs[1]   symbols to get (optional; default: all)
+  if (nrhs < 1 || nrhs > 2)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs != 5 && nlhs != 6)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  dp_workspace &ws = gctx.ws;
+  if (!ws.has_tables)
+    mexErrMsgTxt("No tables in the workspace; call gdetect_dp_mex "
+                 "without outputs first");
+
+  vector<char> want(ws.G.num_symbols, (nrhs < 2) ? 1 : 0);
+  if (nrhs > 1) {
+    const double *syms = mxGetPr(prhs[1]);
+    const int n        = mxGetNumberOfElements(prhs[1]);
+    for (int i = 0; i < n; i++) {
+      const int s = (int)syms[i] - 1;
+      if (s < 0 || s >= ws.G.num_symbols)
+        mexErrMsgTxt("Invalid symbol");
+      want[s] = 1;
+    }
+  }
+  const double t0 = omp_get_wtime();
+  const size_t cells = create_outputs(ws, want, nlhs, plhs);
+  if (cells > 0)
+    ws.copy_rate = (omp_get_wtime() - t0)/cells;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Size of the table arena in bytes
+ **/
+static void info_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  plhs[0] = mxCreateDoubleScalar((double)gctx.ws.arena_bytes());
+}
+
+
+/** -----------------------------------------------------------------
+ ** Release the table arena
+ **/
+static void free_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  gctx.ws.free_arena();
+}
+
+
+/** -----------------------------------------------------------------
+ ** Unlock mex file so it can be unloaded
+ **/
+static void unlock_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (mexIsLocked() == 1)
+    mexUnlock();
+}
+
+
+/** -----------------------------------------------------------------
+ ** mexAtExit callback
+ **/
+static void cleanup() {
+  gctx.ws.free_arena();
+  gctx.ws.E.sched.shutdown();
+}
+
+
+/** -----------------------------------------------------------------
+ ** Available commands.
+ **/
+static handler_registry handlers[] = {
+  { "detect",       detect_handler     },
+  { "get",          get_handler        },
+  { "info",         info_handler       },
+  { "free",         free_handler       },
+  { "unlock",       unlock_handler     },
+
+  // The end.
+  { "END",          NULL               },
+};
+
+
+// matlab entry point
+//                                                   0      1     2
+// [symbol_scores, rule_scores, rule_Ix, rule_Iy, scoretpt, symbol_rules]
+//   = gdetect_dp_mex(model, pyra, filters,
+//                    3        4     5            6
+//                    offsets, defs, num_threads, thresh)
+//
+// filters        cell array of (flipped) filters (class: single)
+// offsets{s}     num_levels x numel(model.rules{s}) matrix of offset +
+//                scale prior scores for each rule with lhs s
+// defs{s}        4 x numel(model.rules{s}) matrix of deformation
+//                parameters for each deformation rule with lhs s
+// num_threads    number of worker threads used by the (symbol, level)
+//                task scheduler (optional; [] => all processors)
+// thresh         detection threshold (optional); when given, table
+//                locations that can't lead to a start symbol score
+//                > thresh are pruned (set to -inf) before they are
+//                computed
+//
+// symbol_scores{s}     model.symbols(s).score
+// rule_scores{s}{r}    model.rules{s}(r).score
+// rule_Ix{s}{r}        model.rules{s}(r).Ix
+// rule_Iy{s}{r}        model.rules{s}(r).Iy
+// scoretpt             model.scoretpt
+// symbol_rules{s}      model.symbols(s).argmax_rule (optional output):
+//                      uint8 index of the rule in model.rules{s} that
+//                      attains symbol_scores{s} at each location
+//                      (first rule on ties; empty for symbols with
+//                      more than 255 rules)
+//
+// The tables are also kept in the workspace; call without output
+// arguments and use 'get' to copy out only some of them.
+// Other commands:
+//  [X, Y, L, S, levels, final]
+//    = gdetect_dp_mex('detect', model, pyra, filters, offsets, defs,
+//                     num_threads, thresh, max_num, deadline)
+//                        compute the tables (kept in the workspace)
+//                        level by level, best bound first, and return
+//                        the max_num (default: all) best start symbol
+//                        locations with score > thresh, in the format
+//                        of detection_candidates.cc. Levels are not
+//                        started when deadline seconds (default: no
+//                        deadline) minus the estimated time of the
+//                        following 'get' have passed. levels(l) is true
+//                        if level l was computed, and final is true if
+//                        no other level could change the result.
+//  [symbol_scores, ...] = gdetect_dp_mex('get', symbols)
+//                        copy the workspace tables of the given
+//                        symbols (default: all) into matlab arrays
+//                        (after 'detect', only the tables on
+//                        derivations of the candidates; the other
+//                        tables are empty)
+//  bytes = gdetect_dp_mex('info')   size of the table arena
+//  gdetect_dp_mex('free')           release the table arena
+//  gdetect_dp_mex('unlock')         allow the mex file to be unloaded
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  { // Lock mex file and register cleanup handler
+    if (mexIsLocked() == 0)
+      mexLock();
+
+    if (!gctx.cleanup_reg) {
+      mexAtExit(cleanup);
+      gctx.cleanup_reg = true;
+    }
+  }
+
+  if (nrhs < 1 || !mxIsChar(prhs[0])) {
+    dp_handler(nlhs, plhs, nrhs, prhs);
+    return;
+  }
+
+  char *cmd = mxArrayToString(prhs[0]);
+  bool found = false;
+  for (int i = 0; handlers[i].func != NULL; i++) {
+    if (handlers[i].cmd.compare(cmd) == 0) {
+      found = true;
+      handlers[i].func(nlhs, plhs, nrhs, prhs);
+      break;
+    }
+  }
+  mxFree(cmd);
+  if (!found)
+    mexErrMsgTxt("Unknown command");
+}
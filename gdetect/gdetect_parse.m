@@ -29,10 +29,30 @@ function [ds, bs, trees] = gdetect_parse(model, pyra, thresh, max_num)
 % your project.
 % -------------------------------------------------------
 
-% Find scores above the threshold
+% Find the (at most max_num) highest scores above the threshold
+if exist('detection_candidates') == 3  % 3 ==> MEX function
+  [X, Y, L, S] = detection_candidates(model.symbols(model.start).score, ...
+                                      thresh, max_num);
+else
+  [X, Y, L, S] = find_candidates(model, pyra, thresh, max_num);
+end
+
+get_loss = false;
+if isfield(model.rules{model.start}, 'loss')
+  get_loss = true;
+end
+
+% Compute detection windows, filter bounding boxes, and derivation trees
+[ds, bs, trees] = get_detection_trees(model, pyra.padx, pyra.pady, ...
+                                      pyra.scales, X, Y, L, S, get_loss);
+
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+% Find scores above the threshold and keep the max_num highest
+% (same output as detection_candidates.cc)
+function [X, Y, L, S] = find_candidates(model, pyra, thresh, max_num)
 X = zeros(0, 'int32');
 Y = zeros(0, 'int32');
-I = zeros(0, 'int32');
 L = zeros(0, 'int32');
 S = [];
 for level = 1:pyra.num_levels
@@ -41,7 +61,6 @@ for level = 1:pyra.num_levels
   [tmpY, tmpX] = ind2sub(size(score), tmpI);
   X = [X; tmpX];
   Y = [Y; tmpY];
-  I = [I; tmpI];
   L = [L; level*ones(length(tmpI), 1)];
   S = [S; score(tmpI)];
 end
@@ -52,15 +71,5 @@ if ~isempty(ord)
 end
 X = X(ord);
 Y = Y(ord);
-I = I(ord);
 L = L(ord);
 S = S(ord);
-
-get_loss = false;
-if isfield(model.rules{model.start}, 'loss')
-  get_loss = true;
-end
-
-% Compute detection windows, filter bounding boxes, and derivation trees
-[ds, bs, trees] = get_detection_trees(model, pyra.padx, pyra.pady, ...
-                                      pyra.scales, X, Y, L, S, get_loss);
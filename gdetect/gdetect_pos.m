@@ -117,6 +117,10 @@ for r = rules(2:end)
   end
 end
 model.symbols(model.start).score = score;
+% the argmax rule tables from gdetect_dp.m (if any) are stale now
+if isfield(model.symbols, 'argmax_rule')
+  model.symbols(model.start).argmax_rule = [];
+end
 
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -151,3 +155,7 @@ for r = rules(2:end)
   end
 end
 model.symbols(model.start).score = score;
+% the argmax rule tables from gdetect_dp.m (if any) are stale now
+if isfield(model.symbols, 'argmax_rule')
+  model.symbols(model.start).argmax_rule = [];
+end
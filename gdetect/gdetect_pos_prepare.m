@@ -45,3 +45,5 @@ model_dp = gdetect_dp(pyra, model);
 %  gdetect_dp until we know which levels can be skipped, which requires
 %  computing overlaps... At any rate, this isn't a major bottleneck.)
 pyra.overlaps = compute_overlaps(pyra, model_dp, boxes);
+% keep the boxes so loss_pyramid.m can compute losses from the geometry
+pyra.overlap_boxes = boxes;
@@ -0,0 +1,68 @@
+function [ds, bs, trees, levels, final] = gdetect_topk(pyra, model, thresh, max_num, deadline)
+% Detect the max_num highest scoring objects in a feature pyramid,
+% optionally within a time budget.
+%   [ds, bs, trees, levels, final] 
+%     = gdetect_topk(pyra, model, thresh, max_num, deadline)
+%
+%   Same as gdetect.m, except that the dynamic program is computed one
+%   pyramid level at a time, in order of decreasing upper bound on the
+%   level's detection scores. It stops as soon as no remaining level
+%   can contain one of the max_num best detections, or when the
+%   deadline has passed (a level that has been started is always
+%   finished). With max_num = 1 this is usually much faster than
+%   gdetect.m followed by taking the top detection.
+%
+% Return values (see gdetect.m for ds, bs, and trees)
+%   levels    levels(l) is true if pyramid level l was searched
+%   final     true if ds are the max_num best detections in the whole 
+%             pyramid (false if the deadline stopped the search early;
+%             ds are then the best detections in the searched levels)
+%
+% Arguments
+%   pyra      Feature pyramid to get detections from (output of featpyramid.m)
+%   model     Model to use for detection
+%   thresh    Detection threshold (scores must be > thresh)
+%   max_num   Maximum number of detections to return (default: 1)
+%   deadline  Time budget in seconds (default: inf)
+
+% AUTORIGHTS
+% -------------------------------------------------------
+% Copyright (C) 2009-2012 Ross Girshick
+% 
+% This file is part of the voc-releaseX code
+% (http://people.cs.uchicago.edu/~rbg/latent/)
+% and is available under the terms of an MIT-like license
+% provided in COPYING. Please retain this notice and
+% COPYING if you use this file (or a portion of it) in
+% your project.
+% -------------------------------------------------------
+
+if nargin < 4
+  max_num = 1;
+end
+
+if nargin < 5
+  deadline = inf;
+end
+
+if exist('gdetect_dp_mex') ~= 3  % 3 ==> MEX function
+  % Fall back to searching all levels
+  [ds, bs, trees] = gdetect(pyra, model, thresh, max_num);
+  levels = logical(pyra.valid_levels(:)');
+  final = true;
+  return;
+end
+
+[model, cands] = gdetect_dp(pyra, model, thresh, max_num, deadline);
+levels = cands.levels;
+final = cands.final;
+
+get_loss = false;
+if isfield(model.rules{model.start}, 'loss')
+  get_loss = true;
+end
+
+% Compute detection windows, filter bounding boxes, and derivation trees
+[ds, bs, trees] = get_detection_trees(model, pyra.padx, pyra.pady, ...
+                                      pyra.scales, cands.X, cands.Y, ...
+                                      cands.L, cands.S, get_loss);
@@ -11,7 +11,11 @@
 // -------------------------------------------------------
 
 #include "mex.h"
+#include "grammar.h"
+#include <stdint.h>
+#include <omp.h>
 #include <vector>
+#include <algorithm>
 
 using namespace std;
 
@@ -57,16 +61,197 @@ typedef vector<node> node_list;
 typedef node_list::iterator node_list_iter;
 
 
+/** -----------------------------------------------------------------
+ ** Score (or argmax) table at one pyramid level
+ **/
+template<class T>
+struct table {
+  const T *data;
+  int rows;
+
+  table() : data(NULL), rows(0) {}
+  T at(int x, int y) const { return data[x*rows + y]; }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Read the table at level l from a 1 x num_levels cell array
+ ** (the table is left NULL if it doesn't exist)
+ **/
+template<class T>
+static void read_table(const mxArray *mx_cell, int l, table<T> &t) {
+  t = table<T>();
+  if (mx_cell == NULL || l >= (int)mxGetNumberOfElements(mx_cell))
+    return;
+  const mxArray *mx_t = mxGetCell(mx_cell, l);
+  if (mx_t == NULL || mxIsEmpty(mx_t))
+    return;
+  t.data = (const T *)mxGetData(mx_t);
+  t.rows = mxGetDimensions(mx_t)[0];
+}
+
+
+/** -----------------------------------------------------------------
+ ** Model index
+ **
+ ** Everything backtracking needs from the model struct, so that it
+ ** is looked up once per call instead of once per tree node. Tables
+ ** are indexed by [symbol*num_levels + level] and [rule*num_levels
+ ** + level] (rules are numbered as in grammar.h). Only the tables
+ ** that backtracking can reach from the detections' levels are
+ ** looked up (see resolve()), and the grammar is kept across calls
+ ** while the model doesn't change.
+ **/
+struct model_index {
+  grammar G;
+  int num_levels;
+  double sbin;
+  bool get_loss;
+  // [rows cols] of each filter
+  vector<int> filter_size;
+  // [rows cols] detection window and shift of each rule
+  vector<double> detwindow;
+  vector<double> shiftwindow;
+  vector<table<double> >  sym_score;
+  // argmax rule tables from gdetect_dp.m (NULL if not available)
+  vector<table<uint8_t> > sym_rule;
+  vector<table<double> >  rule_score;
+  vector<table<int32_t> > rule_Ix;
+  vector<table<int32_t> > rule_Iy;
+  vector<table<double> >  rule_loss;
+
+  // Has resolve() been called for [symbol*num_levels + level]?
+  vector<char> resolved;
+  // Table cell arrays of each symbol and rule, looked up on first use
+  const mxArray *mx_symbols;
+  const mxArray *mx_rules;
+  vector<char> sym_read;
+  vector<const mxArray *> mx_sym_score;
+  vector<const mxArray *> mx_sym_rule;
+  vector<char> rule_read;
+  vector<const mxArray *> mx_rule_score;
+  vector<const mxArray *> mx_rule_Ix;
+  vector<const mxArray *> mx_rule_Iy;
+  vector<const mxArray *> mx_rule_loss;
+
+
+  /** ---------------------------------------------------------------
+   ** Build the index for model (no tables are read yet)
+   **/
+  void init(const mxArray *model, int L, bool loss) {
+    if (!G.is_read_from(model))
+      G.init(model);
+    num_levels = L;
+    get_loss   = loss;
+    sbin       = mxGetScalar(mxGetField(model, 0, "sbin"));
+
+    const mxArray *mx_filters = mxGetField(model, 0, "filters");
+    filter_size.resize(2*G.num_filters);
+    for (int i = 0; i < G.num_filters; i++) {
+      const double *fsz = mxGetPr(mxGetField(mx_filters, i, "size"));
+      filter_size[2*i+0] = (int)fsz[0];
+      filter_size[2*i+1] = (int)fsz[1];
+    }
+
+    mx_symbols = mxGetField(model, 0, "symbols");
+    mx_rules   = mxGetField(model, 0, "rules");
+    sym_read.assign(G.num_symbols, 0);
+    mx_sym_score.resize(G.num_symbols);
+    mx_sym_rule.resize(G.num_symbols);
+    sym_score.resize(G.num_symbols*L);
+    sym_rule.resize(G.num_symbols*L);
+    resolved.assign(G.num_symbols*L, 0);
+
+    const int num_rules = G.rules.size();
+    rule_read.assign(num_rules, 0);
+    mx_rule_score.resize(num_rules);
+    mx_rule_Ix.resize(num_rules);
+    mx_rule_Iy.resize(num_rules);
+    mx_rule_loss.resize(num_rules);
+    rule_score.resize(num_rules*L);
+    rule_Ix.resize(num_rules*L);
+    rule_Iy.resize(num_rules*L);
+    rule_loss.resize(num_rules*L);
+
+    detwindow.assign(2*num_rules, 0);
+    shiftwindow.assign(2*num_rules, 0);
+    const vector<int> &start_rules = G.symbols[G.start].rules;
+    for (int j = 0; j < (int)start_rules.size(); j++) {
+      const int ri = start_rules[j];
+      const grammar::rule &r = G.rules[ri];
+      const mxArray *mx_r = mxGetCell(mx_rules, r.lhs);
+      const double *det_win   = mxGetPr(mxGetField(mx_r, r.index, "detwindow"));
+      const double *shift_win = mxGetPr(mxGetField(mx_r, r.index, "shiftwindow"));
+      detwindow[2*ri+0]   = det_win[0];
+      detwindow[2*ri+1]   = det_win[1];
+      shiftwindow[2*ri+0] = shift_win[0];
+      shiftwindow[2*ri+1] = shift_win[1];
+    }
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Look up the tables of symbol s (and of its rules) at level l
+   ** and of everything a derivation of s at level l can reach. Uses
+   ** the matlab API, so it must be called before backtracking
+   ** starts.
+   **/
+  void resolve(int s, int l) {
+    const int L = num_levels;
+    if (l < 0 || l >= L || resolved[s*L + l])
+      return;
+    resolved[s*L + l] = 1;
+
+    if (!sym_read[s]) {
+      sym_read[s] = 1;
+      mx_sym_score[s] = mxGetField(mx_symbols, s, "score");
+      const mxArray *mx_argmax = mxGetField(mx_symbols, s, "argmax_rule");
+      if (mx_argmax != NULL && (!mxIsCell(mx_argmax) || mxIsEmpty(mx_argmax)))
+        mx_argmax = NULL;
+      if (mx_argmax != NULL) {
+        const mxArray *mx_t = mxGetCell(mx_argmax, 0);
+        if (mx_t == NULL || mxGetClassID(mx_t) != mxUINT8_CLASS)
+          mx_argmax = NULL;
+      }
+      mx_sym_rule[s] = mx_argmax;
+    }
+    read_table(mx_sym_score[s], l, sym_score[s*L + l]);
+    read_table(mx_sym_rule[s], l, sym_rule[s*L + l]);
+
+    const vector<int> &srules = G.symbols[s].rules;
+    for (int j = 0; j < (int)srules.size(); j++) {
+      const int ri = srules[j];
+      const grammar::rule &r = G.rules[ri];
+      if (!rule_read[ri]) {
+        rule_read[ri] = 1;
+        const mxArray *mx_r = mxGetCell(mx_rules, r.lhs);
+        mx_rule_score[ri] = mxGetField(mx_r, r.index, "score");
+        mx_rule_Ix[ri]    = mxGetField(mx_r, r.index, "Ix");
+        mx_rule_Iy[ri]    = mxGetField(mx_r, r.index, "Iy");
+        mx_rule_loss[ri]  = NULL;
+        if (get_loss && r.lhs == G.start)
+          mx_rule_loss[ri] = mxGetField(mx_r, r.index, "loss");
+      }
+      read_table(mx_rule_score[ri], l, rule_score[ri*L + l]);
+      read_table(mx_rule_Ix[ri], l, rule_Ix[ri*L + l]);
+      read_table(mx_rule_Iy[ri], l, rule_Iy[ri*L + l]);
+      read_table(mx_rule_loss[ri], l, rule_loss[ri*L + l]);
+
+      for (int k = 0; k < (int)r.rhs.size(); k++) {
+        const int ds = (r.type == 'S') ? r.anchor_ds(k) : 0;
+        resolve(r.rhs[k], l - G.interval*ds);
+      }
+    }
+  }
+};
+
+
 /** -----------------------------------------------------------------
  ** Package globals in the context struct
  **/
 struct context {
-  const mxArray *model;
-  const mxArray *rules;
+  model_index M;
   const double *scales;
-  int start_symbol;
-  int interval;
-  int next_id;
   int padx;
   int pady;
 };
@@ -93,24 +278,21 @@ static inline int virtpadding(int padding, int ds) {
 /** -----------------------------------------------------------------
  ** Enqueue node in processing queue
  **/
-static void enqueue(node_list &q, int parent_id,  
-                    int x, int y, int l, int ds, int r, 
-                    const double *rhs, int rhs_index) {
+static void enqueue(node_list &q, int &next_id, int parent_id,  
+                    int x, int y, int l, int ds, 
+                    const grammar::rule &r, int rhs_index) {
   // Symbol to push onto the stack
-  int sym = (int)rhs[rhs_index]-1;
+  int sym = r.rhs[rhs_index];
 
   // Lookup symbol's score
-  mxArray *mx_scores = mxGetCell(mxGetField(mxGetField(ctx.model, 0, "symbols"), 
-                                            sym, "score"), l);
-  double *scores = mxGetPr(mx_scores);
-  const mwSize *sz = mxGetDimensions(mx_scores);
+  const table<double> &scores = ctx.M.sym_score[sym*ctx.M.num_levels + l];
   int nvp_x = x - virtpadding(ctx.padx, ds);
   int nvp_y = y - virtpadding(ctx.pady, ds);
-  double score = scores[nvp_x*sz[0] + nvp_y];
+  double score = scores.at(nvp_x, nvp_y);
 
   // push symbol @ (x,y,l) onto the queue
   node n;
-  n.id         = ctx.next_id++;
+  n.id         = next_id++;
   n.parent     = parent_id;
   n.is_leaf    = 0; // not known until later  
   n.symbol     = sym;
@@ -129,15 +311,24 @@ static void enqueue(node_list &q, int parent_id,
 
 
 /** -----------------------------------------------------------------
- ** 
+ ** Backtrack to find the DP solution for a single detection
+ **
+ ** Safe to call concurrently for different detections: node ids are
+ ** counted per detection, q is the caller's (per-thread) queue, and
+ ** the tree is written to tree (N_SZ x number of nodes, column-major)
+ ** rather than to a matlab array. Returns false if the argmax rule
+ ** of a node can't be found.
  **/
-// backtrack to find the DP solution for a single detection
-static void backtrack(int det_index, int start_x, int start_y, int start_l, 
-                      double start_score, mxArray *mx_trees, double *dets, 
-                      mwSize *dets_dim, double *boxes, mwSize *boxes_dim,
-                      bool get_loss) {
+static bool backtrack(int start_x, int start_y, int start_l, 
+                      double start_score, double *dets, 
+                      const mwSize *dets_dim, double *boxes, 
+                      const mwSize *boxes_dim, bool get_loss,
+                      node_list &q, vector<double> &tree) {
+  const model_index &M = ctx.M;
+  const int L          = M.num_levels;
+
   // Queue for processing nodes in breadth-first order
-  node_list q;
+  q.clear();
 
   // Initial node representing the start symbol
   // The fields marked with "<-" are not complete until the node
@@ -147,7 +338,7 @@ static void backtrack(int det_index, int start_x, int start_y, int start_l,
   n.parent     = -1;
   n.is_leaf    = 0; // <- set to 1 if node symbol is a terminal
   n.rhs_index  = 0;
-  n.symbol     = ctx.start_symbol;
+  n.symbol     = M.G.start;
   n.rule_index = 0; // <- set after computing argmax rule
   n.rhs_index  = 0;
   n.x          = start_x;
@@ -160,7 +351,7 @@ static void backtrack(int det_index, int start_x, int start_y, int start_l,
   n.loss       = 0; // <-- set if start symbol
   q.push_back(n);
 
-  ctx.next_id = 1;
+  int next_id = 1;
 
   // Backtrack solution in breadth-first order
   unsigned int head = 0;
@@ -168,21 +359,19 @@ static void backtrack(int det_index, int start_x, int start_y, int start_l,
     // Get node at head of queue
     node n = q[head++];
 
-    mxChar type = mxGetChars(mxGetField(mxGetField(ctx.model, 0, "symbols"), n.symbol, "type"))[0];
+    const grammar::symbol &sym = M.G.symbols[n.symbol];
 
     //////////////////////////////////////////////////////////////////////
     // Node is a terminal
     //////////////////////////////////////////////////////////////////////
     
-    if (type == 'T') {
+    if (sym.type == 'T') {
       // terminal symbol
-      int fi = (int)mxGetScalar(mxGetField(mxGetField(ctx.model, 0, "symbols"), 
-                                           n.symbol, "filter")) - 1;
+      int fi = sym.filter;
       // filter size
-      double *fsz = mxGetPr(mxGetField(mxGetField(ctx.model, 0, "filters"), 
-                                       fi, "size"));
+      const int *fsz = &M.filter_size[2*fi];
       // detection scale
-      double scale = mxGetScalar(mxGetField(ctx.model, 0, "sbin"))/ctx.scales[n.l];
+      double scale = M.sbin/ctx.scales[n.l];
 
       // compute and record image coordinates for the filter
       double x1 = (n.x - ctx.padx*pow2(n.ds))*scale;
@@ -210,49 +399,48 @@ static void backtrack(int det_index, int start_x, int start_y, int start_l,
 
     // The current node represents a lhs symbol that was expanded using
     // one of its (possibly many) productions. We discover which production
-    // was expanded by computing the argmax. The argmax is computed by
-    // looking for the exact match to the current symbol's score in each of
-    // the production score tables.
+    // was expanded by computing the argmax. The argmax is read from the
+    // symbol's argmax rule table when the dynamic program recorded one;
+    // otherwise it is computed by looking for the exact match to the
+    // current symbol's score in each of the production score tables.
     bool success = false;
     // productions with current node's symbol on the lhs
-    const mxArray *rules = mxGetCell(ctx.rules, n.symbol);
-    const int num_rules = mxGetDimensions(rules)[1];
+    const int num_rules = sym.rules.size();
+    // Location of the current symbol without virtual padding
+    int nvp_y = n.y - virtpadding(ctx.pady, n.ds);
+    int nvp_x = n.x - virtpadding(ctx.padx, n.ds);
     int r = 0;
-    for (; r < num_rules; r++) {
-      // Location of the current symbol without virtual padding
-      int nvp_y = n.y - virtpadding(ctx.pady, n.ds);
-      int nvp_x = n.x - virtpadding(ctx.padx, n.ds);
-      mxArray *mx_scores = mxGetCell(mxGetField(rules, r, "score"), n.l);
-      const double *scores = mxGetPr(mx_scores);
-      const int num_rows = mxGetDimensions(mx_scores)[0];
-
-      // pick this rule if the rule's score matches the symbol's score (n.val)
-      if (scores[nvp_x*num_rows + nvp_y] == n.score) {
-        success = true;
-        break;
+    const table<uint8_t> &argmax = M.sym_rule[n.symbol*L + n.l];
+    if (argmax.data != NULL) {
+      r = argmax.at(nvp_x, nvp_y) - 1;
+      success = (r >= 0 && r < num_rules);
+    } else {
+      for (; r < num_rules; r++) {
+        const table<double> &scores = M.rule_score[sym.rules[r]*L + n.l];
+        // pick this rule if the rule's score matches the symbol's score (n.val)
+        if (scores.at(nvp_x, nvp_y) == n.score) {
+          success = true;
+          break;
+        }
       }
     }
     if (!success)
-      mexErrMsgTxt("Rule argmax not found");
+      return false;
 
     // Finalize current node data (this node expands using rule index r)
     n.rule_index = r;
-    // Get list of rhs symbols for rule index r
-    const mxArray *mx_rhs = mxGetField(rules, r, "rhs");
-    const double *rhs = mxGetPr(mx_rhs);
-    const int rhs_len = mxGetDimensions(mx_rhs)[1];
+    const int ri = sym.rules[r];
+    const grammar::rule &rule = M.G.rules[ri];
+    const int rhs_len = rule.rhs.size();
 
     // Record a detection window for the start symbol and rule index r
-    if (n.symbol == ctx.start_symbol) {
+    if (n.symbol == M.G.start) {
       // get detection window for start_symbol and rule r
-      mxArray *mx_det_win = mxGetField(rules, r, "detwindow");
-      double *det_win = mxGetPr(mx_det_win);
-      mxArray *mx_shift_win = mxGetField(rules, r, "shiftwindow");
-      double *shift_win = mxGetPr(mx_shift_win);
+      const double *det_win = &M.detwindow[2*ri];
+      const double *shift_win = &M.shiftwindow[2*ri];
 
-      
       // detection scale
-      double scale = mxGetScalar(mxGetField(ctx.model, 0, "sbin"))/ctx.scales[n.l];
+      double scale = M.sbin/ctx.scales[n.l];
       
       // compute and record image coordinates of the detection window
       double x1 = (n.x-shift_win[1]-ctx.padx*pow2(n.ds))*scale;
@@ -270,52 +458,40 @@ static void backtrack(int det_index, int start_x, int start_y, int start_l,
       boxes[boxes_dim[0]*(boxes_dim[1]-2)] = r + 1;
       boxes[boxes_dim[0]*(boxes_dim[1]-1)] = n.score;
 
-      if (get_loss) {
-        const mxArray *mx_loss = mxGetCell(mxGetField(rules, r, "loss"), n.l);
-        const double *loss = mxGetPr(mx_loss);
-        const mwSize *sz = mxGetDimensions(mx_loss);
-        n.loss = loss[n.x*sz[0] + n.y];
-      }
+      if (get_loss)
+        n.loss = M.rule_loss[ri*L + n.l].at(n.x, n.y);
     }
 
-    type = mxGetChars(mxGetField(rules, r, "type"))[0];
-    if (type == 'S') {
+    if (rule.type == 'S') {
       // Handle structural rule
       // Enqueue each rhs symbol
       for (int rhs_index = 0; rhs_index < rhs_len; rhs_index++) {
         // Get anchor vector
-        const double *anchor = mxGetPr(mxGetCell(mxGetField(rules, r, "anchor"), rhs_index));
-        int a_x   = (int)anchor[0];
-        int a_y   = (int)anchor[1];
-        int a_ds  = (int)anchor[2];
+        int a_x   = rule.anchor_x(rhs_index);
+        int a_y   = rule.anchor_y(rhs_index);
+        int a_ds  = rule.anchor_ds(rhs_index);
         // Compute rhs symbol's location
         int rhs_x = n.x*pow2(a_ds) + a_x;
         int rhs_y = n.y*pow2(a_ds) + a_y;
-        int rhs_l = n.l - ctx.interval*a_ds;
+        int rhs_l = n.l - M.G.interval*a_ds;
         // Acccumulate # of 2x rescalings relative to the start symbol
         int rhs_ds = n.ds + a_ds;
-        enqueue(q, n.id, rhs_x, rhs_y, rhs_l, rhs_ds, r, rhs, rhs_index);
+        enqueue(q, next_id, n.id, rhs_x, rhs_y, rhs_l, rhs_ds, rule, rhs_index);
       }
     } else {
       // Handle deformation rule (only 1 rhs symbol)
       // Get deformation argmax tables
-      mxArray *mxIx = mxGetCell(mxGetField(rules, r, "Ix"), n.l);
-      mxArray *mxIy = mxGetCell(mxGetField(rules, r, "Iy"), n.l);
-      int *Ix = (int *)mxGetPr(mxIx);
-      int *Iy = (int *)mxGetPr(mxIy);
-      const mwSize *isz = mxGetDimensions(mxIx);
-
-      // Location of current symbol without virtual padding
-      int nvp_x = n.x - virtpadding(ctx.padx, n.ds);
-      int nvp_y = n.y - virtpadding(ctx.pady, n.ds);
+      const table<int32_t> &Ix = M.rule_Ix[ri*L + n.l];
+      const table<int32_t> &Iy = M.rule_Iy[ri*L + n.l];
+
       // Computing the rhs symbol's location:
       //  - the rhs symbol is (possibly) shifted/deformed to some other 
       //    location
       //  - lookup the rhs symbol's displaced location using the distance
       //    transform's argmax tables Ix and Iy
       //  - subtract 1 because Ix and Iy use 1-based indexing
-      int rhs_nvp_x = Ix[nvp_x*isz[0] + nvp_y] - 1;
-      int rhs_nvp_y = Iy[nvp_x*isz[0] + nvp_y] - 1;
+      int rhs_nvp_x = Ix.at(nvp_x, nvp_y) - 1;
+      int rhs_nvp_y = Iy.at(nvp_x, nvp_y) - 1;
       // rhs location with virtual padding
       int rhs_x = rhs_nvp_x + virtpadding(ctx.padx, n.ds);
       int rhs_y = rhs_nvp_y + virtpadding(ctx.pady, n.ds);
@@ -324,17 +500,15 @@ static void backtrack(int det_index, int start_x, int start_y, int start_l,
       n.dx = n.x - rhs_x;
       n.dy = n.y - rhs_y;
 
-      enqueue(q, n.id, rhs_x, rhs_y, n.l, n.ds, r, rhs, 0);
+      enqueue(q, next_id, n.id, rhs_x, rhs_y, n.l, n.ds, rule, 0);
     }
     // Update current node since we filled in the missing information
     q[head-1] = n;
   }
 
   // Construct output tree matrix
-  mwSize dims[] = { node::N_SZ, ctx.next_id };
-  mxArray *mx_tree_mat = mxCreateNumericArray(2, dims, mxDOUBLE_CLASS, mxREAL);
-  mxSetCell(mx_trees, det_index, mx_tree_mat);
-  double *tree_mat = mxGetPr(mx_tree_mat);
+  tree.resize(node::N_SZ*next_id);
+  double *tree_mat = &tree[0];
 
   for (node_list_iter i = q.begin(), i_end = q.end(); i != i_end; ++i) {
     *(tree_mat + node::N_PARENT)      = i->parent + 1;
@@ -352,13 +526,20 @@ static void backtrack(int det_index, int start_x, int start_y, int start_l,
     *(tree_mat + node::N_LOSS)        = i->loss;
     tree_mat += node::N_SZ;
   }
+  return true;
 }
 
 
 /** -----------------------------------------------------------------
  ** matlab entry point
  **                                            0      1     2     3       4  5  6  7  8
- ** [dets, boxes, trees] = get_detection_trees(model, padx, pady, scales, X, Y, L, S, get_loss);
+ ** [dets, boxes, trees] = get_detection_trees(model, padx, pady, scales, X, Y, L, S, get_loss,
+ **                                            9
+ **                                            num_threads);
+ **
+ ** num_threads is optional (default: all processors). Detections are
+ ** backtracked concurrently; the output doesn't depend on the number
+ ** of threads.
  **/
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) { 
   // dim[0] := number of detections to return
@@ -372,15 +553,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     return;
   }
 
-  // Set up global context
-  ctx.model         = prhs[0];
-  ctx.rules         = mxGetField(ctx.model, 0, "rules");
-  ctx.scales        = mxGetPr(prhs[3]);
-  ctx.padx          = (int)mxGetScalar(prhs[1]);
-  ctx.pady          = (int)mxGetScalar(prhs[2]);
-  ctx.start_symbol  = (int)mxGetScalar(mxGetField(ctx.model, 0, "start")) - 1;
-  ctx.interval      = (int)mxGetScalar(mxGetField(ctx.model, 0, "interval"));
-
   // Get other inputs (position and score)
   const int *X          = (int *)mxGetPr(prhs[4]);
   const int *Y          = (int *)mxGetPr(prhs[5]);
@@ -388,6 +560,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   const double *S       = mxGetPr(prhs[7]);
   const bool get_loss   = (bool)mxGetScalar(prhs[8]);
 
+  // Set up global context
+  ctx.scales        = mxGetPr(prhs[3]);
+  ctx.padx          = (int)mxGetScalar(prhs[1]);
+  ctx.pady          = (int)mxGetScalar(prhs[2]);
+  ctx.M.init(prhs[0], mxGetNumberOfElements(prhs[3]), get_loss);
+
   // return empty arrays if there are no detections
   // Detection boxes
   mwSize dets_dim[] = { dim[0],
@@ -399,7 +577,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   // Filter bounding boxes
   mwSize boxes_dim[2];
   boxes_dim[0] = dim[0];
-  boxes_dim[1] = 4*(int)mxGetScalar(mxGetField(ctx.model, 0, "numfilters")) + 2;
+  boxes_dim[1] = 4*ctx.M.G.num_filters + 2;
   mxArray *mx_boxes = mxCreateNumericArray(2, boxes_dim, mxDOUBLE_CLASS, mxREAL);
   double *boxes = mxGetPr(mx_boxes);
   plhs[1] = mx_boxes;
@@ -408,9 +586,37 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   mxArray *mx_trees = mxCreateCellArray(1, &dim[0]);
   plhs[2] = mx_trees;
 
-  // Backtrack solution and write output into out
-  for (int i = 0; i < dim[0]; i++)
-    backtrack(i, X[i]-1, Y[i]-1, L[i]-1, S[i], 
-              mx_trees, dets++, dets_dim, boxes++, 
-              boxes_dim, get_loss);
+  int num_threads = omp_get_max_threads();
+  if (nrhs > 9)
+    num_threads = max(1, (int)mxGetScalar(prhs[9]));
+
+  // Look up the tables reachable from the detections' levels, then
+  // backtrack solutions in parallel (one tree per detection); the
+  // matlab API is only used here, from this thread
+  const int num_dets = dim[0];
+  for (int i = 0; i < num_dets; i++)
+    ctx.M.resolve(ctx.M.G.start, L[i]-1);
+  vector<vector<double> > tree_data(num_dets);
+  vector<char> ok(num_dets, 0);
+  #pragma omp parallel num_threads(num_threads)
+  {
+    node_list q;
+    #pragma omp for schedule(dynamic)
+    for (int i = 0; i < num_dets; i++)
+      ok[i] = backtrack(X[i]-1, Y[i]-1, L[i]-1, S[i], 
+                        dets+i, dets_dim, boxes+i, 
+                        boxes_dim, get_loss, q, tree_data[i]);
+  }
+
+  for (int i = 0; i < num_dets; i++)
+    if (!ok[i])
+      mexErrMsgTxt("Rule argmax not found");
+
+  // Write output trees
+  for (int i = 0; i < num_dets; i++) {
+    mwSize dims[] = { node::N_SZ, tree_data[i].size()/node::N_SZ };
+    mxArray *mx_tree_mat = mxCreateNumericArray(2, dims, mxDOUBLE_CLASS, mxREAL);
+    copy(tree_data[i].begin(), tree_data[i].end(), mxGetPr(mx_tree_mat));
+    mxSetCell(mx_trees, i, mx_tree_mat);
+  }
 }
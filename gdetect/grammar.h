@@ -0,0 +1,257 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef GRAMMAR_H
+#define GRAMMAR_H
+
+#include "mex.h"
+#include <vector>
+
+using namespace std;
+
+/** -----------------------------------------------------------------
+ ** Native view of the grammar stored in a model struct
+ **
+ ** The matlab model stores symbols and rules in struct arrays that
+ ** can only be accessed through string-keyed lookups. This struct
+ ** reads the parts of the grammar needed by the native dynamic
+ ** programming and parsing code once, into flat arrays. All indices
+ ** are 0-based.
+ **/
+struct grammar {
+  /** ---------------------------------------------------------------
+   ** Production (rule) in the grammar
+   **/
+  struct rule {
+    char type;            // 'S' (structural) or 'D' (deformation)
+    int lhs;              // lhs symbol
+    int index;            // index of this rule in model.rules{lhs}
+    vector<int> rhs;      // rhs symbols
+    vector<int> anchor;   // [ax ay ds] for each rhs symbol ('S' only)
+
+    int anchor_x(int j) const { return anchor[3*j+0]; }
+    int anchor_y(int j) const { return anchor[3*j+1]; }
+    int anchor_ds(int j) const { return anchor[3*j+2]; }
+  };
+
+  /** ---------------------------------------------------------------
+   ** Grammar symbol
+   **/
+  struct symbol {
+    char type;            // 'T' (terminal) or 'N' (nonterminal)
+    int filter;           // filter index ('T' only)
+    vector<int> rules;    // indices into grammar::rules with this lhs
+  };
+
+  int num_symbols;
+  int num_filters;
+  int start;
+  int interval;
+
+  vector<symbol> symbols;
+  vector<rule> rules;
+  // Nonterminal symbols reachable from the start symbol in
+  // topological (post visit) order; same as model_sort.m
+  vector<int> order;
+  // DFS state used by sort_symbols()
+  vector<int> visited;
+
+  // Incremented by every init(), so that data derived from the
+  // grammar can tell when it has to be rebuilt
+  unsigned int version;
+  // Set once init() has read a grammar successfully
+  bool is_valid;
+
+
+  /** ---------------------------------------------------------------
+   ** Constructor
+   **/
+  grammar() {
+    num_symbols = 0;
+    num_filters = 0;
+    start       = -1;
+    interval    = 0;
+    version     = 0;
+    is_valid    = false;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Was the grammar read from this model?
+   **
+   ** Compares every field that init() reads (symbol types and 
+   ** filters, and each rule's type, rhs and anchors). Matlab arrays
+   ** can be edited in place and their addresses reused, so the 
+   ** contents have to be compared rather than the arrays. This costs
+   ** about as much as reading the grammar, which is small next to the
+   ** dynamic programming, but leaves version (and the data derived 
+   ** from the grammar) unchanged.
+   **/
+  bool is_read_from(const mxArray *model) const {
+    if (!is_valid)
+      return false;
+    if (num_symbols != (int)mxGetScalar(mxGetField(model, 0, "numsymbols")) ||
+        num_filters != (int)mxGetScalar(mxGetField(model, 0, "numfilters")) ||
+        start != (int)mxGetScalar(mxGetField(model, 0, "start")) - 1 ||
+        interval != (int)mxGetScalar(mxGetField(model, 0, "interval")))
+      return false;
+
+    const mxArray *mx_symbols = mxGetField(model, 0, "symbols");
+    const mxArray *mx_rules   = mxGetField(model, 0, "rules");
+    for (int s = 0; s < num_symbols; s++) {
+      const symbol &sym = symbols[s];
+      if (sym.type != (char)mxGetChars(mxGetField(mx_symbols, s, "type"))[0])
+        return false;
+      if (sym.type == 'T' && sym.filter != 
+          (int)mxGetScalar(mxGetField(mx_symbols, s, "filter")) - 1)
+        return false;
+
+      int num_sym_rules = 0;
+      const mxArray *mx_sym_rules = NULL;
+      if (s < (int)mxGetNumberOfElements(mx_rules)) {
+        mx_sym_rules = mxGetCell(mx_rules, s);
+        if (mx_sym_rules != NULL)
+          num_sym_rules = mxGetNumberOfElements(mx_sym_rules);
+      }
+      if (num_sym_rules != (int)sym.rules.size())
+        return false;
+
+      for (int r = 0; r < num_sym_rules; r++) {
+        const rule &ru = rules[sym.rules[r]];
+        if (ru.type != (char)mxGetChars(mxGetField(mx_sym_rules, r, "type"))[0])
+          return false;
+
+        const mxArray *mx_rhs = mxGetField(mx_sym_rules, r, "rhs");
+        const double *rhs     = mxGetPr(mx_rhs);
+        const int rhs_len     = mxGetNumberOfElements(mx_rhs);
+        if (rhs_len != (int)ru.rhs.size())
+          return false;
+        for (int j = 0; j < rhs_len; j++)
+          if (ru.rhs[j] != (int)rhs[j] - 1)
+            return false;
+
+        if (ru.type == 'S') {
+          const mxArray *mx_anchors = mxGetField(mx_sym_rules, r, "anchor");
+          for (int j = 0; j < rhs_len; j++) {
+            const double *anchor = mxGetPr(mxGetCell(mx_anchors, j));
+            if (ru.anchor_x(j) != (int)anchor[0] ||
+                ru.anchor_y(j) != (int)anchor[1] ||
+                ru.anchor_ds(j) != (int)anchor[2])
+              return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Read the grammar from a matlab model struct
+   ** (Storage from a previous call is reused, so reading the same
+   ** grammar again does not allocate memory.)
+   **/
+  void init(const mxArray *model) {
+    num_symbols = (int)mxGetScalar(mxGetField(model, 0, "numsymbols"));
+    num_filters = (int)mxGetScalar(mxGetField(model, 0, "numfilters"));
+    start       = (int)mxGetScalar(mxGetField(model, 0, "start")) - 1;
+    interval    = (int)mxGetScalar(mxGetField(model, 0, "interval"));
+
+    const mxArray *mx_symbols = mxGetField(model, 0, "symbols");
+    const mxArray *mx_rules   = mxGetField(model, 0, "rules");
+    // The grammar is only marked valid once it has been read 
+    // successfully
+    version++;
+    is_valid = false;
+
+    int num_rules = 0;
+    symbols.resize(num_symbols);
+    for (int s = 0; s < num_symbols; s++) {
+      symbol &sym = symbols[s];
+      sym.rules.clear();
+      sym.type    = (char)mxGetChars(mxGetField(mx_symbols, s, "type"))[0];
+      sym.filter  = -1;
+      if (sym.type == 'T')
+        sym.filter = (int)mxGetScalar(mxGetField(mx_symbols, s, "filter")) - 1;
+
+      if (s >= (int)mxGetNumberOfElements(mx_rules))
+        continue;
+      const mxArray *mx_sym_rules = mxGetCell(mx_rules, s);
+      if (mx_sym_rules == NULL || mxIsEmpty(mx_sym_rules))
+        continue;
+
+      const int num_sym_rules = mxGetNumberOfElements(mx_sym_rules);
+      for (int r = 0; r < num_sym_rules; r++) {
+        if (num_rules == (int)rules.size())
+          rules.push_back(rule());
+        rule &ru = rules[num_rules];
+        ru.rhs.clear();
+        ru.anchor.clear();
+        ru.type  = (char)mxGetChars(mxGetField(mx_sym_rules, r, "type"))[0];
+        ru.lhs   = s;
+        ru.index = r;
+
+        const mxArray *mx_rhs = mxGetField(mx_sym_rules, r, "rhs");
+        const double *rhs     = mxGetPr(mx_rhs);
+        const int rhs_len     = mxGetNumberOfElements(mx_rhs);
+        for (int j = 0; j < rhs_len; j++)
+          ru.rhs.push_back((int)rhs[j] - 1);
+
+        if (ru.type == 'S') {
+          const mxArray *mx_anchors = mxGetField(mx_sym_rules, r, "anchor");
+          for (int j = 0; j < rhs_len; j++) {
+            const double *anchor = mxGetPr(mxGetCell(mx_anchors, j));
+            ru.anchor.push_back((int)anchor[0]);
+            ru.anchor.push_back((int)anchor[1]);
+            ru.anchor.push_back((int)anchor[2]);
+          }
+        }
+
+        sym.rules.push_back(num_rules);
+        num_rules++;
+      }
+    }
+    rules.resize(num_rules);
+
+    // Topological sort of the nonterminals
+    order.clear();
+    visited.assign(num_symbols, 0);
+    sort_symbols(start, visited);
+
+    is_valid = true;
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Depth-first search used to sort the nonterminals
+   **/
+  void sort_symbols(int s, vector<int> &visited) {
+    // check for cycle containing symbol s
+    if (visited[s] == 1)
+      mexErrMsgTxt("Cycle detected in grammar!");
+
+    // mark symbol s as pre-visit
+    visited[s] = 1;
+    const vector<int> &srules = symbols[s].rules;
+    for (int r = 0; r < (int)srules.size(); r++) {
+      const vector<int> &rhs = rules[srules[r]].rhs;
+      for (int j = 0; j < (int)rhs.size(); j++)
+        if (symbols[rhs[j]].type == 'N' && visited[rhs[j]] < 2)
+          sort_symbols(rhs[j], visited);
+    }
+    // mark symbol s as post-visit
+    visited[s] = 2;
+    order.push_back(s);
+  }
+};
+
+#endif // GRAMMAR_H
@@ -1,14 +1,19 @@
-function losses = loss_func(o)
+function [losses, form] = loss_func(o)
 % Compute the loss associated with the intersection over union
 % overlap between a ground-truth bounding box and any other 
 % windows.
 %   losses = loss_func(o)
+%   [losses, form] = loss_func()
 %
-% Return value
-%   losses    Loss for each element in the input
+% Return values
+%   losses    Loss for each element in the input (empty if no input
+%             is given)
+%   form      Closed form of the loss for loss_pyramid_mex.cc:
+%             form.type is 'step' or 'linear' and form.param is the
+%             parameter of the loss (see loss_pyramid_mex.cc)
 %
 % Argument
-%   o         Vector of overlap values
+%   o         Vector of overlap values (optional)
 
 % AUTORIGHTS
 % -------------------------------------------------------
@@ -23,8 +28,15 @@ function losses = loss_func(o)
 % -------------------------------------------------------
 
 % The PASCAL VOC detection task loss
-% Loss is 0 for IoU >= 0.5
-% Loss is 1 for IoU < 0.5
+% Loss is 0 for IoU >= thresh
+% Loss is 1 for IoU < thresh
+thresh = 0.5;
+form = struct('type', 'step', 'param', thresh);
+if nargin < 1
+  losses = [];
+  return;
+end
+
 losses = zeros(size(o));
-I = find(o < 0.5);
+I = find(o < thresh);
 losses(I) = 1.0;
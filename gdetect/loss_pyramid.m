@@ -37,6 +37,26 @@ function model = loss_pyramid(h_loss_func, pyra, model, fg_box, ...
 % your project.
 % -------------------------------------------------------
 
+% Compute the loss tables directly from the box geometry if
+% loss_pyramid_mex has been compiled and the loss function reports a
+% closed form that it implements (see loss_func.m)
+form = [];
+if exist('loss_pyramid_mex') == 3 ...  % 3 ==> MEX function
+   && isfield(pyra, 'overlap_boxes')
+  form = loss_form(h_loss_func);
+end
+if ~isempty(form)
+  [detwins, shifts, dims, scales] = window_geometry(pyra, model);
+  losses = loss_pyramid_mex(pyra.overlap_boxes, detwins, shifts, dims, ...
+                            scales, pyra.padx, pyra.pady, pyra.imsize, ...
+                            fg_box, bg_boxes, min_fg_overlap, ...
+                            max_bg_overlap, form.type, form.param);
+  for comp = 1:length(model.rules{model.start})
+    model.rules{model.start}(comp).loss = losses{comp};
+  end
+  return;
+end
+
 num_bg_boxes = length(bg_boxes);
 
 % For each model component
@@ -74,3 +94,17 @@ for comp = 1:length(model.rules{model.start})
     end
   end
 end
+
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+% closed form of a loss function (see loss_func.m); empty if the
+% loss function doesn't report one
+function form = loss_form(h_loss_func)
+form = [];
+try
+  if nargout(h_loss_func) >= 2
+    [dummy, form] = h_loss_func();
+  end
+catch
+  form = [];
+end
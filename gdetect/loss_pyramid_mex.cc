@@ -0,0 +1,173 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "mex.h"
+#include "overlap.h"
+#include <omp.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Native version of loss_pyramid.m for the built-in loss functions.
+ *
+ * The loss tables are computed directly from the box geometry: for
+ * each column of a table, the overlap with the foreground box is
+ * computed (see overlap.h), turned into a loss and masked with -inf
+ * where it is < min_fg_overlap, and then the overlap with each
+ * background box is computed and the loss is masked where it is
+ * >= max_bg_overlap. Only one column of overlaps is kept at a time.
+ * The (component, level) tables are computed in parallel.
+ *
+ * Built-in loss functions:
+ *  'step'    loss = 1 if o < param, 0 otherwise (loss_func.m: param 0.5)
+ *  'linear'  loss = 1 - o
+ */
+
+enum loss_type {
+  LOSS_STEP = 0,
+  LOSS_LINEAR
+};
+
+
+/** -----------------------------------------------------------------
+ ** One loss table to compute
+ **/
+struct loss_job {
+  int comp;
+  int level;
+  double *loss;
+};
+
+
+// matlab entry point
+//                                0      1        2       3     4
+// losses = loss_pyramid_mex(boxes, detwins, shifts, dims, scales,
+//                           5     6     7       8       9
+//                           padx, pady, imsize, fg_box, bg_boxes,
+//                           10              11
+//                           min_fg_overlap, max_bg_overlap,
+//                           12         13
+//                           loss_type, loss_param)
+// boxes ... imsize  see compute_overlaps_mex.cc
+// fg_box            selected foreground box (index into boxes)
+// bg_boxes          indices of non-selected boxes
+// min_fg_overlap    minimum required overlap with the fg box
+// max_bg_overlap    maximum allowed overlap with the bg boxes
+// loss_type         'step' or 'linear' (see above)
+// loss_param        parameter of the loss function
+//
+// losses{c}{l}      model.rules{model.start}(c).loss{l} (see
+//                   loss_pyramid.m; 0 for levels that are skipped)
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs != 14)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs > 1)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  window_geometry A;
+  A.read(prhs);
+
+  const int fg_box = (int)mxGetScalar(prhs[8]) - 1;
+  if (fg_box < 0 || fg_box >= A.num_boxes)
+    mexErrMsgTxt("Invalid input: fg_box");
+  const double *in_bg  = mxGetPr(prhs[9]);
+  const int num_bg     = mxGetNumberOfElements(prhs[9]);
+  vector<int> bg_boxes(num_bg);
+  for (int i = 0; i < num_bg; i++) {
+    bg_boxes[i] = (int)in_bg[i] - 1;
+    if (bg_boxes[i] < 0 || bg_boxes[i] >= A.num_boxes)
+      mexErrMsgTxt("Invalid input: bg_boxes");
+  }
+  const double min_fg_overlap = mxGetScalar(prhs[10]);
+  const double max_bg_overlap = mxGetScalar(prhs[11]);
+
+  char *type_str = mxArrayToString(prhs[12]);
+  if (type_str == NULL)
+    mexErrMsgTxt("Invalid input: loss_type");
+  const string type(type_str);
+  mxFree(type_str);
+  loss_type type_id = LOSS_STEP;
+  if (type == "step")
+    type_id = LOSS_STEP;
+  else if (type == "linear")
+    type_id = LOSS_LINEAR;
+  else
+    mexErrMsgTxt("Unknown loss type");
+  const double param = mxGetScalar(prhs[13]);
+
+  // Create all outputs (from this thread) and collect the jobs
+  mxArray *mx_losses = mxCreateCellMatrix(A.num_comps, 1);
+  vector<loss_job> jobs;
+  for (int c = 0; c < A.num_comps; c++) {
+    mxArray *mx_comp = mxCreateCellMatrix(1, A.num_levels);
+    mxSetCell(mx_losses, c, mx_comp);
+    for (int l = 0; l < A.num_levels; l++) {
+      if (A.rows(c, l) == 0) {
+        mxSetCell(mx_comp, l, mxCreateDoubleScalar(0));
+        continue;
+      }
+      mxArray *mx_loss = mxCreateDoubleMatrix(A.rows(c, l), A.cols(c, l),
+                                              mxREAL);
+      mxSetCell(mx_comp, l, mx_loss);
+      loss_job J = { c, l, mxGetPr(mx_loss) };
+      jobs.push_back(J);
+    }
+  }
+
+  #pragma omp parallel
+  {
+    overlap_terms fg;
+    vector<overlap_terms> bg(num_bg);
+    vector<double> o;
+    #pragma omp for schedule(dynamic)
+    for (int i = 0; i < (int)jobs.size(); i++) {
+      const loss_job &J = jobs[i];
+      A.terms(J.comp, fg_box, J.level, fg);
+      for (int b = 0; b < num_bg; b++)
+        A.terms(J.comp, bg_boxes[b], J.level, bg[b]);
+      const int rows = fg.rows;
+      o.resize(rows);
+
+      for (int x = 0; x < fg.cols; x++) {
+        double *dst = J.loss + x*rows;
+
+        // Loss from the overlap with the foreground box
+        fg.column(x, &o[0]);
+        if (type_id == LOSS_STEP) {
+          for (int y = 0; y < rows; y++)
+            dst[y] = (o[y] < param) ? 1.0 : 0.0;
+        } else {
+          for (int y = 0; y < rows; y++)
+            dst[y] = 1.0 - o[y];
+        }
+
+        // Require at least some overlap with the foreground box
+        for (int y = 0; y < rows; y++)
+          if (o[y] < min_fg_overlap)
+            dst[y] = -INFINITY;
+
+        // Mark locations that overlap a background box too much
+        for (int b = 0; b < num_bg; b++) {
+          bg[b].column(x, &o[0]);
+          for (int y = 0; y < rows; y++)
+            if (o[y] >= max_bg_overlap)
+              dst[y] = -INFINITY;
+        }
+      }
+    }
+  }
+
+  plhs[0] = mx_losses;
+}
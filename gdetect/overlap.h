@@ -0,0 +1,224 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2009-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#ifndef OVERLAP_H
+#define OVERLAP_H
+
+#include "mex.h"
+#include <emmintrin.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/** -----------------------------------------------------------------
+ ** Overlap between a bounding box and every placement of a detection
+ ** window in a feature map (see compute_overlap.cc)
+ **
+ ** The clipped window x extent depends only on the column and the y
+ ** extent only on the row, so the intersection width and window
+ ** width are precomputed per column and the intersection height and
+ ** window height per row. A column of the overlap map is then
+ ** computed two rows at a time with SSE2. The arithmetic is the same
+ ** as in compute_overlap.cc, so the results are identical.
+ **/
+struct overlap_terms {
+  int rows;
+  int cols;
+  double bbox_area;
+  vector<double> int_w;
+  vector<double> win_w;
+  // rows are padded to an even length for the SSE loop
+  vector<double> int_h;
+  vector<double> win_h;
+
+
+  /** ---------------------------------------------------------------
+   ** Precompute the terms
+   ** bbox      [x1 y1 x2 y2] in image coordinates (bbox[k*stride])
+   ** fdim_y/x  detection window size (in cells)
+   ** pad_y/x   feature map padding (plus window shift)
+   ** scale     image scale the feature map was computed at
+   ** rows/cols size of the overlap map
+   ** im_size_y/x  image size
+   **/
+  void init(const double *bbox, int stride, double fdim_y, double fdim_x,
+            double pad_y, double pad_x, double scale, int rows_, int cols_,
+            double im_size_y, double im_size_x) {
+    rows = rows_;
+    cols = cols_;
+    const double bbox_x1 = bbox[0*stride] - 1;
+    const double bbox_y1 = bbox[1*stride] - 1;
+    const double bbox_x2 = bbox[2*stride] - 1;
+    const double bbox_y2 = bbox[3*stride] - 1;
+
+    const double im_area = im_size_x * im_size_y;
+    bbox_area = (bbox_x2 - bbox_x1 + 1) * (bbox_y2 - bbox_y1 + 1);
+
+    // clip detection window to image boundary only if
+    // the bbox is less than 70% of the image area
+    const bool im_clip = (double)bbox_area / (double)im_area < 0.7;
+
+    const int rows2 = max(2, (rows + 1) & ~1);
+    int_w.resize(max(1, cols));
+    win_w.resize(max(1, cols));
+    int_h.resize(rows2);
+    win_h.resize(rows2);
+    axis(cols, fdim_x, scale, pad_x, im_size_x, im_clip, bbox_x1, bbox_x2,
+         &int_w[0], &win_w[0]);
+    axis(rows, fdim_y, scale, pad_y, im_size_y, im_clip, bbox_y1, bbox_y2,
+         &int_h[0], &win_h[0]);
+    if (rows2 > rows) {
+      int_h[rows] = 0;
+      win_h[rows] = 1;
+    }
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Is the overlap zero everywhere in column x?
+   **/
+  bool column_empty(int x) const {
+    return !(int_w[x] > 0);
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Overlap for each row of column x (0 where the window doesn't
+   ** intersect the box)
+   **/
+  void column(int x, double *dst) const {
+    if (column_empty(x)) {
+      fill(dst, dst + rows, 0.0);
+      return;
+    }
+    const double *ih_p = &int_h[0];
+    const double *fh_p = &win_h[0];
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d barea = _mm_set1_pd(bbox_area);
+    const __m128d iw = _mm_set1_pd(int_w[x]);
+    const __m128d fw = _mm_set1_pd(win_w[x]);
+    int y = 0;
+    for (; y+1 < rows; y += 2) {
+      const __m128d ih = _mm_loadu_pd(ih_p + y);
+      const __m128d fh = _mm_loadu_pd(fh_p + y);
+      const __m128d filter_area = _mm_mul_pd(fw, fh);
+      const __m128d int_area = _mm_mul_pd(iw, ih);
+      const __m128d union_area = _mm_sub_pd(_mm_add_pd(filter_area, barea),
+                                            int_area);
+      const __m128d o = _mm_and_pd(_mm_cmpgt_pd(ih, zero),
+                                   _mm_div_pd(int_area, union_area));
+      _mm_storeu_pd(dst + y, o);
+    }
+    for (; y < rows; y++) {
+      dst[y] = 0;
+      if (int_h[y] > 0) {
+        double filter_area = win_w[x] * win_h[y];
+        double int_area = int_w[x] * int_h[y];
+        double union_area = filter_area + bbox_area - int_area;
+        dst[y] = int_area / union_area;
+      }
+    }
+  }
+
+
+private:
+  /** ---------------------------------------------------------------
+   ** Separable terms along one axis: for placements 0 ... n-1 of a
+   ** window of size fdim, the intersection length with [b1, b2] and
+   ** the (clipped) window length
+   **/
+  static void axis(int n, double fdim, double scale, double pad,
+                   double im_size, bool im_clip, double b1, double b2,
+                   double *int_len, double *win_len) {
+    for (int i = 0; i < n; i++) {
+      // pixel extent of the window
+      double a1 = (i - pad) * scale;
+      double a2 = a1 + fdim*scale - 1;
+      if (im_clip) {
+        a1 = min(max(a1, 0.0), im_size-1);
+        a2 = min(max(a2, 0.0), im_size-1);
+      }
+      int_len[i] = min(a2, b2) - max(a1, b1) + 1;
+      win_len[i] = a2 - a1 + 1;
+    }
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Boxes and detection window geometry passed from matlab
+ ** (see compute_overlaps_mex.cc for the layout)
+ **/
+struct window_geometry {
+  const double *boxes;
+  int num_boxes;
+  const double *detwins;
+  const double *shifts;
+  int num_comps;
+  const double *dims;
+  const double *scales;
+  int num_levels;
+  double padx;
+  double pady;
+  double im_size_y;
+  double im_size_x;
+
+
+  /** ---------------------------------------------------------------
+   ** Read boxes, detwins, shifts, dims, scales, padx, pady, imsize
+   ** from in[0] ... in[7]
+   **/
+  void read(const mxArray *in[]) {
+    boxes      = mxGetPr(in[0]);
+    num_boxes  = mxGetM(in[0]);
+    detwins    = mxGetPr(in[1]);
+    shifts     = mxGetPr(in[2]);
+    num_comps  = mxGetM(in[1]);
+    dims       = mxGetPr(in[3]);
+    scales     = mxGetPr(in[4]);
+    num_levels = mxGetNumberOfElements(in[4]);
+    padx       = mxGetScalar(in[5]);
+    pady       = mxGetScalar(in[6]);
+    const double *im_size = mxGetPr(in[7]);
+    im_size_y  = im_size[0];
+    im_size_x  = im_size[1];
+
+    if (num_boxes > 0 && mxGetN(in[0]) < 4)
+      mexErrMsgTxt("Invalid input: boxes must have at least 4 columns");
+    if (mxGetN(in[1]) != 2 || mxGetM(in[2]) != (mwSize)num_comps ||
+        mxGetN(in[2]) != 2)
+      mexErrMsgTxt("Invalid input: detwins and shifts must be num_comps x 2");
+    if (mxGetNumberOfElements(in[3]) != (mwSize)(2*num_levels*num_comps))
+      mexErrMsgTxt("Invalid input: dims must be num_levels x 2 x num_comps");
+  }
+
+
+  /** ---------------------------------------------------------------
+   ** Size of the maps of component c at level l (0 rows => skip)
+   **/
+  int rows(int c, int l) const { return (int)dims[l + 2*num_levels*c]; }
+  int cols(int c, int l) const { return (int)dims[l + num_levels + 2*num_levels*c]; }
+
+
+  /** ---------------------------------------------------------------
+   ** Overlap terms for component c, box b and level l
+   **/
+  void terms(int c, int b, int l, overlap_terms &T) const {
+    T.init(boxes + b, num_boxes,
+           detwins[c], detwins[c + num_comps],
+           pady + shifts[c], padx + shifts[c + num_comps],
+           scales[l], rows(c, l), cols(c, l), im_size_y, im_size_x);
+  }
+};
+
+#endif // OVERLAP_H
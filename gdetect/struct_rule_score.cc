@@ -0,0 +1,99 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "mex.h"
+#include "dp.h"
+#include <algorithm>
+
+using namespace std;
+
+/*
+ * Score table for a structural rule at one pyramid level.
+ *
+ * The output table is created once, filled with the rule's offset
+ * and scale prior score, and then the shifted and 2^ds subsampled
+ * score table of each rhs symbol is added to it in place. Locations
+ * that sample outside of a rhs score table are set to -inf. This
+ * replaces the -inf temporaries and the full-size additions in
+ * apply_structural_rule (gdetect_dp.m).
+ */
+
+// matlab entry point
+//                            0    1     2       3        4     5
+// score = struct_rule_score(val, dims, scores, anchors, pady, padx)
+// val      offset + scale prior score for the rule at this level
+// dims     [rows cols] of the output score table
+// scores   cell array with the score table of each rhs symbol at the
+//          level it is sampled from (empty => the level is outside of
+//          the pyramid)
+// anchors  3 x numel(scores) matrix of [ax; ay; ds] anchors
+// pady     number of rows of feature map padding
+// padx     number of cols of feature map padding
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs != 6)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs != 1)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  enum {
+    IN_VAL = 0,
+    IN_DIMS,
+    IN_SCORES,
+    IN_ANCHORS,
+    IN_PADY,
+    IN_PADX
+  };
+
+  const double val      = mxGetScalar(prhs[IN_VAL]);
+  const double *in_dims = mxGetPr(prhs[IN_DIMS]);
+  const mxArray *scores = prhs[IN_SCORES];
+  const int num_rhs     = mxGetNumberOfElements(scores);
+  const double *anchors = mxGetPr(prhs[IN_ANCHORS]);
+  const int pady        = (int)mxGetScalar(prhs[IN_PADY]);
+  const int padx        = (int)mxGetScalar(prhs[IN_PADX]);
+
+  if (!mxIsCell(scores))
+    mexErrMsgTxt("Invalid input: scores must be a cell array");
+  if (mxGetNumberOfElements(prhs[IN_ANCHORS]) != (mwSize)(3*num_rhs))
+    mexErrMsgTxt("Invalid input: anchors must be 3 x numel(scores)");
+
+  const int rows = (int)in_dims[0];
+  const int cols = (int)in_dims[1];
+  mwSize dims[] = { (mwSize)rows, (mwSize)cols };
+  mxArray *mx_score = mxCreateNumericArray(2, dims, mxDOUBLE_CLASS, mxREAL);
+  double *score = mxGetPr(mx_score);
+  fill(score, score + rows*cols, val);
+
+  for (int j = 0; j < num_rhs; j++) {
+    const mxArray *mx_s = mxGetCell(scores, j);
+    if (mx_s == NULL || mxIsEmpty(mx_s)) {
+      fill(score, score + rows*cols, -INFINITY);
+      continue;
+    }
+    if (mxGetClassID(mx_s) != mxDOUBLE_CLASS)
+      mexErrMsgTxt("Invalid input: score tables must be double precision");
+
+    const int ax   = (int)anchors[3*j+0];
+    const int ay   = (int)anchors[3*j+1];
+    const int ds   = (int)anchors[3*j+2];
+    // step size for down sampling
+    const int step = dp_pow2(ds);
+    // starting points (simulates additional padding at finer scales)
+    const int y0   = ay - (step-1)*pady;
+    const int x0   = ax - (step-1)*padx;
+    const mwSize *s_dims = mxGetDimensions(mx_s);
+    shift_accumulate(score, rows, cols, mxGetPr(mx_s),
+                     s_dims[0], s_dims[1], y0, x0, step);
+  }
+
+  plhs[0] = mx_score;
+}
@@ -0,0 +1,42 @@
+function [detwins, shifts, dims, scales] = window_geometry(pyra, model)
+% Collect the detection window geometry of each top-level rule in the
+% grammar for compute_overlaps_mex and loss_pyramid_mex.
+%   [detwins, shifts, dims, scales] = window_geometry(pyra, model)
+%
+% Return values
+%   detwins   num_comps x 2 matrix of detection window sizes [rows cols]
+%   shifts    num_comps x 2 matrix of detection window shifts [y x]
+%   dims      num_levels x 2 x num_comps array of score table sizes
+%             (0 for levels that are not valid)
+%   scales    image scale each feature map was computed at
+%
+% Arguments
+%   pyra      Feature pyramid
+%   model     Model (augmented with DP tables from gdetect_dp.m)
+
+% AUTORIGHTS
+% -------------------------------------------------------
+% Copyright (C) 2009-2012 Ross Girshick
+% 
+% This file is part of the voc-releaseX code
+% (http://people.cs.uchicago.edu/~rbg/latent/)
+% and is available under the terms of an MIT-like license
+% provided in COPYING. Please retain this notice and
+% COPYING if you use this file (or a portion of it) in
+% your project.
+% -------------------------------------------------------
+
+num_comps = length(model.rules{model.start});
+detwins = zeros(num_comps, 2);
+shifts  = zeros(num_comps, 2);
+dims    = zeros(pyra.num_levels, 2, num_comps);
+for comp = 1:num_comps
+  detwins(comp, :) = model.rules{model.start}(comp).detwindow;
+  shifts(comp, :)  = model.rules{model.start}(comp).shiftwindow;
+  for level = 1:pyra.num_levels
+    if pyra.valid_levels(level)
+      dims(level, :, comp) = size(model.rules{model.start}(comp).score{level});
+    end
+  end
+end
+scales = model.sbin./pyra.scales;
@@ -53,3 +53,5 @@ m.stats.slave_problem_time = [];  % time spent in slave problem optimization
 m.stats.data_mining_time   = [];  % time spent in data mining
 m.stats.pos_latent_time    = [];  % time spent in inference on positives
 m.stats.filter_usage       = [];  % foreground training instances / filter
+m.stats.cache_obj          = [];  % cache objective [bg fg reg total] after
+                                  % each optimization
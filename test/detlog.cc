@@ -0,0 +1,565 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "mex.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Append-only binary detection log.
+ *
+ * A log is a sequence of records, one per tested image. Each record
+ * is a fixed size header followed by the detections of the image:
+ *
+ *   header    (see record_header)
+ *   boxes     double, num_dets x 4, row-major [x1 y1 x2 y2]
+ *   scores    double, num_dets
+ *   parts     double, num_dets x num_part_cols, row-major
+ *   comps     int32, num_dets (model component of each detection)
+ *   padding   to a multiple of 8 bytes
+ *
+ * Values are stored in double precision, so detections read back
+ * from a log are exactly the ones that were appended. Records of
+ * other versions are skipped.
+ *
+ * Records are appended with a single write() under an exclusive
+ * flock() and synced to disk before the lock is released. Because of
+ * that, several processes (e.g., parfor workers) can append to the
+ * same log at the same time. Each header has a checksum over the
+ * whole record. A reader skips any record that doesn't check out,
+ * such as a record torn by a crash, and resynchronizes on the next
+ * valid header. When an image appears more than once (e.g., after a
+ * resumed run), its last record wins.
+ *
+ * The log is read by memory mapping it.
+ */
+
+static const uint32_t LOG_MAGIC   = 0x474c5444;  // "DTLG"
+static const uint32_t LOG_VERSION = 1;
+
+
+/** -----------------------------------------------------------------
+ ** Record header (32 bytes)
+ **/
+struct record_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;          // bytes in the record, including this header
+  uint32_t image;         // 1-based image index
+  uint32_t num_dets;
+  uint32_t num_part_cols;
+  uint32_t reserved;
+  uint32_t checksum;      // of the record with this field set to 0
+};
+
+
+/** -----------------------------------------------------------------
+ ** Record size for num_dets detections with num_part_cols part
+ ** box columns (padded to a multiple of 8 bytes)
+ **/
+static inline size_t record_size(size_t num_dets, size_t num_part_cols) {
+  size_t size = sizeof(record_header)
+                + num_dets*(8*(4 + 1 + num_part_cols) + 4);
+  return (size + 7) & ~(size_t)7;
+}
+
+
+/** -----------------------------------------------------------------
+ ** FNV-1a hash
+ **/
+static inline uint32_t fnv1a(const unsigned char *p, size_t n, uint32_t h) {
+  for (size_t i = 0; i < n; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Checksum of a record (header with the checksum field set to 0,
+ ** followed by the rest of the record)
+ **/
+static uint32_t record_checksum(const record_header &hdr,
+                                const unsigned char *body, size_t n) {
+  record_header h = hdr;
+  h.checksum = 0;
+  uint32_t sum = fnv1a((const unsigned char *)&h, sizeof(h), 2166136261u);
+  return fnv1a(body, n, sum);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Read-only memory map of a log
+ **/
+struct log_map {
+  const unsigned char *data;
+  size_t size;
+
+  log_map() : data(NULL), size(0) {}
+
+  ~log_map() {
+    if (data != NULL)
+      munmap((void *)data, size);
+  }
+
+  /** ---------------------------------------------------------------
+   ** Map filename (a log that doesn't exist is empty)
+   **/
+  void open(const char *filename) {
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+      if (errno == ENOENT)
+        return;
+      mexErrMsgTxt(strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      mexErrMsgTxt(strerror(errno));
+    }
+    size = st.st_size;
+    if (size > 0) {
+      void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        size = 0;
+        mexErrMsgTxt(strerror(errno));
+      }
+      data = (const unsigned char *)p;
+    }
+    close(fd);
+  }
+
+private:
+  log_map(const log_map &);
+  log_map &operator=(const log_map &);
+};
+
+
+/** -----------------------------------------------------------------
+ ** Valid record in a mapped log
+ **/
+struct record {
+  record_header hdr;
+  const unsigned char *body;    // detections (after the header)
+
+  // Pointers into body (the map is page aligned and records are
+  // 8-byte aligned, unless the log was resynchronized after a torn
+  // record; the values are copied with memcpy)
+  const unsigned char *boxes() const  { return body; }
+  const unsigned char *scores() const { return body + 32*hdr.num_dets; }
+  const unsigned char *parts() const  { return body + 40*hdr.num_dets; }
+  const unsigned char *comps() const {
+    return parts() + 8*(size_t)hdr.num_dets*hdr.num_part_cols;
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Is there a valid record at offset off of the map?
+ **/
+static bool parse_record(const log_map &M, size_t off, record &r) {
+  if (off + sizeof(record_header) > M.size)
+    return false;
+  memcpy(&r.hdr, M.data + off, sizeof(record_header));
+  const record_header &h = r.hdr;
+  if (h.magic != LOG_MAGIC || h.version != LOG_VERSION)
+    return false;
+  if (h.size != record_size(h.num_dets, h.num_part_cols) ||
+      off + h.size > M.size)
+    return false;
+  r.body = M.data + off + sizeof(record_header);
+  return h.checksum == record_checksum(h, r.body,
+                                       h.size - sizeof(record_header));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Find the last valid record of each image 1 ... num_images
+ ** (last[i-1] is -1 for images that are not in the log)
+ **/
+static void index_log(const log_map &M, int num_images,
+                      vector<record> &records, vector<int> &last) {
+  records.clear();
+  last.assign(num_images, -1);
+  size_t off = 0;
+  record r;
+  while (off + sizeof(record_header) <= M.size) {
+    if (!parse_record(M, off, r)) {
+      // torn or corrupt data; resynchronize on the next valid header
+      off++;
+      continue;
+    }
+    if (r.hdr.image >= 1 && r.hdr.image <= (uint32_t)num_images) {
+      last[r.hdr.image-1] = records.size();
+      records.push_back(r);
+    }
+    off += r.hdr.size;
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Read a string argument
+ **/
+static string get_string(const mxArray *mx) {
+  char *s = mxArrayToString(mx);
+  if (s == NULL)
+    mexErrMsgTxt("Invalid input: expected a string");
+  string str(s);
+  mxFree(s);
+  return str;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Append the detections of one image
+ **/
+static void append_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  // matlab inputs
+  //  prhs[1]   log filename
+  //  prhs[2]   image index
+  //  prhs[3]   ds (see mexFunction)
+  //  prhs[4]   bs
+  if (nrhs != 5)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs != 0)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  const string filename = get_string(prhs[1]);
+  const double image    = mxGetScalar(prhs[2]);
+  const mxArray *mx_ds  = prhs[3];
+  const mxArray *mx_bs  = prhs[4];
+  if (image < 1 || image != floor(image))
+    mexErrMsgTxt("Invalid input: image index");
+  if (!mxIsDouble(mx_ds) || !mxIsDouble(mx_bs))
+    mexErrMsgTxt("Invalid input: ds and bs must be double precision");
+
+  const size_t num_dets = mxIsEmpty(mx_ds) ? 0 : mxGetM(mx_ds);
+  const size_t ds_cols  = mxGetN(mx_ds);
+  if (num_dets > 0 && ds_cols < 5)
+    mexErrMsgTxt("Invalid input: ds must have at least 5 columns");
+  const size_t num_part_cols = (num_dets == 0) ? 0 : mxGetN(mx_bs);
+  if (num_part_cols > 0 && mxGetM(mx_bs) != num_dets)
+    mexErrMsgTxt("Invalid input: ds and bs must have the same number of rows");
+
+  // Build the record
+  const size_t size = record_size(num_dets, num_part_cols);
+  vector<unsigned char> buf(size, 0);
+  record_header hdr;
+  hdr.magic         = LOG_MAGIC;
+  hdr.version       = LOG_VERSION;
+  hdr.size          = size;
+  hdr.image         = (uint32_t)image;
+  hdr.num_dets      = num_dets;
+  hdr.num_part_cols = num_part_cols;
+  hdr.reserved      = 0;
+  hdr.checksum      = 0;
+
+  unsigned char *body = &buf[0] + sizeof(record_header);
+  double  *boxes  = (double *)body;
+  double  *scores = (double *)(body + 32*num_dets);
+  double  *parts  = (double *)(body + 40*num_dets);
+  int32_t *comps  = (int32_t *)(parts + num_dets*num_part_cols);
+  const double *ds = mxGetPr(mx_ds);
+  const double *bs = mxGetPr(mx_bs);
+  for (size_t i = 0; i < num_dets; i++) {
+    for (int k = 0; k < 4; k++)
+      boxes[4*i + k] = ds[i + k*num_dets];
+    // score is the last column; the component (if any) the 5th
+    scores[i] = ds[i + (ds_cols-1)*num_dets];
+    comps[i]  = (ds_cols > 5) ? (int32_t)ds[i + 4*num_dets] : 0;
+    for (size_t k = 0; k < num_part_cols; k++)
+      parts[num_part_cols*i + k] = bs[i + k*num_dets];
+  }
+  hdr.checksum = record_checksum(hdr, body, size - sizeof(record_header));
+  memcpy(&buf[0], &hdr, sizeof(hdr));
+
+  // Append it in one write (O_APPEND + an exclusive lock, so records
+  // from concurrent writers are never interleaved)
+  int fd = open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0)
+    mexErrMsgTxt(strerror(errno));
+  if (flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    mexErrMsgTxt(strerror(errno));
+  }
+  size_t written = 0;
+  int err = 0;
+  while (written < size) {
+    ssize_t n = write(fd, &buf[written], size - written);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      err = errno;
+      break;
+    }
+    written += n;
+  }
+  if (err == 0 && fdatasync(fd) != 0)
+    err = errno;
+  flock(fd, LOCK_UN);
+  close(fd);
+  if (err != 0)
+    mexErrMsgTxt(strerror(err));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Read the detections of all images
+ **/
+static void read_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  // matlab inputs
+  //  prhs[1]   log filename
+  //  prhs[2]   number of images
+  if (nrhs != 3)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs < 1 || nlhs > 4)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  const string filename = get_string(prhs[1]);
+  const int num_images  = (int)mxGetScalar(prhs[2]);
+
+  log_map M;
+  M.open(filename.c_str());
+  vector<record> records;
+  vector<int> last;
+  index_log(M, num_images, records, last);
+
+  mxArray *mx_ds    = mxCreateCellMatrix(1, num_images);
+  mxArray *mx_bs    = mxCreateCellMatrix(1, num_images);
+  mxArray *mx_done  = mxCreateLogicalMatrix(1, num_images);
+  mxArray *mx_comps = mxCreateCellMatrix(1, num_images);
+  mxLogical *done   = mxGetLogicals(mx_done);
+  for (int i = 0; i < num_images; i++) {
+    if (last[i] < 0) {
+      mxSetCell(mx_ds, i, mxCreateDoubleMatrix(0, 0, mxREAL));
+      mxSetCell(mx_bs, i, mxCreateDoubleMatrix(0, 0, mxREAL));
+      mxSetCell(mx_comps, i, mxCreateDoubleMatrix(0, 0, mxREAL));
+      continue;
+    }
+    done[i] = true;
+    const record &r = records[last[i]];
+    const int n = r.hdr.num_dets;
+    const int p = r.hdr.num_part_cols;
+    // [x1 y1 x2 y2 score] (the format of pascal_test.m)
+    mxArray *ds    = mxCreateDoubleMatrix(n, (n > 0) ? 5 : 0, mxREAL);
+    mxArray *bs    = mxCreateDoubleMatrix(n, (n > 0) ? p : 0, mxREAL);
+    mxArray *comps = mxCreateDoubleMatrix(n, (n > 0) ? 1 : 0, mxREAL);
+    double *ds_p = mxGetPr(ds);
+    double *bs_p = mxGetPr(bs);
+    double *c_p  = mxGetPr(comps);
+    for (int j = 0; j < n; j++) {
+      double box[4], score;
+      int32_t comp;
+      memcpy(box, r.boxes() + 32*j, sizeof(box));
+      memcpy(&score, r.scores() + 8*j, sizeof(score));
+      memcpy(&comp, r.comps() + 4*j, sizeof(comp));
+      for (int k = 0; k < 4; k++)
+        ds_p[j + k*n] = box[k];
+      ds_p[j + 4*n] = score;
+      c_p[j] = comp;
+      for (int k = 0; k < p; k++) {
+        double v;
+        memcpy(&v, r.parts() + 8*((size_t)p*j + k), sizeof(v));
+        bs_p[j + k*n] = v;
+      }
+    }
+    mxSetCell(mx_ds, i, ds);
+    mxSetCell(mx_bs, i, bs);
+    mxSetCell(mx_comps, i, comps);
+  }
+
+  plhs[0] = mx_ds;
+  if (nlhs > 1)
+    plhs[1] = mx_bs;
+  else
+    mxDestroyArray(mx_bs);
+  if (nlhs > 2)
+    plhs[2] = mx_done;
+  else
+    mxDestroyArray(mx_done);
+  if (nlhs > 3)
+    plhs[3] = mx_comps;
+  else
+    mxDestroyArray(mx_comps);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Which images are in the log?
+ **/
+static void done_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  // matlab inputs
+  //  prhs[1]   log filename
+  //  prhs[2]   number of images
+  if (nrhs != 3)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs > 1)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  const string filename = get_string(prhs[1]);
+  const int num_images  = (int)mxGetScalar(prhs[2]);
+
+  log_map M;
+  M.open(filename.c_str());
+  vector<record> records;
+  vector<int> last;
+  index_log(M, num_images, records, last);
+
+  plhs[0] = mxCreateLogicalMatrix(1, num_images);
+  mxLogical *done = mxGetLogicals(plhs[0]);
+  for (int i = 0; i < num_images; i++)
+    done[i] = (last[i] >= 0);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Print a number like matlab's fprintf does for %d (non-integers
+ ** are printed with %e)
+ **/
+static inline void print_int(FILE *f, double v) {
+  if (v == floor(v) && fabs(v) < 1e15)
+    fprintf(f, "%.0f", v);
+  else
+    fprintf(f, "%e", v);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Write the detections in the PASCAL results format
+ ** (same output as the loop in pascal_eval.m)
+ **/
+static void write_voc_handler(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  // matlab inputs
+  //  prhs[1]   log filename
+  //  prhs[2]   cell array of image ids (in the order of the image
+  //            indices)
+  //  prhs[3]   output filename
+  if (nrhs != 4)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs != 0)
+    mexErrMsgTxt("Wrong number of outputs");
+  if (!mxIsCell(prhs[2]))
+    mexErrMsgTxt("Invalid input: ids must be a cell array");
+
+  const string filename = get_string(prhs[1]);
+  const string outname  = get_string(prhs[3]);
+  const int num_images  = mxGetNumberOfElements(prhs[2]);
+
+  log_map M;
+  M.open(filename.c_str());
+  vector<record> records;
+  vector<int> last;
+  index_log(M, num_images, records, last);
+
+  vector<string> ids(num_images);
+  for (int i = 0; i < num_images; i++)
+    if (last[i] >= 0)
+      ids[i] = get_string(mxGetCell(prhs[2], i));
+
+  FILE *f = fopen(outname.c_str(), "w");
+  if (f == NULL)
+    mexErrMsgTxt(strerror(errno));
+  for (int i = 0; i < num_images; i++) {
+    if (last[i] < 0)
+      continue;
+    const record &r = records[last[i]];
+    const string &id = ids[i];
+    for (int j = 0; j < (int)r.hdr.num_dets; j++) {
+      double box[4], score;
+      memcpy(box, r.boxes() + 32*j, sizeof(box));
+      memcpy(&score, r.scores() + 8*j, sizeof(score));
+      fprintf(f, "%s %f", id.c_str(), score);
+      for (int k = 0; k < 4; k++) {
+        fputc(' ', f);
+        print_int(f, box[k]);
+      }
+      fputc('\n', f);
+    }
+  }
+  if (fclose(f) != 0)
+    mexErrMsgTxt(strerror(errno));
+}
+
+
+/** -----------------------------------------------------------------
+ ** Commands and handler functions
+ **/
+struct handler_registry {
+  string cmd;
+  void (*func)(int, mxArray **, int, const mxArray **);
+};
+
+
+/** -----------------------------------------------------------------
+ ** Available commands.
+ **/
+static handler_registry handlers[] = {
+  { "append",       append_handler     },
+  { "read",         read_handler       },
+  { "done",         done_handler       },
+  { "write_voc",    write_voc_handler  },
+
+  // The end.
+  { "END",          NULL               },
+};
+
+
+// matlab entry point
+//  detlog('append', filename, i, ds, bs)
+//      append the detections of image i; ds are detections as
+//      returned by imgdetect (after clipping and NMS) with the
+//      box in columns 1-4, the component in column 5 (if there are
+//      more than 5 columns) and the score in the last column; bs
+//      are the part boxes saved by pascal_test.m
+//  [ds, bs, done, comps] = detlog('read', filename, num_images)
+//      ds{i}      [x1 y1 x2 y2 score] of each detection in image i
+//      bs{i}      part boxes
+//      done(i)    is image i in the log?
+//      comps{i}   component of each detection
+//  done = detlog('done', filename, num_images)
+//  detlog('write_voc', filename, ids, outfile)
+//      write all detections to outfile in the PASCAL results format
+//
+// Boxes, part boxes and scores are stored in double precision.
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1 || !mxIsChar(prhs[0]))
+    mexErrMsgTxt("Expected a command");
+
+  char *cmd = mxArrayToString(prhs[0]);
+  bool found = false;
+  for (int i = 0; handlers[i].func != NULL; i++) {
+    if (handlers[i].cmd.compare(cmd) == 0) {
+      found = true;
+      handlers[i].func(nlhs, plhs, nrhs, prhs);
+      break;
+    }
+  }
+  mxFree(cmd);
+  if (!found)
+    mexErrMsgTxt("Unknown command");
+}
@@ -6,10 +6,13 @@ function pick = nms(boxes, overlap)
 %   significantly covered by a previously selected detection.
 %
 % Return value
-%   pick      Indices of locally maximal detections
+%   pick      Indices of locally maximal detections (in order of
+%             decreasing score)
 %
 % Arguments
-%   boxes     Detection bounding boxes (see pascal_test.m)
+%   boxes     Detection bounding boxes (see pascal_test.m), or a cell
+%             array of them (e.g., one per class or image), in which
+%             case pick is a cell array of the same size
 %   overlap   Overlap threshold for suppression
 %             For a selected box Bi, all boxes Bj that are covered by 
 %             more than overlap are suppressed. Note that 'covered' is
@@ -30,7 +33,15 @@ function pick = nms(boxes, overlap)
 % your project.
 % -------------------------------------------------------
 
-if isempty(boxes)
+% Use the native implementation if it has been compiled (see compile.m)
+if exist('nms_mex') == 3  % 3 ==> MEX function
+  pick = nms_mex(boxes, overlap);
+  return;
+end
+
+if iscell(boxes)
+  pick = cellfun(@(b) nms(b, overlap), boxes, 'UniformOutput', false);
+elseif isempty(boxes)
   pick = [];
 else
   x1 = boxes(:,1);
@@ -0,0 +1,407 @@
+// AUTORIGHTS
+// -------------------------------------------------------
+// Copyright (C) 2011-2012 Ross Girshick
+//
+// This file is part of the voc-releaseX code
+// (http://people.cs.uchicago.edu/~rbg/latent/)
+// and is available under the terms of an MIT-like license
+// provided in COPYING. Please retain this notice and
+// COPYING if you use this file (or a portion of it) in
+// your project.
+// -------------------------------------------------------
+
+#include "mex.h"
+#include <emmintrin.h>
+#include <omp.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/*
+ * Native version of nms.m (greedy non-maximum suppression).
+ *
+ * Same semantics and output as nms.m: boxes are visited in order of
+ * decreasing score (ties: higher row index first, as produced by the
+ * stable ascending sort in nms.m), and a selected box Bi suppresses
+ * every remaining box Bj with |Bi \cap Bj| / |Bj| > overlap.
+ *
+ * The boxes are sorted once and copied into a compact structure of
+ * arrays. After each pick, the remaining boxes are tested two at a
+ * time with SSE2 and the survivors are compacted in place, so later
+ * rounds only touch the boxes that are still alive.
+ *
+ * With the optional grid, each box is registered in the cells of a
+ * uniform grid that it overlaps. A selected box then only tests the
+ * boxes in its own cells (a box that doesn't intersect Bi can't be
+ * suppressed by it). This pays off for large sets of small boxes
+ * spread over the image.
+ */
+
+// Use the grid by default for at least this many boxes
+static const int GRID_MIN_BOXES = 2000;
+
+
+/** -----------------------------------------------------------------
+ ** Boxes of one group
+ **/
+struct box_set {
+  const double *boxes;  // n x cols matrix (see pascal_test.m)
+  int n;
+  int cols;
+};
+
+
+/** -----------------------------------------------------------------
+ ** Sorted boxes (structure of arrays)
+ **/
+struct sorted_boxes {
+  vector<double> x1, y1, x2, y2, area;
+  vector<int> id;       // 0-based row in the input matrix
+  bool finite;          // are all coordinates finite?
+};
+
+
+/** -----------------------------------------------------------------
+ ** Is a visited before b? (decreasing score, then decreasing row;
+ ** NaN scores are visited first, as sort in nms.m puts them last)
+ **/
+struct visit_order {
+  const double *s;
+  bool operator()(int a, int b) const {
+    const bool na = isnan(s[a]), nb = isnan(s[b]);
+    if (na != nb)
+      return na;
+    if (!na && s[a] != s[b])
+      return s[a] > s[b];
+    return a > b;
+  }
+};
+
+
+/** -----------------------------------------------------------------
+ ** Sort the boxes by visiting order
+ **/
+static void sort_boxes(const box_set &B, sorted_boxes &S) {
+  const int n = B.n;
+  const double *X1 = B.boxes;
+  const double *Y1 = B.boxes + n;
+  const double *X2 = B.boxes + 2*n;
+  const double *Y2 = B.boxes + 3*n;
+  visit_order cmp;
+  cmp.s = B.boxes + (B.cols-1)*n;
+
+  S.id.resize(n);
+  for (int i = 0; i < n; i++)
+    S.id[i] = i;
+  sort(S.id.begin(), S.id.end(), cmp);
+
+  S.x1.resize(n);
+  S.y1.resize(n);
+  S.x2.resize(n);
+  S.y2.resize(n);
+  S.area.resize(n);
+  S.finite = true;
+  for (int k = 0; k < n; k++) {
+    const int i = S.id[k];
+    S.x1[k]   = X1[i];
+    S.y1[k]   = Y1[i];
+    S.x2[k]   = X2[i];
+    S.y2[k]   = Y2[i];
+    S.area[k] = (X2[i]-X1[i]+1) * (Y2[i]-Y1[i]+1);
+    if (!isfinite(X1[i]) || !isfinite(Y1[i]) ||
+        !isfinite(X2[i]) || !isfinite(Y2[i]))
+      S.finite = false;
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Does box i (x1, y1, x2, y2) cover box j by more than overlap?
+ ** (same arithmetic as nms.m)
+ **/
+static inline bool covers(double x1, double y1, double x2, double y2,
+                          const sorted_boxes &S, int j, double overlap) {
+  const double w = min(x2, S.x2[j]) - max(x1, S.x1[j]) + 1;
+  const double h = min(y2, S.y2[j]) - max(y1, S.y1[j]) + 1;
+  return w > 0 && h > 0 && w * h / S.area[j] > overlap;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Greedy suppression over the live boxes, compacted after each pick
+ **/
+static void nms_compact(sorted_boxes &S, double overlap, vector<int> &pick) {
+  double *X1 = &S.x1[0], *Y1 = &S.y1[0], *X2 = &S.x2[0], *Y2 = &S.y2[0];
+  double *A  = &S.area[0];
+  int *id    = &S.id[0];
+  int n_live = S.id.size();
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d ov = _mm_set1_pd(overlap);
+
+  while (n_live > 0) {
+    // The first live box has the highest score
+    pick.push_back(id[0]);
+    const double x1 = X1[0], y1 = Y1[0], x2 = X2[0], y2 = Y2[0];
+    const __m128d vx1 = _mm_set1_pd(x1), vy1 = _mm_set1_pd(y1);
+    const __m128d vx2 = _mm_set1_pd(x2), vy2 = _mm_set1_pd(y2);
+
+    // Keep the survivors (writes never pass the boxes being read)
+    int m = 0;
+    int k = 1;
+    for (; k+1 < n_live; k += 2) {
+      const __m128d bx1 = _mm_loadu_pd(X1+k), by1 = _mm_loadu_pd(Y1+k);
+      const __m128d bx2 = _mm_loadu_pd(X2+k), by2 = _mm_loadu_pd(Y2+k);
+      const __m128d ba  = _mm_loadu_pd(A+k);
+      const __m128d w = _mm_add_pd(_mm_sub_pd(_mm_min_pd(bx2, vx2),
+                                              _mm_max_pd(bx1, vx1)), one);
+      const __m128d h = _mm_add_pd(_mm_sub_pd(_mm_min_pd(by2, vy2),
+                                              _mm_max_pd(by1, vy1)), one);
+      const __m128d o = _mm_div_pd(_mm_mul_pd(w, h), ba);
+      const __m128d sup = _mm_and_pd(_mm_and_pd(_mm_cmpgt_pd(w, zero),
+                                                _mm_cmpgt_pd(h, zero)),
+                                     _mm_cmpgt_pd(o, ov));
+      const int mask = _mm_movemask_pd(sup);
+      if (mask == 3)
+        continue;
+      double tx1[2], ty1[2], tx2[2], ty2[2], ta[2];
+      _mm_storeu_pd(tx1, bx1);
+      _mm_storeu_pd(ty1, by1);
+      _mm_storeu_pd(tx2, bx2);
+      _mm_storeu_pd(ty2, by2);
+      _mm_storeu_pd(ta, ba);
+      const int tid[2] = { id[k], id[k+1] };
+      for (int b = 0; b < 2; b++) {
+        if (mask & (1<<b))
+          continue;
+        X1[m] = tx1[b];
+        Y1[m] = ty1[b];
+        X2[m] = tx2[b];
+        Y2[m] = ty2[b];
+        A[m]  = ta[b];
+        id[m] = tid[b];
+        m++;
+      }
+    }
+    for (; k < n_live; k++) {
+      if (covers(x1, y1, x2, y2, S, k, overlap))
+        continue;
+      X1[m] = X1[k];
+      Y1[m] = Y1[k];
+      X2[m] = X2[k];
+      Y2[m] = Y2[k];
+      A[m]  = A[k];
+      id[m] = id[k];
+      m++;
+    }
+    n_live = m;
+  }
+}
+
+
+/** -----------------------------------------------------------------
+ ** Greedy suppression using a uniform grid (coordinates must be
+ ** finite)
+ **/
+static void nms_grid(const sorted_boxes &S, double overlap,
+                     vector<int> &pick) {
+  const int n = S.id.size();
+
+  // Boxes occupy [x1, x2+1) x [y1, y2+1); boxes with an empty extent
+  // can't intersect (or be suppressed by) any other box
+  double xmin = INFINITY, ymin = INFINITY, xmax = -INFINITY, ymax = -INFINITY;
+  double sum_w = 0, sum_h = 0;
+  int num_valid = 0;
+  for (int k = 0; k < n; k++) {
+    const double w = S.x2[k] + 1 - S.x1[k];
+    const double h = S.y2[k] + 1 - S.y1[k];
+    if (w <= 0 || h <= 0)
+      continue;
+    xmin = min(xmin, S.x1[k]);
+    ymin = min(ymin, S.y1[k]);
+    xmax = max(xmax, S.x2[k] + 1);
+    ymax = max(ymax, S.y2[k] + 1);
+    sum_w += w;
+    sum_h += h;
+    num_valid++;
+  }
+
+  // Cells about the size of an average box, and no more than 4 per box
+  double cw = 1, ch = 1;
+  if (num_valid > 0) {
+    cw = sum_w / num_valid;
+    ch = sum_h / num_valid;
+  }
+  double gx = floor((xmax - xmin) / cw) + 1;
+  double gy = floor((ymax - ymin) / ch) + 1;
+  if (num_valid == 0)
+    gx = gy = 1;
+  if (gx*gy > 4.0*n) {
+    const double f = sqrt(gx*gy / (4.0*n));
+    cw *= f;
+    ch *= f;
+    gx = floor((xmax - xmin) / cw) + 1;
+    gy = floor((ymax - ymin) / ch) + 1;
+  }
+  const int grid_w = (int)gx;
+  const int grid_h = (int)gy;
+
+  // Cells covered by box k
+  #define NMS_CELLS(k, cx0, cx1, cy0, cy1)                               \
+    const int cx0 = max(0, (int)floor((S.x1[k] - xmin) / cw));          \
+    const int cx1 = min(grid_w-1, (int)floor((S.x2[k] + 1 - xmin) / cw)); \
+    const int cy0 = max(0, (int)floor((S.y1[k] - ymin) / ch));          \
+    const int cy1 = min(grid_h-1, (int)floor((S.y2[k] + 1 - ymin) / ch));
+
+  // Cell lists in compressed form, each sorted by visiting order
+  vector<int> cell_begin(grid_w*grid_h + 1, 0);
+  for (int k = 0; k < n; k++) {
+    if (!(S.x2[k] + 1 > S.x1[k] && S.y2[k] + 1 > S.y1[k]))
+      continue;
+    NMS_CELLS(k, cx0, cx1, cy0, cy1);
+    for (int cx = cx0; cx <= cx1; cx++)
+      for (int cy = cy0; cy <= cy1; cy++)
+        cell_begin[cx*grid_h + cy + 1]++;
+  }
+  for (int c = 0; c < grid_w*grid_h; c++)
+    cell_begin[c+1] += cell_begin[c];
+  vector<int> cells(cell_begin[grid_w*grid_h]);
+  vector<int> fill_pos(cell_begin.begin(), cell_begin.end() - 1);
+  for (int k = 0; k < n; k++) {
+    if (!(S.x2[k] + 1 > S.x1[k] && S.y2[k] + 1 > S.y1[k]))
+      continue;
+    NMS_CELLS(k, cx0, cx1, cy0, cy1);
+    for (int cx = cx0; cx <= cx1; cx++)
+      for (int cy = cy0; cy <= cy1; cy++)
+        cells[fill_pos[cx*grid_h + cy]++] = k;
+  }
+
+  vector<char> suppressed(n, 0);
+  for (int k = 0; k < n; k++) {
+    if (suppressed[k])
+      continue;
+    pick.push_back(S.id[k]);
+    if (!(S.x2[k] + 1 > S.x1[k] && S.y2[k] + 1 > S.y1[k]))
+      continue;
+    const double x1 = S.x1[k], y1 = S.y1[k], x2 = S.x2[k], y2 = S.y2[k];
+    NMS_CELLS(k, cx0, cx1, cy0, cy1);
+    for (int cx = cx0; cx <= cx1; cx++) {
+      for (int cy = cy0; cy <= cy1; cy++) {
+        const int c = cx*grid_h + cy;
+        // Only boxes after k in visiting order are still undecided
+        const int *p   = upper_bound(&cells[0] + cell_begin[c],
+                                     &cells[0] + cell_begin[c+1], k);
+        const int *end = &cells[0] + cell_begin[c+1];
+        for (; p < end; p++)
+          if (!suppressed[*p] && covers(x1, y1, x2, y2, S, *p, overlap))
+            suppressed[*p] = 1;
+      }
+    }
+  }
+  #undef NMS_CELLS
+}
+
+
+/** -----------------------------------------------------------------
+ ** Non-maximum suppression for one group of boxes
+ ** (use_grid: 1 => yes, 0 => no, -1 => decide by the number of boxes)
+ **/
+static void nms(const box_set &B, double overlap, int use_grid,
+                vector<int> &pick) {
+  pick.clear();
+  if (B.n == 0)
+    return;
+  sorted_boxes S;
+  sort_boxes(B, S);
+  if (use_grid < 0)
+    use_grid = (B.n >= GRID_MIN_BOXES);
+  if (use_grid && S.finite)
+    nms_grid(S, overlap, pick);
+  else
+    nms_compact(S, overlap, pick);
+}
+
+
+/** -----------------------------------------------------------------
+ ** Read a boxes matrix
+ **/
+static box_set read_boxes(const mxArray *mx_boxes) {
+  box_set B;
+  B.boxes = NULL;
+  B.n     = 0;
+  B.cols  = 0;
+  if (mx_boxes == NULL || mxIsEmpty(mx_boxes))
+    return B;
+  if (mxGetClassID(mx_boxes) != mxDOUBLE_CLASS)
+    mexErrMsgTxt("Invalid input: boxes must be double precision");
+  B.boxes = mxGetPr(mx_boxes);
+  B.n     = mxGetM(mx_boxes);
+  B.cols  = mxGetN(mx_boxes);
+  if (B.cols < 4)
+    mexErrMsgTxt("Invalid input: boxes must have at least 4 columns");
+  return B;
+}
+
+
+/** -----------------------------------------------------------------
+ ** Create the output for one group (1-based indices; [] if no boxes)
+ **/
+static mxArray *create_pick(const box_set &B, const vector<int> &pick) {
+  if (B.n == 0)
+    return mxCreateDoubleMatrix(0, 0, mxREAL);
+  mxArray *mx_pick = mxCreateDoubleMatrix(pick.size(), 1, mxREAL);
+  double *p = mxGetPr(mx_pick);
+  for (int i = 0; i < (int)pick.size(); i++)
+    p[i] = pick[i] + 1;
+  return mx_pick;
+}
+
+
+// matlab entry point
+//                    0      1        2
+// pick = nms_mex(boxes, overlap, use_grid)
+// boxes      detection bounding boxes (see nms.m), or a cell array of
+//            them (e.g., one per class or image); the cells are
+//            processed in parallel and pick is a cell array of the
+//            same size
+// overlap    overlap threshold for suppression (see nms.m)
+// use_grid   use the uniform grid (optional; true, false or [] => use
+//            it for large sets of boxes)
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 2 || nrhs > 3)
+    mexErrMsgTxt("Wrong number of inputs");
+  if (nlhs > 1)
+    mexErrMsgTxt("Wrong number of outputs");
+
+  const double overlap = mxGetScalar(prhs[1]);
+  int use_grid = -1;
+  if (nrhs > 2 && !mxIsEmpty(prhs[2]))
+    use_grid = (mxGetScalar(prhs[2]) != 0);
+
+  if (!mxIsCell(prhs[0])) {
+    const box_set B = read_boxes(prhs[0]);
+    vector<int> pick;
+    nms(B, overlap, use_grid, pick);
+    plhs[0] = create_pick(B, pick);
+    return;
+  }
+
+  // Batched form
+  const int num_groups = mxGetNumberOfElements(prhs[0]);
+  vector<box_set> groups(num_groups);
+  for (int g = 0; g < num_groups; g++)
+    groups[g] = read_boxes(mxGetCell(prhs[0], g));
+
+  vector<vector<int> > picks(num_groups);
+  #pragma omp parallel for schedule(dynamic)
+  for (int g = 0; g < num_groups; g++)
+    nms(groups[g], overlap, use_grid, picks[g]);
+
+  mxArray *mx_picks = mxCreateCellArray(mxGetNumberOfDimensions(prhs[0]),
+                                        mxGetDimensions(prhs[0]));
+  for (int g = 0; g < num_groups; g++)
+    mxSetCell(mx_picks, g, create_pick(groups[g], picks[g]));
+  plhs[0] = mx_picks;
+}
@@ -9,7 +9,9 @@ function [ap, prec, recall] = pascal_eval(cls, ds, testset, year, suffix)
 %
 % Arguments
 %   cls       Object class to evaluate
-%   ds        Detection windows returned by pascal_test.m
+%   ds        Detection windows returned by pascal_test.m, or the
+%             filename of a detection log written by pascal_test.m
+%             (requires detlog)
 %   testset   Test set to evaluate against (e.g., 'val', 'test')
 %   year      Test set year to use  (e.g., '2007', '2011')
 %   suffix    Results are saved to a file named:
@@ -36,14 +38,19 @@ VOCopts  = conf.pascal.VOCopts;
 ids = textread(sprintf(VOCopts.imgsetpath, testset), '%s');
 
 % write out detections in PASCAL format and score
-fid = fopen(sprintf(VOCopts.detrespath, 'comp3', cls), 'w');
-for i = 1:length(ids);
-  bbox = ds{i};
-  for j = 1:size(bbox,1)
-    fprintf(fid, '%s %f %d %d %d %d\n', ids{i}, bbox(j,end), bbox(j,1:4));
+if ischar(ds)
+  % read the detection log directly
+  detlog('write_voc', ds, ids, sprintf(VOCopts.detrespath, 'comp3', cls));
+else
+  fid = fopen(sprintf(VOCopts.detrespath, 'comp3', cls), 'w');
+  for i = 1:length(ids);
+    bbox = ds{i};
+    for j = 1:size(bbox,1)
+      fprintf(fid, '%s %f %d %d %d %d\n', ids{i}, bbox(j,end), bbox(j,1:4));
+    end
   end
+  fclose(fid);
 end
-fclose(fid);
 
 recall = [];
 prec = [];
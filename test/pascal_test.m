@@ -16,6 +16,10 @@ function ds = pascal_test(model, testset, year, suffix)
 %
 %   We also save the bounding boxes of each filter (include root filters)
 %   and the unclipped detection window in ds
+%
+%   If detlog has been compiled, the detections are also kept in the 
+%   binary log [model.class '_boxes_' testset '_' suffix '.detlog'],
+%   which pascal_eval.m can read directly.
 
 % AUTORIGHTS
 % -------------------------------------------------------
@@ -45,57 +49,92 @@ catch
   % parfor gets confused if we use VOCopts
   opts = VOCopts;
   num_ids = length(ids);
-  ds_out = cell(1, num_ids);
-  bs_out = cell(1, num_ids);
+
+  % If detlog has been compiled, detections are appended to a log as
+  % each image is finished, so an interrupted run resumes with the
+  % images that are not in the log yet
+  logfile = [cachedir cls '_boxes_' testset '_' suffix '.detlog'];
+  use_log = (exist('detlog') == 3);  % 3 ==> MEX function
+  if use_log
+    done = detlog('done', logfile, num_ids);
+  else
+    done = false(1, num_ids);
+  end
+  todo = find(~done);
+  num_todo = length(todo);
+  ds_todo = cell(1, num_todo);
+  bs_todo = cell(1, num_todo);
   th = tic();
-  parfor i = 1:num_ids;
+  parfor k = 1:num_todo
+    i = todo(k);
     fprintf('%s: testing: %s %s, %d/%d\n', cls, testset, year, ...
             i, num_ids);
-    if strcmp('inriaperson', cls)
-      % INRIA uses a mixutre of PNGs and JPGs, so we need to use the annotation
-      % to locate the image.  The annotation is not generally available for PASCAL
-      % test data (e.g., 2009 test), so this method can fail for PASCAL.
-      rec = PASreadrecord(sprintf(opts.annopath, ids{i}));
-      im = imread([opts.datadir rec.imgname]);
-    else
-      im = imread(sprintf(opts.imgpath, ids{i}));  
-    end
-    [ds, bs] = imgdetect(im, model, model.thresh);
-    if ~isempty(bs)
-      unclipped_ds = ds(:,1:4);
-      [ds, bs, rm] = clipboxes(im, ds, bs);
-      unclipped_ds(rm,:) = [];
-
-      % NMS
-      I = nms(ds, 0.5);
-      ds = ds(I,:);
-      bs = bs(I,:);
-      unclipped_ds = unclipped_ds(I,:);
-
+    [ds, bs] = detect_image(model, opts, ids{i});
+    if use_log
+      detlog('append', logfile, i, ds, bs);
+    elseif ~isempty(ds)
       % Save detection windows in boxes
-      ds_out{i} = ds(:,[1:4 end]);
-
-      % Save filter boxes in parts
-      if model.type == model_types.MixStar
-        % Use the structure of a mixture of star models 
-        % (with a fixed number of parts) to reduce the 
-        % size of the bounding box matrix
-        bs = reduceboxes(model, bs);
-        bs_out{i} = bs;
-      else
-        % We cannot apply reduceboxes to a general grammar model
-        % Record unclipped detection window and all filter boxes
-        bs_out{i} = cat(2, unclipped_ds, bs);
-      end
-    else
-      ds_out{i} = [];
-      bs_out{i} = [];
+      ds_todo{k} = ds(:,[1:4 end]);
+      bs_todo{k} = bs;
     end
   end
   th = toc(th);
-  ds = ds_out;
-  bs = bs_out;
+  if use_log
+    [ds, bs] = detlog('read', logfile, num_ids);
+  else
+    ds = ds_todo;
+    bs = bs_todo;
+  end
   save([cachedir cls '_boxes_' testset '_' suffix], ...
        'ds', 'bs', 'th');
   fprintf('Testing took %.4f seconds\n', th);
 end
+
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+% detect objects in one image
+function [ds, bs] = detect_image(model, opts, id)
+% model  model to test
+% opts   VOCopts
+% id     image id
+%
+% ds     clipped detections after NMS (as returned by imgdetect)
+% bs     filter boxes to save (see above)
+
+cls = model.class;
+if strcmp('inriaperson', cls)
+  % INRIA uses a mixutre of PNGs and JPGs, so we need to use the annotation
+  % to locate the image.  The annotation is not generally available for PASCAL
+  % test data (e.g., 2009 test), so this method can fail for PASCAL.
+  rec = PASreadrecord(sprintf(opts.annopath, id));
+  im = imread([opts.datadir rec.imgname]);
+else
+  im = imread(sprintf(opts.imgpath, id));  
+end
+[ds, bs] = imgdetect(im, model, model.thresh);
+if ~isempty(bs)
+  unclipped_ds = ds(:,1:4);
+  [ds, bs, rm] = clipboxes(im, ds, bs);
+  unclipped_ds(rm,:) = [];
+
+  % NMS
+  I = nms(ds, 0.5);
+  ds = ds(I,:);
+  bs = bs(I,:);
+  unclipped_ds = unclipped_ds(I,:);
+
+  % Save filter boxes in parts
+  if model.type == model_types.MixStar
+    % Use the structure of a mixture of star models 
+    % (with a fixed number of parts) to reduce the 
+    % size of the bounding box matrix
+    bs = reduceboxes(model, bs);
+  else
+    % We cannot apply reduceboxes to a general grammar model
+    % Record unclipped detection window and all filter boxes
+    bs = cat(2, unclipped_ds, bs);
+  end
+else
+  ds = [];
+  bs = [];
+end
@@ -73,7 +73,8 @@ if ~cont
   % a maximum byte size of single_byte_size*max_dim
   [max_dim, max_nbls] = max_fv_dim(model);
   max_num = ceil(bytelimit / (conf.single_byte_size*max_dim));
-  fv_cache('init', max_num, max_dim, max_nbls);
+  fv_cache('init', max_num, max_dim, max_nbls, [], ...
+           conf.training.fv_storage);
 end
 
 [blocks, lb, rm, lm, cmps] = fv_model_args(model);
@@ -284,6 +285,11 @@ for t = 1:iter
 
       % Output history of the objective function value on the cache
       cache(tneg,:) = [nl pl rt nl+pl+rt];
+      % (models saved before cache_obj was added don't have the field)
+      if ~isfield(model.stats, 'cache_obj')
+        model.stats.cache_obj = [];
+      end
+      model.stats.cache_obj = [model.stats.cache_obj; cache(tneg,:)];
       for tt = 1:tneg
         fprintf('Cache objective: bg: %.6f, fg: %.6f, reg: %.6f, total: %.6f\n', ...
                 cache(tt,1), cache(tt,2), cache(tt,3), cache(tt,4));
@@ -181,6 +181,8 @@ conf = cv(conf, 'training.C', 0.001);
 conf = cv(conf, 'training.bias_feature', 10);
 % File size limit for the feature vector cache (2^30 bytes = 1GB)
 conf = cv(conf, 'training.cache_byte_limit', 3*2^30);
+% Feature vector storage in the cache ('single' or 'half')
+conf = cv(conf, 'training.fv_storage', 'single');
 % Location of training log (matlab diary)
 conf.training.log = @(x) sprintf([conf.paths.model_dir '%s.log'], x);
 